@@ -11,6 +11,13 @@ expr
     | expr (ADD | SUB) expr  # BinaryOp
     | CELL  # Cell
     | NUMBER  # Literal
+    | NAME '(' arg (',' arg)* ')'  # Call
+    ;
+
+// functions aggregate over ranges as well as over single values
+arg
+    : CELL ':' CELL  # Range
+    | expr  # Argument
     ;
 
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
@@ -26,5 +33,8 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
-CELL: [A-Z]+[0-9]+ ;
+// '$' makes the column or the row absolute, as in $A$1
+CELL: '$'? [A-Z]+ '$'? [0-9]+ ;
+// SUM, AVERAGE, MIN, MAX or COUNT; other names are rejected by the parser
+NAME: [A-Z]+ ;
 WS: [ \t\n\r]+ -> skip ;
@@ -4,14 +4,188 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
+#include <climits>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iterator>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <string_view>
 
 namespace ASTImpl {
 
+Program::Program(std::pmr::memory_resource* resource)
+    : code_(resource)
+    , constants_(resource)
+    , starts_(resource)
+    , call_starts_(resource)
+    , invariant_starts_(resource)
+    , invariant_ends_(resource) {
+}
+
+void Program::PushNumber(double value) {
+    PushOperand({OpCode::PushNumber, static_cast<uint32_t>(constants_.size())});
+    constants_.push_back(value);
+}
+
+void Program::LoadCell(const CellReference& cell) {
+    PushOperand({OpCode::LoadCell, cell.pos.Pack() | (cell.absolute_row ? ABSOLUTE_ROW : 0)
+                                       | (cell.absolute_col ? ABSOLUTE_COL : 0)});
+}
+
+namespace {
+
+double Calculate(OpCode code, double lhs, double rhs) {
+    switch (code) {
+        case OpCode::Add:
+            return lhs + rhs;
+        case OpCode::Subtract:
+            return lhs - rhs;
+        case OpCode::Multiply:
+            return lhs * rhs;
+        case OpCode::Divide:
+            return lhs / rhs;
+        default:
+            assert(false);
+            return 0;
+    }
+}
+
+}  // namespace
+
+void Program::Apply(OpCode code) {
+    const size_t operand = starts_.back();
+    if (code == OpCode::Negate) {
+        if (auto value = GetConstant(operand, code_.size())) {
+            constants_[code_[operand].operand] = -*value;
+        } else if (code_.back().code == OpCode::Negate) {
+            code_.pop_back();
+        } else {
+            code_.push_back({code});
+        }
+        return;
+    }
+
+    starts_.pop_back();
+    const size_t lhs = starts_.back();
+    const size_t rhs = operand;
+    const auto lhs_value = GetConstant(lhs, rhs);
+    const auto rhs_value = GetConstant(rhs, code_.size());
+
+    if (lhs_value && rhs_value) {
+        const double result = Calculate(code, *lhs_value, *rhs_value);
+        if (std::isfinite(result)) {
+            EraseConstant(rhs);
+            EraseConstant(lhs);
+            code_.push_back({OpCode::PushNumber, static_cast<uint32_t>(constants_.size())});
+            constants_.push_back(result);
+            return;
+        }
+    } else if (rhs_value && ((code == OpCode::Multiply && *rhs_value == 1.0)
+                             || (code == OpCode::Divide && *rhs_value == 1.0)
+                             || (code == OpCode::Subtract && *rhs_value == 0.0 && !std::signbit(*rhs_value)))) {
+        EraseConstant(rhs);
+        return;
+    } else if (lhs_value && code == OpCode::Multiply && *lhs_value == 1.0) {
+        EraseConstant(lhs);
+        return;
+    }
+    code_.push_back({code});
+}
+
+void Program::BeginAggregate(Function function) {
+    call_starts_.push_back(static_cast<uint32_t>(code_.size()));
+    code_.push_back({OpCode::BeginAggregate, static_cast<uint32_t>(function)});
+    max_aggregate_depth_ = std::max(max_aggregate_depth_, call_starts_.size());
+}
+
+void Program::Aggregate() {
+    starts_.pop_back();
+    code_.push_back({OpCode::Aggregate});
+}
+
+void Program::AggregateRange(uint32_t range_index) {
+    code_.push_back({OpCode::AggregateRange, range_index});
+}
+
+void Program::EndAggregate(Function function) {
+    // the whole call is one operand, it never looks like a constant
+    starts_.push_back(call_starts_.back());
+    call_starts_.pop_back();
+    code_.push_back({OpCode::EndAggregate, static_cast<uint32_t>(function)});
+    max_depth_ = std::max(max_depth_, starts_.size());
+}
+
+void Program::StoreTemp(uint32_t temp) {
+    code_.push_back({OpCode::StoreTemp, temp});
+    temp_count_ = std::max<size_t>(temp_count_, temp + 1);
+}
+
+void Program::LoadTemp(uint32_t temp) {
+    PushOperand({OpCode::LoadTemp, temp});
+}
+
+void Program::BeginInvariant(uint32_t temp) {
+    invariant_starts_.push_back(static_cast<uint32_t>(code_.size()));
+    code_.push_back({OpCode::BeginInvariant, temp});
+    temp_count_ = std::max<size_t>(temp_count_, temp + 1);
+}
+
+void Program::EndInvariant(uint32_t temp) {
+    // the value starts with BeginInvariant, so it never looks like a constant
+    starts_.back() = invariant_starts_.back();
+    invariant_starts_.pop_back();
+    code_.push_back({OpCode::EndInvariant, temp});
+}
+
+void Program::Finish() {
+    starts_.clear();
+    starts_.shrink_to_fit();
+    call_starts_.clear();
+    call_starts_.shrink_to_fit();
+    invariant_starts_.clear();
+    invariant_starts_.shrink_to_fit();
+
+    // found only now, since folding may have moved the code
+    for (size_t i = 0; i < code_.size(); ++i) {
+        if (code_[i].code == OpCode::EndInvariant) {
+            if (invariant_ends_.empty()) {
+                invariant_ends_.resize(temp_count_);
+            }
+            invariant_ends_[code_[i].operand] = static_cast<uint32_t>(i + 1);
+        }
+    }
+}
+
+void Program::PushOperand(Instruction instruction) {
+    starts_.push_back(static_cast<uint32_t>(code_.size()));
+    code_.push_back(instruction);
+    max_depth_ = std::max(max_depth_, starts_.size());
+}
+
+// The value of code_[first, last) if it is a single constant
+std::optional<double> Program::GetConstant(size_t first, size_t last) const {
+    if (last - first != 1 || code_[first].code != OpCode::PushNumber) {
+        return std::nullopt;
+    }
+    return constants_[code_[first].operand];
+}
+
+// Removes the push at the index; its slot in constants_ is reclaimed when
+// it is the last one
+void Program::EraseConstant(size_t index) {
+    if (code_[index].operand + 1 == constants_.size()) {
+        constants_.pop_back();
+    }
+    code_.erase(code_.begin() + index);
+}
+
 enum ExprPrecedence {
     EP_ADD,
     EP_SUB,
@@ -66,73 +240,160 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
     /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
-class Expr {
+namespace {
+
+const char* ToString(Function function) {
+    switch (function) {
+        case Function::Sum:
+            return "SUM";
+        case Function::Average:
+            return "AVERAGE";
+        case Function::Min:
+            return "MIN";
+        case Function::Max:
+            return "MAX";
+        case Function::Count:
+            return "COUNT";
+        default:
+            assert(false);
+            return "";
+    }
+}
+
+std::optional<Function> ReadFunction(std::string_view name) {
+    for (auto function : {Function::Sum, Function::Average, Function::Min, Function::Max, Function::Count}) {
+        if (name == ToString(function)) {
+            return function;
+        }
+    }
+    return std::nullopt;
+}
+
+OpCode GetOpCode(char op) {
+    switch (op) {
+        case '+':
+            return OpCode::Add;
+        case '-':
+            return OpCode::Subtract;
+        case '*':
+            return OpCode::Multiply;
+        case '/':
+            return OpCode::Divide;
+        default:
+            assert(false);
+            return OpCode::Add;
+    }
+}
+
+// A reference moves when it is printed or evaluated at an offset, unless
+// every part of it is absolute
+bool Moves(const CellReference& cell) {
+    return !cell.absolute_row || !cell.absolute_col;
+}
+
+bool Moves(const RangeReference& range) {
+    return Moves(range.first) || Moves(range.last);
+}
+
+// The node array of a formula with the references its nodes point to
+class Tree {
 public:
-    virtual ~Expr() = default;
-    virtual void Print(std::ostream& out) const = 0;
-    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(std::function<CellInterface*(Position)> get_cell_func) const = 0;
+    Tree(const Node* nodes, const CellReference* cells, const RangeReference* ranges)
+        : nodes_(nodes)
+        , cells_(cells)
+        , ranges_(ranges) {
+    }
 
-    // higher is tighter
-    virtual ExprPrecedence GetPrecedence() const = 0;
+    void Print(uint32_t index, std::ostream& out) const {
+        const Node& node = nodes_[index];
+        switch (node.type) {
+            case Node::Type::Binary:
+                out << '(' << node.op << ' ';
+                Print(node.children[0], out);
+                out << ' ';
+                Print(node.children[1], out);
+                out << ')';
+                break;
+            case Node::Type::Unary:
+                out << '(' << node.op << ' ';
+                Print(node.children[0], out);
+                out << ')';
+                break;
+            case Node::Type::Number:
+                out << node.number;
+                break;
+            case Node::Type::Cell:
+                out << cells_[node.children[0]].ToString();
+                break;
+            case Node::Type::Range:
+                out << ranges_[node.children[0]].ToString();
+                break;
+            case Node::Type::Call:
+                out << '(' << ToString(static_cast<Function>(node.op));
+                for (uint32_t arg = node.children[0]; arg < node.children[0] + node.children[1]; ++arg) {
+                    out << ' ';
+                    Print(arg, out);
+                }
+                out << ')';
+                break;
+            case Node::Type::Argument:
+                Print(node.children[0], out);
+                break;
+        }
+    }
+
+    // Makes PrintFormula() append the slots of the references that move
+    void RecordSlots(std::pmr::vector<FormulaAST::ReferenceSlot>* slots) {
+        slots_ = slots;
+    }
 
-    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+    void PrintFormula(uint32_t index, std::ostream& out, ExprPrecedence parent_precedence, Position offset,
                       bool right_child = false) const {
-        auto precedence = GetPrecedence();
+        auto precedence = GetPrecedence(nodes_[index]);
         auto mask = right_child ? PR_RIGHT : PR_LEFT;
         bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
         if (parens_needed) {
             out << '(';
         }
 
-        DoPrintFormula(out, precedence);
+        DoPrintFormula(index, out, precedence, offset);
 
         if (parens_needed) {
             out << ')';
         }
     }
-};
-
-namespace {
-class BinaryOpExpr final : public Expr {
-public:
-    enum Type : char {
-        Add = '+',
-        Subtract = '-',
-        Multiply = '*',
-        Divide = '/',
-    };
-
-public:
-    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
-        : type_(type)
-        , lhs_(std::move(lhs))
-        , rhs_(std::move(rhs)) {
-    }
-
-    void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        lhs_->Print(out);
-        out << ' ';
-        rhs_->Print(out);
-        out << ')';
-    }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        lhs_->PrintFormula(out, precedence);
-        out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+private:
+    const Node* nodes_;
+    const CellReference* cells_;
+    const RangeReference* ranges_;
+    std::pmr::vector<FormulaAST::ReferenceSlot>* slots_ = nullptr;
+
+    void PrintReference(std::ostream& out, const std::string& text, uint32_t index, bool is_range,
+                        bool moves) const {
+        if (slots_ != nullptr && moves) {
+            const auto begin = static_cast<uint32_t>(out.tellp());
+            slots_->push_back({begin, static_cast<uint32_t>(text.size()), index, is_range});
+        }
+        out << text;
     }
 
-    ExprPrecedence GetPrecedence() const override {
-        switch (type_) {
-            case Add:
+    // higher is tighter
+    static ExprPrecedence GetPrecedence(const Node& node) {
+        if (node.type == Node::Type::Unary) {
+            return EP_UNARY;
+        }
+        if (node.type != Node::Type::Binary) {
+            return EP_ATOM;
+        }
+        switch (node.op) {
+            case '+':
                 return EP_ADD;
-            case Subtract:
+            case '-':
                 return EP_SUB;
-            case Multiply:
+            case '*':
                 return EP_MUL;
-            case Divide:
+            case '/':
                 return EP_DIV;
             default:
                 assert(false);
@@ -140,243 +401,808 @@ public:
         }
     }
 
-    double Evaluate(std::function<CellInterface*(Position)> get_cell_func) const override {
-        switch (type_) {
-            case Add: {
-                auto res = lhs_->Evaluate(get_cell_func) + rhs_->Evaluate(get_cell_func);
-                if (!std::isfinite(res)) {
-                    throw FormulaError(FormulaError::Category::Div0);
-                } else {
-                    return res;
-                }  
+    void DoPrintFormula(uint32_t index, std::ostream& out, ExprPrecedence precedence, Position offset) const {
+        const Node& node = nodes_[index];
+        switch (node.type) {
+            case Node::Type::Binary:
+                PrintFormula(node.children[0], out, precedence, offset);
+                out << node.op;
+                PrintFormula(node.children[1], out, precedence, offset, /* right_child = */ true);
+                break;
+            case Node::Type::Unary:
+                out << node.op;
+                PrintFormula(node.children[0], out, precedence, offset);
+                break;
+            case Node::Type::Number:
+                out << node.number;
+                break;
+            case Node::Type::Cell: {
+                const CellReference& cell = cells_[node.children[0]];
+                PrintReference(out, cell.ToString(offset), node.children[0], false, Moves(cell));
+                break;
             }
-            case Subtract: {
-                auto res = lhs_->Evaluate(get_cell_func) - rhs_->Evaluate(get_cell_func);
-                if (!std::isfinite(res)) {
-                    throw FormulaError(FormulaError::Category::Div0);
-                } else {
-                    return res;
-                }  
+            case Node::Type::Range: {
+                const RangeReference& range = ranges_[node.children[0]];
+                PrintReference(out, range.ToString(offset), node.children[0], true, Moves(range));
+                break;
             }
-            case Multiply: {
-                auto res = lhs_->Evaluate(get_cell_func) * rhs_->Evaluate(get_cell_func);
-                if (!std::isfinite(res)) {
-                    throw FormulaError(FormulaError::Category::Div0);
-                } else {
-                    return res;
-                }  
+            case Node::Type::Call:
+                out << ToString(static_cast<Function>(node.op)) << '(';
+                for (uint32_t arg = node.children[0]; arg < node.children[0] + node.children[1]; ++arg) {
+                    if (arg != node.children[0]) {
+                        out << ',';
+                    }
+                    // the arguments are delimited, none of them needs parens
+                    PrintFormula(nodes_[arg].children[0], out, EP_ATOM, offset);
+                }
+                out << ')';
+                break;
+            case Node::Type::Argument:
+                PrintFormula(node.children[0], out, precedence, offset);
+                break;
+        }
+    }
+};
+
+// Appends the postfix code of a tree. A value that appears more than once
+// is computed where it first appears and loaded from a temporary elsewhere.
+// Invariant values that take some work to compute are marked, see
+// Program::BeginInvariant(): the largest ones and the repeated ones.
+class Compiler {
+public:
+    Compiler(const Node* nodes, size_t count, const CellReference* cells, const RangeReference* ranges)
+        : nodes_(nodes)
+        , cells_(cells)
+        , ranges_(ranges)
+        , info_(count) {
+        Number(count);
+    }
+
+    void Compile(uint32_t root, Program& program) {
+        Plan(root, false);
+        Emit(root, program);
+    }
+
+private:
+    static constexpr uint32_t NO_TEMP = UINT32_MAX;
+
+    // what a node is made of: equal subtrees get equal keys
+    struct Key {
+        uint64_t first;
+        uint64_t second;
+        uint32_t tag;
+
+        bool operator==(const Key& other) const {
+            return first == other.first && second == other.second && tag == other.tag;
+        }
+    };
+
+    struct NodeInfo {
+        // equal for equal subtrees
+        uint32_t id = 0;
+        // no moving reference below
+        bool invariant = true;
+        // folded to a number, see Program
+        bool constant = false;
+    };
+
+    struct IdInfo {
+        uint32_t temp = NO_TEMP;
+        bool seen = false;
+        bool needs_temp = false;
+    };
+
+    const Node* nodes_;
+    const CellReference* cells_;
+    const RangeReference* ranges_;
+    std::vector<NodeInfo> info_;
+    std::vector<IdInfo> ids_;
+    uint32_t temp_count_ = 0;
+
+    static uint64_t Pack(const CellReference& cell) {
+        return cell.pos.Pack() | (cell.absolute_row ? Program::ABSOLUTE_ROW : 0)
+               | (cell.absolute_col ? Program::ABSOLUTE_COL : 0);
+    }
+
+    // Gives every node an id; children come first in the array
+    void Number(size_t count) {
+        // open addressing over the keys, at most one per node and one per
+        // argument chain link
+        std::vector<Key> keys;
+        keys.reserve(count * 2);
+        size_t capacity = 16;
+        while (capacity < count * 4) {
+            capacity *= 2;
+        }
+        std::vector<uint32_t> slots(capacity, NO_TEMP);
+        auto intern = [&keys, &slots](const Key& key) {
+            size_t slot = (key.first * 0x9E3779B97F4A7C15ull ^ key.second * 0xC2B2AE3D27D4EB4Full ^ key.tag)
+                          & (slots.size() - 1);
+            while (slots[slot] != NO_TEMP && !(keys[slots[slot]] == key)) {
+                slot = (slot + 1) & (slots.size() - 1);
             }
-            case Divide: {
-                auto res = lhs_->Evaluate(get_cell_func) / rhs_->Evaluate(get_cell_func);
-                if (!std::isfinite(res)) {
-                    throw FormulaError(FormulaError::Category::Div0);
-                } else {
-                    return res;
+            if (slots[slot] == NO_TEMP) {
+                slots[slot] = static_cast<uint32_t>(keys.size());
+                keys.push_back(key);
+            }
+            return slots[slot];
+        };
+        for (size_t i = 0; i < count; ++i) {
+            const Node& node = nodes_[i];
+            const uint32_t tag = static_cast<uint32_t>(node.type) << 8 | static_cast<uint8_t>(node.op);
+            Key key{0, 0, tag};
+            NodeInfo& info = info_[i];
+            switch (node.type) {
+                case Node::Type::Binary: {
+                    const NodeInfo& lhs = info_[node.children[0]];
+                    const NodeInfo& rhs = info_[node.children[1]];
+                    key = {lhs.id, rhs.id, tag};
+                    info.invariant = lhs.invariant && rhs.invariant;
+                    info.constant = lhs.constant && rhs.constant;
+                    break;
+                }
+                case Node::Type::Unary:
+                    key = {info_[node.children[0]].id, 0, tag};
+                    info.invariant = info_[node.children[0]].invariant;
+                    info.constant = info_[node.children[0]].constant;
+                    break;
+                case Node::Type::Argument:
+                    key = {info_[node.children[0]].id, 0, tag};
+                    info.invariant = info_[node.children[0]].invariant;
+                    break;
+                case Node::Type::Number:
+                    std::memcpy(&key.first, &node.number, sizeof(double));
+                    info.constant = true;
+                    break;
+                case Node::Type::Cell:
+                    key = {Pack(cells_[node.children[0]]), 0, tag};
+                    info.invariant = !Moves(cells_[node.children[0]]);
+                    break;
+                case Node::Type::Range: {
+                    const RangeReference& range = ranges_[node.children[0]];
+                    key = {Pack(range.first), Pack(range.last), tag};
+                    info.invariant = !Moves(range);
+                    break;
                 }
+                case Node::Type::Call: {
+                    // the arguments are chained one by one
+                    uint64_t chain = UINT64_MAX;
+                    for (uint32_t arg = node.children[0]; arg < node.children[0] + node.children[1]; ++arg) {
+                        chain = intern({info_[arg].id, chain, UINT32_MAX});
+                        info.invariant = info.invariant && info_[arg].invariant;
+                    }
+                    key = {chain, node.children[1], tag};
+                    break;
+                }
+            }
+            info.id = intern(key);
+        }
+        ids_.resize(keys.size());
+    }
+
+    // Worth keeping in a temporary: it loads a cell or computes something
+    // that is not folded to a constant
+    bool IsWorthKeeping(uint32_t index) const {
+        switch (nodes_[index].type) {
+            case Node::Type::Cell:
+                return true;
+            case Node::Type::Binary:
+            case Node::Type::Unary:
+            case Node::Type::Call:
+                return !info_[index].constant;
+            default:
+                return false;
+        }
+    }
+
+    // Walks the tree in the order Emit() does, skipping what it will load
+    // from temporaries, and picks the values to keep
+    void Plan(uint32_t index, bool parent_invariant) {
+        const Node& node = nodes_[index];
+        const bool invariant = info_[index].invariant;
+        IdInfo& id = ids_[info_[index].id];
+        if (IsWorthKeeping(index)) {
+            if (id.seen) {
+                id.needs_temp = true;
+                return;
+            }
+            id.seen = true;
+            if (invariant && !parent_invariant && node.type != Node::Type::Cell) {
+                id.needs_temp = true;
             }
+        }
+        switch (node.type) {
+            case Node::Type::Binary:
+                Plan(node.children[0], invariant);
+                Plan(node.children[1], invariant);
+                break;
+            case Node::Type::Unary:
+                Plan(node.children[0], invariant);
+                break;
+            case Node::Type::Call:
+                for (uint32_t arg = node.children[0]; arg < node.children[0] + node.children[1]; ++arg) {
+                    Plan(nodes_[arg].children[0], invariant);
+                }
+                break;
             default:
-                // have to do this because VC++ has a buggy warning
+                break;
+        }
+    }
+
+    void Emit(uint32_t index, Program& program) {
+        IdInfo& id = ids_[info_[index].id];
+        if (!id.needs_temp) {
+            EmitNode(index, program);
+        } else if (id.temp != NO_TEMP) {
+            program.LoadTemp(id.temp);
+        } else if (info_[index].invariant && nodes_[index].type != Node::Type::Cell) {
+            // a memo may skip this code, so temporaries set inside are
+            // invariant as well and kept in the memo
+            const uint32_t temp = id.temp = temp_count_++;
+            program.BeginInvariant(temp);
+            EmitNode(index, program);
+            program.EndInvariant(temp);
+        } else {
+            const uint32_t temp = id.temp = temp_count_++;
+            EmitNode(index, program);
+            program.StoreTemp(temp);
+        }
+    }
+
+    void EmitNode(uint32_t index, Program& program) {
+        const Node& node = nodes_[index];
+        switch (node.type) {
+            case Node::Type::Binary:
+                Emit(node.children[0], program);
+                Emit(node.children[1], program);
+                program.Apply(GetOpCode(node.op));
+                break;
+            case Node::Type::Unary:
+                Emit(node.children[0], program);
+                if (node.op == '-') {
+                    program.Apply(OpCode::Negate);
+                }
+                break;
+            case Node::Type::Number:
+                program.PushNumber(node.number);
+                break;
+            case Node::Type::Cell:
+                program.LoadCell(cells_[node.children[0]]);
+                break;
+            case Node::Type::Call:
+                program.BeginAggregate(static_cast<Function>(node.op));
+                for (uint32_t arg = node.children[0]; arg < node.children[0] + node.children[1]; ++arg) {
+                    EmitArgument(nodes_[arg].children[0], program);
+                }
+                program.EndAggregate(static_cast<Function>(node.op));
+                break;
+            default:
+                // ranges and arguments only appear in calls
                 assert(false);
-                return 0;
         }
     }
 
-private:
-    Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
+    // appends the code adding the subtree to the aggregate of a call
+    void EmitArgument(uint32_t index, Program& program) {
+        const Node& node = nodes_[index];
+        if (node.type == Node::Type::Range) {
+            program.AggregateRange(node.children[0]);
+        } else {
+            Emit(index, program);
+            program.Aggregate();
+        }
+    }
 };
 
-class UnaryOpExpr final : public Expr {
+// Appends the nodes of a formula as its parser completes them, children
+// before their parents
+class TreeBuilder {
 public:
-    enum Type : char {
-        UnaryPlus = '+',
-        UnaryMinus = '-',
-    };
+    explicit TreeBuilder(std::pmr::memory_resource* resource)
+        : nodes_(resource)
+        , cells_(resource)
+        , ranges_(resource) {
+    }
 
-public:
-    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
-        : type_(type)
-        , operand_(std::move(operand)) {
+    uint32_t AddNumber(double value) {
+        Node node{Node::Type::Number, 0, {}};
+        node.number = value;
+        return Add(node);
     }
 
-    void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        operand_->Print(out);
-        out << ')';
+    uint32_t AddCell(const CellReference& cell) {
+        cells_.push_back(cell);
+        return Add(Node::Type::Cell, 0, static_cast<uint32_t>(cells_.size() - 1));
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
+    uint32_t AddRange(const RangeReference& range) {
+        ranges_.push_back(range);
+        return Add(Node::Type::Range, 0, static_cast<uint32_t>(ranges_.size() - 1));
     }
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_UNARY;
+    uint32_t AddUnary(char op, uint32_t operand) {
+        return Add(Node::Type::Unary, op, operand);
     }
 
-    double Evaluate(std::function<CellInterface*(Position)> get_cell_func) const override {
-        switch (type_) {
-            case UnaryPlus:
-                return + operand_->Evaluate(get_cell_func);
-            case UnaryMinus:
-                return - operand_->Evaluate(get_cell_func);
-            default:
-                // have to do this because VC++ has a buggy warning
-                assert(false);
-                return 0;
+    uint32_t AddBinary(char op, uint32_t lhs, uint32_t rhs) {
+        return Add(Node::Type::Binary, op, lhs, rhs);
+    }
+
+    // args are the roots of the arguments in order
+    uint32_t AddCall(Function function, const uint32_t* args, size_t count) {
+        const auto first = static_cast<uint32_t>(nodes_.size());
+        for (size_t i = 0; i < count; ++i) {
+            Add(Node::Type::Argument, 0, args[i]);
         }
+        return Add(Node::Type::Call, static_cast<char>(function), first, static_cast<uint32_t>(count));
+    }
+
+    // The last node added is the root
+    FormulaAST Build() {
+        return FormulaAST(std::move(nodes_), std::move(cells_), std::move(ranges_));
     }
 
 private:
-    Type type_;
-    std::unique_ptr<Expr> operand_;
+    std::pmr::vector<Node> nodes_;
+    std::pmr::vector<CellReference> cells_;
+    std::pmr::vector<RangeReference> ranges_;
+
+    uint32_t Add(Node::Type type, char op, uint32_t first, uint32_t second = 0) {
+        Node node{type, op, {}};
+        node.children[0] = first;
+        node.children[1] = second;
+        return Add(node);
+    }
+
+    uint32_t Add(const Node& node) {
+        nodes_.push_back(node);
+        return static_cast<uint32_t>(nodes_.size() - 1);
+    }
+};
+
+// The text of a NUMBER token. Reads what extracting a double from a stream
+// would: a number too large for a double is an error, one too small is
+// read as what it rounds to.
+bool ReadNumber(std::string_view text, double& value) {
+    const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (error == std::errc::result_out_of_range) {
+        // rare, so strtod tells an underflow from an overflow
+        value = std::strtod(std::string(text).c_str(), nullptr);
+        return std::isfinite(value);
+    }
+    return error == std::errc();
+}
+
+// The text of a CELL token; the position is invalid if it is off the sheet
+CellReference ReadCellReference(std::string_view text) {
+    // longer names are off the sheet anyway
+    constexpr size_t MAX_NAME_LENGTH = 16;
+
+    CellReference cell;
+    char name[MAX_NAME_LENGTH];
+    size_t length = 0;
+    for (char c : text) {
+        if (c != '$') {
+            if (length < MAX_NAME_LENGTH) {
+                name[length] = c;
+            }
+            ++length;
+        } else if (length == 0) {
+            cell.absolute_col = true;
+        } else {
+            cell.absolute_row = true;
+        }
+    }
+    cell.pos = length <= MAX_NAME_LENGTH ? Position::FromString({name, length}) : Position::NONE;
+    return cell;
+}
+
+enum class TokenType {
+    Number,
+    Cell,
+    Name,
+    Add,
+    Sub,
+    Mul,
+    Div,
+    LeftParen,
+    RightParen,
+    Colon,
+    Comma,
+    End,
+};
+
+struct Token {
+    TokenType type = TokenType::End;
+    std::string_view text;
 };
 
-class NumberExpr final : public Expr {
+// Tokens of Formula.g4, read one at a time. Like the generated lexer it
+// takes the longest match: "1.e5" is [1] followed by an error at '.',
+// "1e" is [1] followed by an error at 'e'.
+class Lexer {
 public:
-    explicit NumberExpr(double value)
-        : value_(value) {
+    explicit Lexer(std::string_view input)
+        : input_(input) {
     }
 
-    void Print(std::ostream& out) const override {
-        out << value_;
+    Token Next() {
+        while (pos_ < input_.size() && IsSpace(input_[pos_])) {
+            ++pos_;
+        }
+        if (pos_ == input_.size()) {
+            return {TokenType::End, {}};
+        }
+
+        const size_t start = pos_;
+        switch (input_[pos_]) {
+            case '+':
+                return Take(TokenType::Add, start + 1);
+            case '-':
+                return Take(TokenType::Sub, start + 1);
+            case '*':
+                return Take(TokenType::Mul, start + 1);
+            case '/':
+                return Take(TokenType::Div, start + 1);
+            case '(':
+                return Take(TokenType::LeftParen, start + 1);
+            case ')':
+                return Take(TokenType::RightParen, start + 1);
+            case ':':
+                return Take(TokenType::Colon, start + 1);
+            case ',':
+                return Take(TokenType::Comma, start + 1);
+            default:
+                break;
+        }
+
+        // CELL: '$'? [A-Z]+ '$'? [0-9]+, NAME: [A-Z]+
+        if (IsLetter(start) || input_[start] == '$') {
+            size_t end = start + (input_[start] == '$');
+            if (!IsLetter(end)) {
+                Fail(start);
+            }
+            while (IsLetter(end)) {
+                ++end;
+            }
+            const size_t letters_end = end;
+            end += end < input_.size() && input_[end] == '$';
+            if (IsDigit(end)) {
+                return Take(TokenType::Cell, SkipDigits(end));
+            }
+            if (input_[start] == '$') {
+                Fail(start);
+            }
+            return Take(TokenType::Name, letters_end);
+        }
+
+        // UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+        size_t end = SkipDigits(start);
+        if (end < input_.size() && input_[end] == '.' && IsDigit(end + 1)) {
+            end = SkipDigits(end + 1);
+        } else if (end == start) {
+            Fail(start);
+        }
+        if (end < input_.size() && (input_[end] == 'e' || input_[end] == 'E')) {
+            size_t exponent = end + 1;
+            if (exponent < input_.size() && (input_[exponent] == '+' || input_[exponent] == '-')) {
+                ++exponent;
+            }
+            if (IsDigit(exponent)) {
+                end = SkipDigits(exponent);
+            }
+        }
+        return Take(TokenType::Number, end);
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        out << value_;
+private:
+    std::string_view input_;
+    size_t pos_ = 0;
+
+    static bool IsSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
     }
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_ATOM;
+    bool IsDigit(size_t index) const {
+        return index < input_.size() && input_[index] >= '0' && input_[index] <= '9';
     }
 
-    double Evaluate(std::function<CellInterface*(Position)>) const override {
-        return value_;
+    bool IsLetter(size_t index) const {
+        return index < input_.size() && input_[index] >= 'A' && input_[index] <= 'Z';
     }
 
-private:
-    double value_;
+    size_t SkipDigits(size_t index) const {
+        while (IsDigit(index)) {
+            ++index;
+        }
+        return index;
+    }
+
+    Token Take(TokenType type, size_t end) {
+        Token token{type, input_.substr(pos_, end - pos_)};
+        pos_ = end;
+        return token;
+    }
+
+    [[noreturn]] void Fail(size_t index) const {
+        throw ParsingError("Error when lexing: token recognition error at: '"
+                           + std::string(1, input_[index]) + "'");
+    }
 };
 
-class CellExpr final : public Expr {
+// Precedence-climbing parser for Formula.g4 that builds the same tree as
+// ParseASTListener. The listener only runs once the whole input has
+// parsed, so bad literals and positions are reported after syntax errors
+// here as well, in the order they appear.
+class Parser {
 public:
-    explicit CellExpr(const Position* cell)
-        : cell_(cell) {
+    Parser(std::string_view input, std::pmr::memory_resource* resource)
+        : lexer_(input)
+        , builder_(resource) {
+        Advance();
     }
 
-    void Print(std::ostream& out) const override {
-        if (!cell_->IsValid()) {
-            out << FormulaError::Category::Ref;
-        } else {
-            out << cell_->ToString();
+    // main : expr EOF
+    FormulaAST ParseMain() {
+        ParseExpr(ADDITIVE);
+        if (token_.type != TokenType::End) {
+            Fail();
         }
+        if (deferred_error_) {
+            std::rethrow_exception(deferred_error_);
+        }
+        return builder_.Build();
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        Print(out);
+private:
+    static constexpr int ADDITIVE = 1;
+    static constexpr int MULTIPLICATIVE = 2;
+
+    Lexer lexer_;
+    Token token_;
+    TreeBuilder builder_;
+    std::exception_ptr deferred_error_;
+
+    void Advance() {
+        token_ = lexer_.Next();
     }
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_ATOM;
+    // binary operators associate to the left
+    uint32_t ParseExpr(int min_precedence) {
+        uint32_t lhs = ParseUnary();
+        for (;;) {
+            char op;
+            int precedence;
+            switch (token_.type) {
+                case TokenType::Add:
+                    op = '+';
+                    precedence = ADDITIVE;
+                    break;
+                case TokenType::Sub:
+                    op = '-';
+                    precedence = ADDITIVE;
+                    break;
+                case TokenType::Mul:
+                    op = '*';
+                    precedence = MULTIPLICATIVE;
+                    break;
+                case TokenType::Div:
+                    op = '/';
+                    precedence = MULTIPLICATIVE;
+                    break;
+                default:
+                    return lhs;
+            }
+            if (precedence < min_precedence) {
+                return lhs;
+            }
+            Advance();
+            uint32_t rhs = ParseExpr(precedence + 1);
+            lhs = builder_.AddBinary(op, lhs, rhs);
+        }
     }
 
-    double Evaluate(std::function<CellInterface*(Position)> get_cell_func) const override {
-        auto cell = get_cell_func({cell_->row, cell_->col});
-        auto cell_value = cell->GetValue();
+    // unary operators bind tighter than any binary one
+    uint32_t ParseUnary() {
+        if (token_.type == TokenType::Add || token_.type == TokenType::Sub) {
+            const char op = token_.type == TokenType::Add ? '+' : '-';
+            Advance();
+            return builder_.AddUnary(op, ParseUnary());
+        }
+        return ParsePrimary();
+    }
 
-        if (std::holds_alternative<double>(cell_value)) {
-            return std::get<double>(cell_value);
-        } else {
-            throw FormulaError(FormulaError::Category::Value);
+    uint32_t ParsePrimary() {
+        switch (token_.type) {
+            case TokenType::LeftParen: {
+                Advance();
+                uint32_t expr = ParseExpr(ADDITIVE);
+                if (token_.type != TokenType::RightParen) {
+                    Fail();
+                }
+                Advance();
+                return expr;
+            }
+            case TokenType::Number: {
+                double value = 0;
+                if (!ReadNumber(token_.text, value)) {
+                    Defer(ParsingError("Invalid number: " + std::string(token_.text)));
+                }
+                Advance();
+                return builder_.AddNumber(value);
+            }
+            case TokenType::Cell:
+                return builder_.AddCell(ReadCell());
+            case TokenType::Name:
+                return ParseCall();
+            default:
+                Fail();
         }
-        
     }
 
-private:
-    const Position* cell_;
-};
+    // NAME '(' arg (',' arg)* ')'
+    uint32_t ParseCall() {
+        const std::string_view name = token_.text;
+        Advance();
+        if (token_.type != TokenType::LeftParen) {
+            Fail();
+        }
+        std::vector<uint32_t> args;
+        do {
+            Advance();
+            args.push_back(ParseArgument());
+        } while (token_.type == TokenType::Comma);
+        if (token_.type != TokenType::RightParen) {
+            Fail();
+        }
+        Advance();
 
+        // the listener checks the name once it has seen the arguments
+        auto function = ReadFunction(name);
+        if (!function) {
+            Defer(ParsingError("Unknown function: " + std::string(name)));
+            function = Function::Sum;
+        }
+        return builder_.AddCall(*function, args.data(), args.size());
+    }
+
+    // arg : CELL ':' CELL | expr
+    uint32_t ParseArgument() {
+        if (token_.type != TokenType::Cell || Lexer(lexer_).Next().type != TokenType::Colon) {
+            return ParseExpr(ADDITIVE);
+        }
+        RangeReference range;
+        range.first = ReadCell();
+        Advance();
+        if (token_.type != TokenType::Cell) {
+            Fail();
+        }
+        range.last = ReadCell();
+        return builder_.AddRange(range);
+    }
+
+    // Consumes the CELL token
+    CellReference ReadCell() {
+        auto cell = ReadCellReference(token_.text);
+        if (!cell.pos.IsValid()) {
+            Defer(FormulaException("Invalid position: " + std::string(token_.text)));
+        }
+        Advance();
+        return cell;
+    }
+
+    template <typename Error>
+    void Defer(Error error) {
+        if (!deferred_error_) {
+            deferred_error_ = std::make_exception_ptr(std::move(error));
+        }
+    }
+
+    [[noreturn]] void Fail() const {
+        if (token_.type == TokenType::End) {
+            throw ParsingError("Error when parsing: unexpected end of formula");
+        }
+        throw ParsingError("Error when parsing: unexpected '" + std::string(token_.text) + "'");
+    }
+};
 
 class ParseASTListener final : public FormulaBaseListener {
 public:
-    std::unique_ptr<Expr> MoveRoot() {
+    explicit ParseASTListener(std::pmr::memory_resource* resource)
+        : builder_(resource)
+        , args_(resource) {
+    }
+
+    FormulaAST Build() {
         assert(args_.size() == 1);
-        auto root = std::move(args_.front());
         args_.clear();
 
-        return root;
-    }
-
-    std::forward_list<Position> MoveCells() {
-        return std::move(cells_);
+        return builder_.Build();
     }
 
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
 
-        auto operand = std::move(args_.back());
-
-        UnaryOpExpr::Type type;
+        char op;
         if (ctx->SUB()) {
-            type = UnaryOpExpr::UnaryMinus;
+            op = '-';
         } else {
             assert(ctx->ADD() != nullptr);
-            type = UnaryOpExpr::UnaryPlus;
+            op = '+';
         }
 
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-        args_.back() = std::move(node);
+        args_.back() = builder_.AddUnary(op, args_.back());
     }
 
     void exitLiteral(FormulaParser::LiteralContext* ctx) override {
         double value = 0;
         auto valueStr = ctx->NUMBER()->getSymbol()->getText();
-        std::istringstream in(valueStr);
-        in >> value;
-        if (!in) {
+        if (!ReadNumber(valueStr, value)) {
             throw ParsingError("Invalid number: " + valueStr);
         }
 
-        auto node = std::make_unique<NumberExpr>(value);
-        args_.push_back(std::move(node));
+        args_.push_back(builder_.AddNumber(value));
     }
 
     void exitCell(FormulaParser::CellContext* ctx) override {
         auto value_str = ctx->CELL()->getSymbol()->getText();
-        auto value = Position::FromString(value_str);
-        if (!value.IsValid()) {
+        auto value = ReadCellReference(value_str);
+        if (!value.pos.IsValid()) {
             throw FormulaException("Invalid position: " + value_str);
         }
 
-        cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
-        args_.push_back(std::move(node));
+        args_.push_back(builder_.AddCell(value));
+    }
+
+    void exitRange(FormulaParser::RangeContext* ctx) override {
+        RangeReference range;
+        CellReference* corners[] = {&range.first, &range.last};
+        for (size_t i = 0; i < 2; ++i) {
+            auto value_str = ctx->CELL(i)->getSymbol()->getText();
+            *corners[i] = ReadCellReference(value_str);
+            if (!corners[i]->pos.IsValid()) {
+                throw FormulaException("Invalid position: " + value_str);
+            }
+        }
+
+        args_.push_back(builder_.AddRange(range));
+    }
+
+    void exitCall(FormulaParser::CallContext* ctx) override {
+        const size_t arg_count = ctx->arg().size();
+        assert(args_.size() >= arg_count);
+
+        auto name = ctx->NAME()->getSymbol()->getText();
+        auto function = ReadFunction(name);
+        if (!function) {
+            throw ParsingError("Unknown function: " + name);
+        }
+
+        const uint32_t node = builder_.AddCall(*function, args_.data() + args_.size() - arg_count, arg_count);
+        args_.resize(args_.size() - arg_count);
+        args_.push_back(node);
     }
 
     void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
         assert(args_.size() >= 2);
 
-        auto rhs = std::move(args_.back());
+        const uint32_t rhs = args_.back();
         args_.pop_back();
 
-        auto lhs = std::move(args_.back());
-
-        BinaryOpExpr::Type type;
+        char op;
         if (ctx->ADD()) {
-            type = BinaryOpExpr::Add;
+            op = '+';
         } else if (ctx->SUB()) {
-            type = BinaryOpExpr::Subtract;
+            op = '-';
         } else if (ctx->MUL()) {
-            type = BinaryOpExpr::Multiply;
+            op = '*';
         } else {
             assert(ctx->DIV() != nullptr);
-            type = BinaryOpExpr::Divide;
+            op = '/';
         }
 
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-        args_.back() = std::move(node);
+        args_.back() = builder_.AddBinary(op, args_.back(), rhs);
     }
 
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
@@ -384,8 +1210,9 @@ public:
     }
 
 private:
-    std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    TreeBuilder builder_;
+    // roots of the subtrees whose parents have not been seen yet
+    std::pmr::vector<uint32_t> args_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -401,7 +1228,17 @@ public:
 }  // namespace
 }  // namespace ASTImpl
 
-FormulaAST ParseFormulaAST(std::istream& in) {
+FormulaAST ParseFormulaAST(std::istream& in, std::pmr::memory_resource* resource) {
+    std::string in_str(std::istreambuf_iterator<char>(in), {});
+    return ParseFormulaAST(in_str, resource);
+}
+
+FormulaAST ParseFormulaAST(const std::string& in_str, std::pmr::memory_resource* resource) {
+    ASTImpl::Parser parser(in_str, resource);
+    return parser.ParseMain();
+}
+
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in, std::pmr::memory_resource* resource) {
     using namespace antlr4;
 
     ANTLRInputStream input(in);
@@ -419,39 +1256,442 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     parser.removeErrorListeners();
 
     tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
+    ASTImpl::ParseASTListener listener(resource);
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return listener.Build();
 }
 
-FormulaAST ParseFormulaAST(const std::string& in_str) {
+FormulaAST ParseFormulaASTWithAntlr(const std::string& in_str, std::pmr::memory_resource* resource) {
     std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+    return ParseFormulaASTWithAntlr(in, resource);
+}
+
+std::string ToRelativeForm(std::string_view expression, Position anchor) {
+    using ASTImpl::TokenType;
+
+    std::string result;
+    result.reserve(expression.size() * 2);
+    ASTImpl::Lexer lexer(expression);
+    bool after_operand = false;
+    for (auto token = lexer.Next(); token.type != TokenType::End; token = lexer.Next()) {
+        const bool operand = token.type == TokenType::Number || token.type == TokenType::Cell
+                             || token.type == TokenType::Name;
+        // keeps "1 2" apart from "12" and "SUM 1" apart from "SUM1"
+        if (operand && after_operand) {
+            result += ' ';
+        }
+        after_operand = operand;
+        if (token.type != TokenType::Cell) {
+            result += token.text;
+            continue;
+        }
+
+        auto cell = ASTImpl::ReadCellReference(token.text);
+        if (!cell.pos.IsValid()) {
+            throw FormulaException("Invalid position: " + std::string(token.text));
+        }
+        auto append = [&result](char axis, bool absolute, int index, int anchor_index) {
+            result += axis;
+            if (absolute) {
+                result += std::to_string(index + 1);
+            } else {
+                result += '[';
+                result += std::to_string(index - anchor_index);
+                result += ']';
+            }
+        };
+        append('R', cell.absolute_row, cell.pos.row, anchor.row);
+        append('C', cell.absolute_col, cell.pos.col, anchor.col);
+    }
+    return result;
+}
+
+std::string CellReference::ToString(Position offset) const {
+    const Position resolved = Resolve(offset);
+    if (!resolved.IsValid()) {
+        return "#REF!";
+    }
+    std::string text = resolved.ToString();
+    if (absolute_row) {
+        text.insert(text.find_first_of("0123456789"), 1, '$');
+    }
+    if (absolute_col) {
+        text.insert(text.begin(), '$');
+    }
+    return text;
+}
+
+PositionRange RangeReference::Resolve(Position offset) const {
+    const Position a = first.Resolve(offset);
+    const Position b = last.Resolve(offset);
+    return {{std::min(a.row, b.row), std::min(a.col, b.col)}, {std::max(a.row, b.row), std::max(a.col, b.col)}};
+}
+
+bool RangeReference::IsValid(Position offset) const {
+    return first.Resolve(offset).IsValid() && last.Resolve(offset).IsValid();
+}
+
+std::string RangeReference::ToString(Position offset) const {
+    if (!IsValid(offset)) {
+        return "#REF!";
+    }
+    return first.ToString(offset) + ':' + last.ToString(offset);
 }
 
 void FormulaAST::PrintCells(std::ostream& out) const {
-    for (auto cell : cells_) {
+    for (const auto& cell : cells_) {
         out << cell.ToString() << ' ';
     }
 }
 
 void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
+    ASTImpl::Tree(nodes_.data(), cells_.data(), ranges_.data()).Print(GetRoot(), out);
+}
+
+void FormulaAST::PrintFormula(std::ostream& out, Position offset) const {
+    ASTImpl::Tree(nodes_.data(), cells_.data(), ranges_.data()).PrintFormula(GetRoot(), out, ASTImpl::EP_ATOM, offset);
+}
+
+void FormulaAST::PrintFormula(std::ostream& out, std::pmr::vector<ReferenceSlot>& slots) const {
+    ASTImpl::Tree tree(nodes_.data(), cells_.data(), ranges_.data());
+    tree.RecordSlots(&slots);
+    tree.PrintFormula(GetRoot(), out, ASTImpl::EP_ATOM, {});
+}
+
+namespace {
+
+// Formulas deeper than this evaluate on a heap-allocated stack
+constexpr size_t INLINE_STACK_DEPTH = 32;
+// and ones with calls nested deeper than this keep the aggregates on the heap
+constexpr size_t INLINE_AGGREGATE_DEPTH = 4;
+// as do ones with more temporaries than this
+constexpr size_t INLINE_TEMPS = 8;
+
+double Finish(ASTImpl::Function function, const RangeAggregate& aggregate) {
+    using ASTImpl::Function;
+
+    switch (function) {
+        case Function::Sum:
+            return aggregate.sum;
+        case Function::Average:
+            // 0 / 0 for no numbers, reported as #DIV/0!
+            return aggregate.sum / static_cast<double>(aggregate.count);
+        case Function::Min:
+            return aggregate.min;
+        case Function::Max:
+            return aggregate.max;
+        case Function::Count:
+            return static_cast<double>(aggregate.count);
+        default:
+            assert(false);
+            return 0;
+    }
+}
+
+}  // namespace
+
+FormulaAST::Result FormulaAST::Execute(CellValueGetter get_cell_value, Position offset) const {
+    auto aggregate_range = [get_cell_value](PositionRange range, RangeAggregate& aggregate) {
+        for (int row = range.top_left.row; row <= range.bottom_right.row; ++row) {
+            for (int col = range.top_left.col; col <= range.bottom_right.col; ++col) {
+                auto value = get_cell_value({row, col});
+                if (std::holds_alternative<FormulaError>(value)) {
+                    return false;
+                }
+                if (std::holds_alternative<double>(value)) {
+                    aggregate.Add(std::get<double>(value));
+                }
+            }
+        }
+        return true;
+    };
+    return Execute(get_cell_value, aggregate_range, offset);
+}
+
+// Errors are returned as soon as they appear. The code runs in the order
+// the tree would be walked, so this is the error the walk would report;
+// a temporary only ever holds a value computed without one.
+FormulaAST::Result FormulaAST::Execute(CellValueGetter get_cell_value, RangeAggregator aggregate_range,
+                                       Position offset, Memo* memo) const {
+    using ASTImpl::Function;
+    using ASTImpl::OpCode;
+    using ASTImpl::Program;
+
+    double inline_stack[INLINE_STACK_DEPTH];
+    std::vector<double> heap_stack;
+    double* top = inline_stack;
+    if (program_.GetMaxDepth() > INLINE_STACK_DEPTH) {
+        heap_stack.resize(program_.GetMaxDepth());
+        top = heap_stack.data();
+    }
+    RangeAggregate inline_aggregates[INLINE_AGGREGATE_DEPTH];
+    std::vector<RangeAggregate> heap_aggregates;
+    RangeAggregate* aggregate = inline_aggregates;
+    if (program_.GetMaxAggregateDepth() > INLINE_AGGREGATE_DEPTH) {
+        heap_aggregates.resize(program_.GetMaxAggregateDepth());
+        aggregate = heap_aggregates.data();
+    }
+    double inline_temps[INLINE_TEMPS];
+    std::vector<double> heap_temps;
+    double* temps = inline_temps;
+    if (memo != nullptr) {
+        assert(memo->temps_.size() == program_.GetTempCount());
+        temps = memo->temps_.data();
+    } else if (program_.GetTempCount() > INLINE_TEMPS) {
+        heap_temps.resize(program_.GetTempCount());
+        temps = heap_temps.data();
+    }
+    // top points past the last value on the stack, aggregate past the
+    // aggregate of the innermost open call
+    const auto& code = program_.GetCode();
+    for (size_t next = 0; next < code.size();) {
+        const ASTImpl::Instruction& instruction = code[next++];
+        switch (instruction.code) {
+            case OpCode::PushNumber:
+                *top++ = program_.GetConstant(instruction.operand);
+                continue;
+            case OpCode::LoadCell: {
+                const uint32_t operand = instruction.operand;
+                Position pos = Position::Unpack(operand & (Program::ABSOLUTE_ROW - 1));
+                pos.row += operand & Program::ABSOLUTE_ROW ? 0 : offset.row;
+                pos.col += operand & Program::ABSOLUTE_COL ? 0 : offset.col;
+                if (!pos.IsValid()) {
+                    return FormulaError(FormulaError::Category::Ref);
+                }
+                auto cell_value = get_cell_value(pos);
+                if (!std::holds_alternative<double>(cell_value)) {
+                    return FormulaError(FormulaError::Category::Value);
+                }
+                *top++ = std::get<double>(cell_value);
+                continue;
+            }
+            case OpCode::Negate:
+                top[-1] = -top[-1];
+                continue;
+            case OpCode::Add:
+                --top;
+                top[-1] += top[0];
+                break;
+            case OpCode::Subtract:
+                --top;
+                top[-1] -= top[0];
+                break;
+            case OpCode::Multiply:
+                --top;
+                top[-1] *= top[0];
+                break;
+            case OpCode::Divide:
+                --top;
+                top[-1] /= top[0];
+                break;
+            case OpCode::BeginAggregate: {
+                const auto function = static_cast<Function>(instruction.operand);
+                *aggregate = RangeAggregate{};
+                aggregate->needs_extremes = function == Function::Min || function == Function::Max;
+                ++aggregate;
+                continue;
+            }
+            case OpCode::Aggregate:
+                aggregate[-1].Add(*--top);
+                continue;
+            case OpCode::AggregateRange: {
+                const RangeReference& range = ranges_[instruction.operand];
+                if (!range.IsValid(offset)) {
+                    return FormulaError(FormulaError::Category::Ref);
+                }
+                if (!aggregate_range(range.Resolve(offset), aggregate[-1])) {
+                    return FormulaError(FormulaError::Category::Value);
+                }
+                continue;
+            }
+            case OpCode::EndAggregate:
+                --aggregate;
+                *top++ = Finish(static_cast<Function>(instruction.operand), *aggregate);
+                break;
+            case OpCode::StoreTemp:
+                temps[instruction.operand] = top[-1];
+                continue;
+            case OpCode::LoadTemp:
+                *top++ = temps[instruction.operand];
+                continue;
+            case OpCode::BeginInvariant:
+                if (memo != nullptr && memo->known_[instruction.operand]) {
+                    *top++ = temps[instruction.operand];
+                    next = program_.GetInvariantEnd(instruction.operand);
+                }
+                continue;
+            case OpCode::EndInvariant:
+                temps[instruction.operand] = top[-1];
+                if (memo != nullptr) {
+                    memo->known_[instruction.operand] = true;
+                }
+                continue;
+        }
+        // binary operations and calls end up here
+        if (!std::isfinite(top[-1])) {
+            return FormulaError(FormulaError::Category::Div0);
+        }
+    }
+    return top[-1];
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+namespace {
+
+// Cells a column block holds; a value on the stack is this many doubles
+constexpr size_t COLUMN_BLOCK = 256;
+
+// Values of a LoadCell operand for the cells of a block
+void LoadColumnOperand(FormulaAST::ColumnLoader load_column, uint32_t operand, Position offset,
+                       size_t count, double* values, bool* not_number, uint8_t* errors) {
+    using ASTImpl::Program;
+
+    // the first error of a cell is the one it keeps
+    auto fail = [errors](size_t first, size_t last, FormulaError::Category category) {
+        for (size_t i = first; i < last; ++i) {
+            if (errors[i] == 0) {
+                errors[i] = 1 + static_cast<uint8_t>(category);
+            }
+        }
+    };
+
+    Position pos = Position::Unpack(operand & (Program::ABSOLUTE_ROW - 1));
+    pos.col += operand & Program::ABSOLUTE_COL ? 0 : offset.col;
+    if (operand & Program::ABSOLUTE_ROW) {
+        // the same cell for the whole block
+        bool is_text = false;
+        if (pos.IsValid()) {
+            load_column(pos, 1, values, &is_text);
+        } else {
+            values[0] = 0.0;
+            fail(0, count, FormulaError::Category::Ref);
+        }
+        if (is_text) {
+            fail(0, count, FormulaError::Category::Value);
+        }
+        std::fill_n(values + 1, count - 1, values[0]);
+        return;
+    }
+
+    pos.row += offset.row;
+    const int first_valid = std::clamp(-pos.row, 0, static_cast<int>(count));
+    const int last_valid = std::clamp(Position::MAX_ROWS - pos.row, first_valid, static_cast<int>(count));
+    if (pos.col < 0 || pos.col >= Position::MAX_COLS || first_valid == last_valid) {
+        std::fill_n(values, count, 0.0);
+        fail(0, count, FormulaError::Category::Ref);
+        return;
+    }
+    std::fill_n(values, first_valid, 0.0);
+    fail(0, first_valid, FormulaError::Category::Ref);
+    std::fill(values + last_valid, values + count, 0.0);
+    fail(last_valid, count, FormulaError::Category::Ref);
+
+    load_column({pos.row + first_valid, pos.col}, last_valid - first_valid,
+                values + first_valid, not_number + first_valid);
+    for (int i = first_valid; i < last_valid; ++i) {
+        if (not_number[i]) {
+            fail(i, i + 1, FormulaError::Category::Value);
+        }
+    }
 }
 
-double FormulaAST::Execute(std::function<CellInterface*(Position)> get_cell_func) const {
-    return root_expr_->Evaluate(get_cell_func);
+}  // namespace
+
+void FormulaAST::ExecuteColumn(ColumnLoader load_column, Position offset, size_t count, Result* results,
+                               const ColumnKernels& kernels) const {
+    using ASTImpl::OpCode;
+    assert(!program_.HasAggregates());
+
+    std::vector<double> stack(program_.GetMaxDepth() * COLUMN_BLOCK);
+    std::vector<double> temps(program_.GetTempCount() * COLUMN_BLOCK);
+    // 0 while the cell has no error, then 1 + the category of its first one
+    uint8_t errors[COLUMN_BLOCK];
+    bool not_number[COLUMN_BLOCK];
+
+    for (size_t done = 0; done < count; done += COLUMN_BLOCK) {
+        const size_t block = std::min(COLUMN_BLOCK, count - done);
+        const Position block_offset{offset.row + static_cast<int>(done), offset.col};
+        std::fill_n(errors, block, 0);
+
+        // top points past the last value on the stack
+        double* top = stack.data();
+        for (const ASTImpl::Instruction& instruction : program_.GetCode()) {
+            bool (*apply)(double*, const double*, size_t) = nullptr;
+            switch (instruction.code) {
+                case OpCode::PushNumber:
+                    std::fill_n(top, block, program_.GetConstant(instruction.operand));
+                    top += COLUMN_BLOCK;
+                    continue;
+                case OpCode::LoadCell:
+                    LoadColumnOperand(load_column, instruction.operand, block_offset, block, top, not_number, errors);
+                    top += COLUMN_BLOCK;
+                    continue;
+                case OpCode::Negate:
+                    kernels.negate(top - COLUMN_BLOCK, block);
+                    continue;
+                case OpCode::StoreTemp:
+                case OpCode::EndInvariant:
+                    std::copy_n(top - COLUMN_BLOCK, block, temps.data() + instruction.operand * COLUMN_BLOCK);
+                    continue;
+                case OpCode::LoadTemp:
+                    std::copy_n(temps.data() + instruction.operand * COLUMN_BLOCK, block, top);
+                    top += COLUMN_BLOCK;
+                    continue;
+                case OpCode::BeginInvariant:
+                    continue;
+                case OpCode::Add:
+                    apply = kernels.add;
+                    break;
+                case OpCode::Subtract:
+                    apply = kernels.subtract;
+                    break;
+                case OpCode::Multiply:
+                    apply = kernels.multiply;
+                    break;
+                case OpCode::Divide:
+                    apply = kernels.divide;
+                    break;
+                default:
+                    assert(false);
+                    continue;
+            }
+            // binary operations end up here
+            top -= COLUMN_BLOCK;
+            double* lhs = top - COLUMN_BLOCK;
+            if (apply(lhs, top, block)) {
+                for (size_t i = 0; i < block; ++i) {
+                    if (errors[i] == 0 && !std::isfinite(lhs[i])) {
+                        errors[i] = 1 + static_cast<uint8_t>(FormulaError::Category::Div0);
+                    }
+                }
+            }
+        }
+
+        const double* values = top - COLUMN_BLOCK;
+        for (size_t i = 0; i < block; ++i) {
+            if (errors[i] == 0) {
+                results[done + i] = values[i];
+            } else {
+                results[done + i] = FormulaError(static_cast<FormulaError::Category>(errors[i] - 1));
+            }
+        }
+    }
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
-    cells_.sort();  // to avoid sorting in GetReferencedCells
+FormulaAST::FormulaAST(std::pmr::vector<ASTImpl::Node> nodes, std::pmr::vector<CellReference> cells,
+                       std::pmr::vector<RangeReference> ranges)
+    : nodes_(std::move(nodes))
+    , cells_(std::move(cells))
+    , ranges_(std::move(ranges))
+    , program_(nodes_.get_allocator().resource()) {
+    assert(!nodes_.empty());
+    ASTImpl::Compiler(nodes_.data(), nodes_.size(), cells_.data(), ranges_.data()).Compile(GetRoot(), program_);
+    program_.Finish();
 }
 
 FormulaAST::~FormulaAST() = default;
+
+FormulaAST::Memo::Memo(const FormulaAST& ast)
+    : temps_(ast.program_.GetTempCount())
+    , known_(ast.program_.GetTempCount()) {
+}
@@ -1,16 +1,192 @@
 #pragma once
 
 #include "FormulaLexer.h"
+#include "column_kernels.h"
 #include "common.h"
+#include "function_ref.h"
 
-#include <forward_list>
-#include <functional>
+#include <cstdint>
+#include <memory_resource>
+#include <optional>
 #include <stdexcept>
+#include <string>
+#include <string_view>
 #include <unordered_set>
+#include <variant>
+#include <vector>
+
+// A cell reference as written in a formula. The parts marked with '$' are
+// absolute; the others move along when the formula is shared by a cell
+// offset rows and columns away from the one it was written for.
+struct CellReference {
+    Position pos;
+    bool absolute_row = false;
+    bool absolute_col = false;
+
+    Position Resolve(Position offset) const {
+        return {absolute_row ? pos.row : pos.row + offset.row,
+                absolute_col ? pos.col : pos.col + offset.col};
+    }
+
+    // A1 text with the '$' marks, "#REF!" if the moved reference is off the sheet
+    std::string ToString(Position offset = {}) const;
+};
+
+// A range as written, A1:B10; the corners move like cell references
+struct RangeReference {
+    CellReference first;
+    CellReference last;
+
+    // With the corners put in order; not valid if one is off the sheet
+    PositionRange Resolve(Position offset) const;
+    bool IsValid(Position offset) const;
+    std::string ToString(Position offset = {}) const;
+};
 
 namespace ASTImpl {
-class Expr;
-}
+
+enum class Function : uint8_t {
+    Sum,
+    Average,
+    Min,
+    Max,
+    Count,
+};
+
+// A node of the expression tree. The nodes of a formula live in one array
+// and refer to each other by index; a child always comes before its parent,
+// so the root is the last node.
+struct Node {
+    enum class Type : uint8_t {
+        Binary,    // op is '+', '-', '*' or '/'; children are the operands
+        Unary,     // op is '+' or '-'; children[0] is the operand
+        Number,    // number holds the value
+        Cell,      // children[0] indexes the cell references of the formula
+        Range,     // children[0] indexes the range references of the formula
+        Call,      // op is the Function; children[0] is the first of children[1]
+                   // consecutive Argument nodes
+        Argument,  // children[0] is the root of the argument
+    };
+
+    Type type;
+    char op = 0;
+    union {
+        double number;
+        uint32_t children[2];
+    };
+};
+
+enum class OpCode : uint8_t {
+    PushNumber,      // operand indexes the constants
+    LoadCell,        // operand is a packed position and the absolute flags
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    Negate,
+    BeginAggregate,  // starts the arguments of a call; operand is the Function
+    Aggregate,       // pops a value into the aggregate of the call
+    AggregateRange,  // adds a range to the aggregate; operand indexes the ranges
+    EndAggregate,    // pushes the result of the call; operand is the Function
+    StoreTemp,       // copies the top of the stack to a temporary; operand indexes them
+    LoadTemp,        // pushes a temporary
+    BeginInvariant,  // starts the code of an invariant value; operand is its temporary
+    EndInvariant,    // ends it, copying the value to the temporary
+};
+
+struct Instruction {
+    OpCode code;
+    uint32_t operand = 0;
+};
+
+// The formula in postfix order: every instruction pops its arguments from
+// the value stack and pushes its result. Operations are simplified as they
+// are appended: constant operands are folded and operations that return
+// their operand exactly are dropped (x*1, 1*x, x/1, x-0, -(-x)). x+0 stays,
+// since -0+0 is +0. A fold that gives inf or NaN is left for run time,
+// so the error appears where it would without folding.
+class Program {
+public:
+    // flags of LoadCell operands, above the 28 bits of the packed position
+    static constexpr uint32_t ABSOLUTE_ROW = 1u << 28;
+    static constexpr uint32_t ABSOLUTE_COL = 1u << 29;
+
+    explicit Program(std::pmr::memory_resource* resource);
+
+    void PushNumber(double value);
+    void LoadCell(const CellReference& cell);
+    void Apply(OpCode code);
+
+    // A call is BeginAggregate(), then every argument followed by Aggregate()
+    // or a single AggregateRange(), then EndAggregate(). Calls are not folded.
+    void BeginAggregate(Function function);
+    void Aggregate();
+    void AggregateRange(uint32_t range_index);
+    void EndAggregate(Function function);
+
+    // A value used more than once is computed where it first appears and
+    // copied to a temporary with StoreTemp(); LoadTemp() pushes it again.
+    // An invariant value, one whose references do not move with the
+    // offset, is computed between BeginInvariant() and EndInvariant()
+    // instead, so that a memo can keep it between offsets, see
+    // FormulaAST::Memo.
+    void StoreTemp(uint32_t temp);
+    void LoadTemp(uint32_t temp);
+    void BeginInvariant(uint32_t temp);
+    void EndInvariant(uint32_t temp);
+
+    // Frees what was only needed while appending
+    void Finish();
+
+    const std::pmr::vector<Instruction>& GetCode() const {
+        return code_;
+    }
+
+    double GetConstant(uint32_t index) const {
+        return constants_[index];
+    }
+
+    size_t GetMaxDepth() const {
+        return max_depth_;
+    }
+
+    // Nesting of function calls
+    size_t GetMaxAggregateDepth() const {
+        return max_aggregate_depth_;
+    }
+
+    bool HasAggregates() const {
+        return max_aggregate_depth_ > 0;
+    }
+
+    size_t GetTempCount() const {
+        return temp_count_;
+    }
+
+    // Where the code after EndInvariant(temp) starts; set by Finish()
+    uint32_t GetInvariantEnd(uint32_t temp) const {
+        return invariant_ends_[temp];
+    }
+
+private:
+    std::pmr::vector<Instruction> code_;
+    std::pmr::vector<double> constants_;
+    // where the code of every value now on the stack starts
+    std::pmr::vector<uint32_t> starts_;
+    // where the code of every call now open starts
+    std::pmr::vector<uint32_t> call_starts_;
+    // where the code of every invariant value now open starts
+    std::pmr::vector<uint32_t> invariant_starts_;
+    std::pmr::vector<uint32_t> invariant_ends_;
+    size_t max_depth_ = 0;
+    size_t max_aggregate_depth_ = 0;
+    size_t temp_count_ = 0;
+
+    void PushOperand(Instruction instruction);
+    std::optional<double> GetConstant(size_t first, size_t last) const;
+    void EraseConstant(size_t index);
+};
+}  // namespace ASTImpl
 
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
@@ -18,31 +194,121 @@ class ParsingError : public std::runtime_error {
 
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
+    // The root is the last node
+    explicit FormulaAST(std::pmr::vector<ASTImpl::Node> nodes,
+                        std::pmr::vector<CellReference> cells,
+                        std::pmr::vector<RangeReference> ranges);
     FormulaAST(FormulaAST&&) = default;
     FormulaAST& operator=(FormulaAST&&) = default;
     ~FormulaAST();
 
-    double Execute(std::function<CellInterface*(Position)> get_cell_func) const;
+    const ASTImpl::Program& GetProgram() const {
+        return program_;
+    }
+
+    // A finite number or the first error met, left to right
+    using Result = std::variant<double, FormulaError>;
+
+    using CellValueGetter = FunctionRef<CellInterface::Value(Position)>;
+    // Adds the numbers of the range to the aggregate, false on an error value
+    using RangeAggregator = FunctionRef<bool(PositionRange range, RangeAggregate& aggregate)>;
+
+    // Invariant values of the formula kept between Execute() calls, so
+    // that cells sharing the formula compute them once. It is up to the
+    // caller to drop the memo once a cell they read may have changed.
+    class Memo {
+    public:
+        explicit Memo(const FormulaAST& ast);
+
+    private:
+        friend class FormulaAST;
+
+        std::vector<double> temps_;
+        std::vector<bool> known_;
+    };
+
+    // The callbacks are only borrowed for the duration of the call. The
+    // offset moves the relative references, see CellReference; a reference
+    // moved off the sheet evaluates to #REF!. The memo, if any, belongs to
+    // this formula.
+    Result Execute(CellValueGetter get_cell_value, RangeAggregator aggregate_range,
+                   Position offset = {}, Memo* memo = nullptr) const;
+    // Reads ranges cell by cell through get_cell_value, which cannot tell
+    // empty cells from zeros, so those are counted as numbers
+    Result Execute(CellValueGetter get_cell_value, Position offset = {}) const;
+
+    // Fills values[0, count) with the values of count cells down a column
+    // from first, marking the ones that are not numbers in not_number
+    using ColumnLoader = FunctionRef<void(Position first, size_t count, double* values, bool* not_number)>;
+
+    // Execute() for count cells stacked in a column: the i-th one is moved
+    // by {offset.row + i, offset.col}. Every instruction runs for a block
+    // of cells at once, the arithmetic with the given kernels, and every
+    // cell gets the result Execute() would give it. Programs with function
+    // calls are not supported, see Program::HasAggregates().
+    void ExecuteColumn(ColumnLoader load_column, Position offset, size_t count, Result* results,
+                       const ColumnKernels& kernels = GetBestColumnKernels()) const;
+
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    void PrintFormula(std::ostream& out, Position offset = {}) const;
 
-    std::forward_list<Position>& GetCells() {
+    // Where a reference that prints differently at other offsets was put
+    // in the text printed at no offset: [begin, begin + length)
+    struct ReferenceSlot {
+        uint32_t begin;
+        uint32_t length;
+        uint32_t index;  // into GetCells(), or GetRanges() for a range
+        bool is_range;
+    };
+
+    // PrintFormula() at no offset that also appends the slots of the
+    // references in the order printed; they are positions as reported by
+    // out.tellp(), so out is a string stream
+    void PrintFormula(std::ostream& out, std::pmr::vector<ReferenceSlot>& slots) const;
+
+    // Every reference in the formula in the order written, repeats included
+    const std::pmr::vector<CellReference>& GetCells() const {
         return cells_;
     }
 
-    const std::forward_list<Position>& GetCells() const {
-        return cells_;
+    // Every range in the formula in the order written, repeats included
+    const std::pmr::vector<RangeReference>& GetRanges() const {
+        return ranges_;
     }
 
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
-    std::forward_list<Position> cells_;
+    std::pmr::vector<ASTImpl::Node> nodes_;
+    std::pmr::vector<CellReference> cells_;
+    std::pmr::vector<RangeReference> ranges_;
+    // the tree is kept for printing, evaluation runs the compiled program
+    ASTImpl::Program program_;
+
+    uint32_t GetRoot() const {
+        return static_cast<uint32_t>(nodes_.size() - 1);
+    }
 };
 
-FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
+// The node array and the reference arrays are allocated from the resource.
+// The hand-written parser accepts exactly the language of Formula.g4.
+FormulaAST ParseFormulaAST(std::istream& in,
+                           std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+FormulaAST ParseFormulaAST(const std::string& in_str,
+                           std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+// The generated ANTLR parser, kept as the reference for the one above.
+// It builds the same tree; on a syntax error it throws ANTLR's own
+// ParseCancellationException rather than ParsingError.
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in,
+                                    std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+FormulaAST ParseFormulaASTWithAntlr(const std::string& in_str,
+                                    std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+// The tokens of the expression with every reference written R1C1 style
+// relative to anchor: R[-1]C[2] for relative parts, R5C3 for absolute
+// ones. Copies of a formula filled from one cell to others get the same
+// form. Throws ParsingError or FormulaException on bad tokens, but does
+// not check the syntax.
+std::string ToRelativeForm(std::string_view expression, Position anchor);
 
 
@@ -0,0 +1,160 @@
+#include "aggregate_index.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace {
+
+// Columns start with this many rows and double when a cell below is set
+constexpr size_t MIN_ROWS = 64;
+
+// Nodes are numbered from 1 in the usual Fenwick way
+size_t LowBit(size_t index) {
+    return index & (~index + 1);
+}
+
+}  // namespace
+
+AggregateIndex::AggregateIndex(std::pmr::memory_resource* resource)
+    : columns_(resource) {
+}
+
+void AggregateIndex::AddColumn(int col) {
+    if (col >= static_cast<int>(columns_.size())) {
+        columns_.resize(col + 1);
+    }
+    if (!columns_[col].indexed) {
+        columns_[col].indexed = true;
+        ++indexed_count_;
+    }
+}
+
+void AggregateIndex::Set(Position pos, Kind kind, double value) {
+    if (!IsIndexed(pos.col)) {
+        return;
+    }
+    Column& column = columns_[pos.col];
+    const size_t row = pos.row;
+    if (row >= column.kinds.size()) {
+        if (kind == Kind::None) {
+            return;
+        }
+        Grow(column, row + 1);
+    }
+
+    column.values[row] = kind == Kind::Number ? value : 0.0;
+    column.kinds[row] = kind;
+    for (size_t index = row + 1; index <= column.nodes.size(); index += LowBit(index)) {
+        Recompute(column, index - 1);
+    }
+}
+
+AggregateIndex::Totals AggregateIndex::Query(PositionRange range) const {
+    Totals totals;
+    for (int col = range.top_left.col; col <= range.bottom_right.col; ++col) {
+        assert(IsIndexed(col));
+        const Column& column = columns_[col];
+        const size_t rows = column.kinds.size();
+        const size_t first = range.top_left.row;
+        if (first >= rows) {
+            continue;
+        }
+
+        // walks down from the last row, taking a whole node whenever it
+        // does not reach above the first row and a single row otherwise
+        size_t index = std::min<size_t>(range.bottom_right.row, rows - 1) + 1;
+        while (index > first) {
+            const size_t low_bit = LowBit(index);
+            if (index - low_bit >= first) {
+                const Node& node = column.nodes[index - 1];
+                totals.sum += node.sum;
+                totals.count += node.count;
+                totals.errors += node.errors;
+                totals.stale += node.stale;
+                index -= low_bit;
+            } else {
+                const Kind kind = column.kinds[index - 1];
+                totals.sum += column.values[index - 1];
+                totals.count += kind == Kind::Number;
+                totals.errors += kind == Kind::Error;
+                totals.stale += kind == Kind::Stale;
+                --index;
+            }
+        }
+    }
+    return totals;
+}
+
+std::vector<Position> AggregateIndex::GetStale(PositionRange range) const {
+    std::vector<Position> result;
+    for (int col = range.top_left.col; col <= range.bottom_right.col; ++col) {
+        assert(IsIndexed(col));
+        const Column& column = columns_[col];
+        const size_t rows = column.kinds.size();
+        const size_t first = range.top_left.row;
+        if (first >= rows) {
+            continue;
+        }
+
+        // the same walk as in Query(), going into the nodes with stale rows
+        size_t index = std::min<size_t>(range.bottom_right.row, rows - 1) + 1;
+        while (index > first) {
+            const size_t low_bit = LowBit(index);
+            if (index - low_bit >= first) {
+                if (column.nodes[index - 1].stale > 0) {
+                    CollectStale(column, index, col, result);
+                }
+                index -= low_bit;
+            } else {
+                if (column.kinds[index - 1] == Kind::Stale) {
+                    result.push_back({static_cast<int>(index - 1), col});
+                }
+                --index;
+            }
+        }
+    }
+    return result;
+}
+
+// Sets the node of the row from its own cell and the nodes it covers,
+// which have to be up to date
+void AggregateIndex::Recompute(Column& column, size_t row) {
+    const size_t index = row + 1;
+    Node node;
+    node.sum = column.values[row];
+    node.count = column.kinds[row] == Kind::Number;
+    node.errors = column.kinds[row] == Kind::Error;
+    node.stale = column.kinds[row] == Kind::Stale;
+    for (size_t step = 1; step < LowBit(index); step <<= 1) {
+        const Node& child = column.nodes[index - step - 1];
+        node.sum += child.sum;
+        node.count += child.count;
+        node.errors += child.errors;
+        node.stale += child.stale;
+    }
+    column.nodes[row] = node;
+}
+
+// A node covers its own row and the nodes Recompute() adds up
+void AggregateIndex::CollectStale(const Column& column, size_t index, int col, std::vector<Position>& result) {
+    if (column.kinds[index - 1] == Kind::Stale) {
+        result.push_back({static_cast<int>(index - 1), col});
+    }
+    for (size_t step = 1; step < LowBit(index); step <<= 1) {
+        if (column.nodes[index - step - 1].stale > 0) {
+            CollectStale(column, index - step, col, result);
+        }
+    }
+}
+
+void AggregateIndex::Grow(Column& column, size_t rows) {
+    const size_t old_rows = column.kinds.size();
+    const size_t new_rows = std::min<size_t>(std::max({rows, old_rows * 2, MIN_ROWS}), Position::MAX_ROWS);
+    column.values.resize(new_rows, 0.0);
+    column.kinds.resize(new_rows, Kind::None);
+    column.nodes.resize(new_rows);
+    // the old nodes cover old rows only and stay as they are
+    for (size_t row = old_rows; row < new_rows; ++row) {
+        Recompute(column, row);
+    }
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <vector>
+
+// Per-column Fenwick trees over what every cell adds to SUM, COUNT and
+// AVERAGE: its value if it is a number, an error mark if it holds an error.
+// A change costs O(log^2 rows) and a rectangle is totalled in about
+// O(columns * log rows) instead of a visit to every cell in it.
+//
+// Only the columns passed to AddColumn() are maintained, so that sheets
+// that never aggregate over a column pay nothing for it. A tree node is
+// recomputed from its children rather than adjusted by the change, and
+// ranges are summed without subtracting prefixes, so the totals depend on
+// the current values only and not on the order of the edits.
+//
+// A formula that has not been evaluated since it or one of its inputs
+// changed is kept as stale; its rows are found with GetStale() in about
+// O(stale rows * log^2 rows) so that they can be evaluated on demand.
+class AggregateIndex {
+public:
+    enum class Kind : uint8_t {
+        None,    // empty, text or an empty text cell
+        Number,
+        Error,
+        Stale,   // a formula whose value is not known yet
+    };
+
+    struct Totals {
+        double sum = 0.0;
+        size_t count = 0;
+        size_t errors = 0;
+        // the other totals are incomplete unless this is 0
+        size_t stale = 0;
+    };
+
+    explicit AggregateIndex(std::pmr::memory_resource* resource);
+
+    bool IsIndexed(int col) const {
+        return col < static_cast<int>(columns_.size()) && columns_[col].indexed;
+    }
+
+    // Starts maintaining an empty column; its cells are added with Set()
+    void AddColumn(int col);
+
+    // Ignored for the columns that are not indexed
+    void Set(Position pos, Kind kind, double value = 0.0);
+
+    // Every column of the range has to be indexed
+    Totals Query(PositionRange range) const;
+    // Positions of the stale rows of the range, in no particular order;
+    // every column of the range has to be indexed
+    std::vector<Position> GetStale(PositionRange range) const;
+
+    size_t GetIndexedColumnCount() const {
+        return indexed_count_;
+    }
+
+private:
+    struct Node {
+        double sum = 0.0;
+        uint32_t count = 0;
+        uint32_t errors = 0;
+        uint32_t stale = 0;
+    };
+
+    struct Column {
+        // by row; the values of rows that are not numbers are 0
+        std::pmr::vector<double> values;
+        std::pmr::vector<Kind> kinds;
+        // nodes[i] covers the rows (i + 1 - lowbit(i + 1), i]
+        std::pmr::vector<Node> nodes;
+        bool indexed = false;
+    };
+
+    std::pmr::vector<Column> columns_;
+    size_t indexed_count_ = 0;
+
+    static void Recompute(Column& column, size_t row);
+    static void Grow(Column& column, size_t rows);
+    static void CollectStale(const Column& column, size_t index, int col, std::vector<Position>& result);
+};
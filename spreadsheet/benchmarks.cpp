@@ -0,0 +1,444 @@
+#include "benchmarks.h"
+
+#include "FormulaAST.h"
+#include "column_kernels.h"
+#include "common.h"
+#include "formula.h"
+#include "log_duration.h"
+#include "sheet.h"
+
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+constexpr int DENSE_SIDE = 300;
+constexpr int SPARSE_SIDE = 2000;
+constexpr int SPARSE_CELLS = 40000;
+constexpr int TALL_ROWS = 16000;
+constexpr int FORMULA_ROWS = 16000;
+constexpr int FORMULA_COLUMN_PAIRS = 3;
+constexpr int CHAIN_LENGTH = 8000;
+constexpr int EVALUATIONS = 1000000;
+constexpr int PARSES = 200000;
+constexpr int COLUMN_PASSES = 200;
+constexpr int RANGE_LENGTH = 500;
+constexpr int RANGE_EVALUATIONS = 20000;
+constexpr int OVERLAPPING_RANGES = 100;
+constexpr int RANGE_EDITS = 200;
+constexpr int NORMALIZED_ROWS = 4000;
+constexpr int SUMMARY_ROWS = 100;
+constexpr int SUMMARY_EDITS = 1000;
+
+void FillDense(SheetInterface& sheet) {
+    for (int row = 0; row < DENSE_SIDE; ++row) {
+        for (int col = 0; col < DENSE_SIDE; ++col) {
+            sheet.SetCell({row, col}, std::to_string(row * DENSE_SIDE + col));
+        }
+    }
+}
+
+void FillSparse(SheetInterface& sheet) {
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<int> dist(0, SPARSE_SIDE - 1);
+    for (int i = 0; i < SPARSE_CELLS; ++i) {
+        sheet.SetCell({dist(gen), dist(gen)}, std::to_string(i));
+    }
+}
+
+// One formula per row of column A, as in an imported list
+void FillTall(SheetInterface& sheet) {
+    for (int row = 0; row < TALL_ROWS; ++row) {
+        sheet.SetCell({row, 0}, "=" + std::to_string(row) + "*2");
+    }
+}
+
+void ReadAll(const SheetInterface& sheet, Size size) {
+    size_t found = 0;
+    for (int row = 0; row < size.rows; ++row) {
+        for (int col = 0; col < size.cols; ++col) {
+            found += sheet.GetCell({row, col}) != nullptr;
+        }
+    }
+    std::cerr << "  cells found: " << found << std::endl;
+}
+
+void BenchmarkStorage(const std::string& name, void (*fill)(SheetInterface&), Size size) {
+    auto sheet = std::make_unique<Sheet>();
+    {
+        LOG_DURATION(name + " SetCell");
+        fill(*sheet);
+    }
+    std::cerr << "  grid bytes: " << sheet->GetMemoryStats().grid.bytes << std::endl;
+    {
+        LOG_DURATION(name + " GetCell sweep");
+        ReadAll(*sheet, size);
+    }
+    {
+        std::ostringstream out;
+        LOG_DURATION(name + " PrintValues");
+        sheet->PrintValues(out);
+    }
+    {
+        std::ostringstream out;
+        LOG_DURATION(name + " PrintTexts");
+        sheet->PrintTexts(out);
+    }
+}
+
+void BenchmarkFormulaLoad() {
+    auto sheet = std::make_unique<Sheet>();
+    {
+        LOG_DURATION("formulas SetCell");
+        for (int pair = 0; pair < FORMULA_COLUMN_PAIRS; ++pair) {
+            const int col = pair * 2;
+            const std::string input_col = Position{0, col}.ToString().substr(0, 1);
+            for (int row = 0; row < FORMULA_ROWS; ++row) {
+                sheet->SetCell({row, col}, std::to_string(row));
+                sheet->SetCell({row, col + 1}, "=" + input_col + std::to_string(row + 1) + "*2+(1-3)/4");
+            }
+        }
+    }
+    // each filled column shares one formula
+    std::cerr << "  cache misses: " << sheet->GetFormulaCache().GetStats().misses
+              << ", formula bytes: " << sheet->GetMemoryStats().formulas.bytes << std::endl;
+    {
+        std::ostringstream out;
+        LOG_DURATION("formulas PrintTexts");
+        sheet->PrintTexts(out);
+    }
+    {
+        LOG_DURATION("formulas teardown");
+        sheet.reset();
+    }
+}
+
+// Columns of the same formula, as after filling down an absolute lookup
+void BenchmarkSharedFormulas() {
+    Sheet sheet;
+    sheet.SetCell({0, 0}, "3");
+    {
+        LOG_DURATION("shared formulas SetCell");
+        for (int col = 1; col <= FORMULA_COLUMN_PAIRS; ++col) {
+            for (int row = 0; row < FORMULA_ROWS; ++row) {
+                sheet.SetCell({row, col}, "=$A$1*1.05+2");
+            }
+        }
+    }
+    const auto stats = sheet.GetFormulaCache().GetStats();
+    std::cerr << "  cache hits: " << stats.hits << ", misses: " << stats.misses
+              << ", formula bytes: " << sheet.GetMemoryStats().formulas.bytes
+              << ", cell bytes: " << sheet.GetMemoryStats().cells.bytes << std::endl;
+}
+
+// A1 holds a number, every next row adds one to the row above
+std::vector<std::pair<Position, std::string>> MakeChain() {
+    std::vector<std::pair<Position, std::string>> cells;
+    cells.reserve(CHAIN_LENGTH);
+    cells.push_back({{0, 0}, "1"});
+    for (int row = 1; row < CHAIN_LENGTH; ++row) {
+        cells.push_back({{row, 0}, "=A" + std::to_string(row) + "+1"});
+    }
+    return cells;
+}
+
+void BenchmarkChainLoad() {
+    {
+        Sheet sheet;
+        auto cells = MakeChain();
+        LOG_DURATION("chain SetCell one by one");
+        for (auto& [pos, text] : cells) {
+            sheet.SetCell(pos, std::move(text));
+        }
+    }
+    {
+        Sheet sheet;
+        auto cells = MakeChain();
+        LOG_DURATION("chain SetCells");
+        sheet.SetCells(std::move(cells));
+    }
+}
+
+void BenchmarkParse() {
+    const std::string expressions[] = {"A1+B2*C3", "(1+2)*A1/4-ZZ100", "-(B7-3.5e2)/(C8+D9*(E10-1))"};
+    size_t cells = 0;
+    {
+        LOG_DURATION("ParseFormula");
+        for (int i = 0; i < PARSES; ++i) {
+            cells += ParseFormula(expressions[i % 3])->GetReferencedCells().size();
+        }
+    }
+    std::cerr << "  cells referenced: " << cells << std::endl;
+}
+
+void BenchmarkEvaluate() {
+    Sheet sheet;
+    for (int row = 0; row < 8; ++row) {
+        for (int col = 0; col < 8; ++col) {
+            sheet.SetCell({row, col}, std::to_string(row + col + 1));
+        }
+    }
+    auto formula = ParseFormula("(A1+B2)*C3-D4/2+E5*(F6-1)/-(G7+H8)");
+
+    double sum = 0.0;
+    {
+        LOG_DURATION("formula Evaluate");
+        for (int i = 0; i < EVALUATIONS; ++i) {
+            sum += std::get<double>(formula->Evaluate(sheet));
+        }
+    }
+    std::cerr << "  checksum: " << sum << std::endl;
+}
+
+// Every formula of the cone ends up as an error: the first row divides by
+// zero and each next row refers to the row above
+void BenchmarkErrorCone() {
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells;
+    cells.push_back({{0, 0}, "=1/0"});
+    cells.push_back({{0, 1}, "text"});
+    for (int row = 1; row < CHAIN_LENGTH; ++row) {
+        const std::string above = std::to_string(row);
+        cells.push_back({{row, 0}, "=A" + above + "*2+1"});
+        cells.push_back({{row, 1}, "=B" + above + "+A" + above});
+    }
+    {
+        LOG_DURATION("error cone SetCells");
+        sheet.SetCells(std::move(cells));
+    }
+
+    auto formula = ParseFormula("A100+B100/2");
+    size_t errors = 0;
+    {
+        LOG_DURATION("error formula Evaluate");
+        for (int i = 0; i < EVALUATIONS; ++i) {
+            errors += std::holds_alternative<FormulaError>(formula->Evaluate(sheet));
+        }
+    }
+    std::cerr << "  errors: " << errors << std::endl;
+}
+
+// A pricing column: =A{r}*B{r}+C{r} down the whole height of the sheet
+void BenchmarkColumnRun() {
+    const int rows = Position::MAX_ROWS;
+    std::vector<std::pair<Position, std::string>> cells;
+    cells.reserve(rows * 4);
+    for (int row = 0; row < rows; ++row) {
+        const std::string n = std::to_string(row + 1);
+        cells.push_back({{row, 0}, std::to_string(row % 1000)});
+        cells.push_back({{row, 1}, std::to_string(row % 7 + 1)});
+        cells.push_back({{row, 2}, std::to_string(row % 13)});
+        cells.push_back({{row, 3}, "=A" + n + "*B" + n + "+C" + n});
+    }
+    Sheet sheet;
+    {
+        LOG_DURATION("column run SetCells");
+        sheet.SetCells(std::move(cells));
+    }
+
+    FormulaAST ast = ParseFormulaAST("A1*B1+C1");
+    double sum = 0.0;
+    {
+        LOG_DURATION("column run per cell");
+        for (int pass = 0; pass < COLUMN_PASSES; ++pass) {
+            for (int row = 0; row < rows; ++row) {
+                sum += std::get<double>(ast.Execute([&sheet](Position pos) {
+                    return sheet.GetCellValue(pos);
+                }, {row, 0}));
+            }
+        }
+    }
+    std::cerr << "  checksum: " << sum << std::endl;
+
+    std::vector<FormulaAST::Result> results(rows, 0.0);
+    auto load_column = [&sheet](Position first, size_t count, double* values, bool* not_number) {
+        sheet.GetColumnValues(first, count, values, not_number);
+    };
+    for (auto instruction_set : {InstructionSet::Scalar, InstructionSet::Sse2, InstructionSet::Avx2}) {
+        const ColumnKernels* kernels = GetColumnKernels(instruction_set);
+        if (kernels == nullptr) {
+            continue;
+        }
+        sum = 0.0;
+        {
+            LOG_DURATION(std::string("column run batched, ") + ToString(instruction_set));
+            for (int pass = 0; pass < COLUMN_PASSES; ++pass) {
+                ast.ExecuteColumn(load_column, {0, 0}, rows, results.data(), *kernels);
+                for (const auto& result : results) {
+                    sum += std::get<double>(result);
+                }
+            }
+        }
+        std::cerr << "  checksum: " << sum << std::endl;
+    }
+}
+
+// The same total written as a range and as a chain of additions
+void BenchmarkRangeSum() {
+    Sheet sheet;
+    std::string chain;
+    for (int row = 0; row < RANGE_LENGTH; ++row) {
+        const std::string name = Position{row, 0}.ToString();
+        sheet.SetCell({row, 0}, std::to_string(row % 100));
+        chain += (row == 0 ? "" : "+") + name;
+    }
+    const std::string range = "SUM(A1:" + Position{RANGE_LENGTH - 1, 0}.ToString() + ")";
+    for (const auto& expression : {range, chain}) {
+        auto formula = ParseFormula(expression);
+        double sum = 0.0;
+        {
+            LOG_DURATION(expression.size() > 40 ? "sum as a chain of cells" : "sum as a range");
+            for (int i = 0; i < RANGE_EVALUATIONS; ++i) {
+                sum += std::get<double>(formula->Evaluate(sheet));
+            }
+        }
+        std::cerr << "  checksum: " << sum << std::endl;
+    }
+}
+
+// Dashboard-like load: many long ranges over one column, all evaluated
+// again after every edit of the column. SUM is served by the aggregate
+// index, MAX walks the cells.
+void BenchmarkOverlappingRanges() {
+    Sheet sheet;
+    for (int row = 0; row < Position::MAX_ROWS; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row % 1000));
+    }
+    for (const std::string function : {"SUM", "MAX"}) {
+        std::vector<std::unique_ptr<FormulaInterface>> formulas;
+        for (int i = 0; i < OVERLAPPING_RANGES; ++i) {
+            const Position last{Position::MAX_ROWS - 1 - i * 50, 0};
+            formulas.push_back(ParseFormula(function + "(A" + std::to_string(i + 1) + ":" + last.ToString() + ")"));
+        }
+        double sum = 0.0;
+        {
+            LOG_DURATION(function + " of overlapping ranges after every edit");
+            for (int edit = 0; edit < RANGE_EDITS; ++edit) {
+                sheet.SetCell({edit * 7 % Position::MAX_ROWS, 0}, std::to_string(edit));
+                for (const auto& formula : formulas) {
+                    sum += std::get<double>(formula->Evaluate(sheet));
+                }
+            }
+        }
+        std::cerr << "  checksum: " << sum << std::endl;
+    }
+}
+
+// Generated formulas repeat their intermediates, and a filled column
+// divides by the same aggregate in every row
+void BenchmarkRepeatedSubexpressions() {
+    Sheet sheet;
+    for (int row = 0; row < NORMALIZED_ROWS; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row % 97));
+        sheet.SetCell({row, 1}, std::to_string(row % 13 + 1));
+    }
+    auto formula = ParseFormula("(A1*B1+A2)/(A1*B1+A2+B2)*(A1*B1+A2)-(A1*B1+A2)/B1");
+    double sum = 0.0;
+    {
+        LOG_DURATION("repeated subexpressions Evaluate");
+        for (int i = 0; i < EVALUATIONS; ++i) {
+            sum += std::get<double>(formula->Evaluate(sheet));
+        }
+    }
+    std::cerr << "  checksum: " << sum << std::endl;
+
+    std::vector<std::pair<Position, std::string>> cells;
+    const std::string last = std::to_string(NORMALIZED_ROWS);
+    for (int row = 0; row < NORMALIZED_ROWS; ++row) {
+        const std::string n = std::to_string(row + 1);
+        cells.push_back({{row, 2}, "=A" + n + "/MAX($A$1:$A$" + last + ")*B" + n});
+    }
+    {
+        LOG_DURATION("column normalized by its MAX SetCells");
+        sheet.SetCells(std::move(cells));
+    }
+    std::cerr << "  last: " << std::get<double>(sheet.GetCell({NORMALIZED_ROWS - 1, 2})->GetValue()) << std::endl;
+}
+
+// Bulk import of a filled sheet of which only a small summary is read,
+// then edits of the inputs, each followed by a read of the summary
+void BenchmarkLazyImport() {
+    const int rows = Position::MAX_ROWS;
+    std::vector<std::pair<Position, std::string>> cells;
+    cells.reserve(rows * 6 + 1);
+    for (int row = 0; row < rows; ++row) {
+        const std::string n = std::to_string(row + 1);
+        cells.push_back({{row, 0}, std::to_string(row % 100)});
+        cells.push_back({{row, 1}, std::to_string(row % 7 + 1)});
+        cells.push_back({{row, 2}, "=A" + n + "*B" + n + "+1"});
+        cells.push_back({{row, 3}, "=C" + n + "/B" + n + "-A" + n});
+        // a running total is evaluated cell by cell
+        cells.push_back({{row, 4}, row == 0 ? "=D1" : "=E" + std::to_string(row) + "+D" + n});
+        cells.push_back({{row, 5}, "=MAX(A" + n + ":B" + n + ")*C" + n});
+    }
+    const Position summary{0, 6};
+    cells.push_back({summary, "=SUM(D1:F" + std::to_string(SUMMARY_ROWS) + ")"});
+
+    for (auto mode : {Sheet::EvaluationMode::Eager, Sheet::EvaluationMode::Lazy}) {
+        const std::string name = mode == Sheet::EvaluationMode::Eager ? "eager" : "lazy";
+        Sheet sheet;
+        sheet.SetEvaluationMode(mode);
+        double sum = 0.0;
+        {
+            LOG_DURATION("import read through a summary, " + name);
+            sheet.SetCells(cells);
+            sum += std::get<double>(sheet.GetCell(summary)->GetValue());
+        }
+        if (mode == Sheet::EvaluationMode::Lazy) {
+            LOG_DURATION("edits read through a summary, " + name);
+            for (int edit = 0; edit < SUMMARY_EDITS; ++edit) {
+                sheet.SetCell({edit % SUMMARY_ROWS, 0}, std::to_string(edit % 100));
+                sum += std::get<double>(sheet.GetCell(summary)->GetValue());
+            }
+        }
+        std::cerr << "  checksum: " << sum << std::endl;
+    }
+}
+
+void BenchmarkMassClear() {
+    auto sheet = CreateSheet();
+    FillDense(*sheet);
+    {
+        LOG_DURATION("dense ClearCell from top-left");
+        for (int row = 0; row < DENSE_SIDE; ++row) {
+            for (int col = 0; col < DENSE_SIDE; ++col) {
+                sheet->ClearCell({row, col});
+            }
+        }
+    }
+
+    FillDense(*sheet);
+    {
+        LOG_DURATION("dense ClearCell from bottom-right");
+        for (int row = DENSE_SIDE - 1; row >= 0; --row) {
+            for (int col = DENSE_SIDE - 1; col >= 0; --col) {
+                sheet->ClearCell({row, col});
+            }
+        }
+    }
+    std::cerr << "  printable size after clear: " << sheet->GetPrintableSize().rows << 'x'
+              << sheet->GetPrintableSize().cols << std::endl;
+}
+
+}  // namespace
+
+void RunBenchmarks() {
+    BenchmarkStorage("dense", FillDense, {DENSE_SIDE, DENSE_SIDE});
+    BenchmarkStorage("sparse", FillSparse, {SPARSE_SIDE, SPARSE_SIDE});
+    BenchmarkStorage("tall", FillTall, {TALL_ROWS, 1});
+    BenchmarkFormulaLoad();
+    BenchmarkSharedFormulas();
+    BenchmarkChainLoad();
+    BenchmarkParse();
+    BenchmarkEvaluate();
+    BenchmarkErrorCone();
+    BenchmarkColumnRun();
+    BenchmarkRangeSum();
+    BenchmarkOverlappingRanges();
+    BenchmarkRepeatedSubexpressions();
+    BenchmarkLazyImport();
+    BenchmarkMassClear();
+}
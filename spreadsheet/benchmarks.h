@@ -0,0 +1,4 @@
+#pragma once
+
+// Запуск замеров производительности: spreadsheet --bench
+void RunBenchmarks();
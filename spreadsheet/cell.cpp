@@ -1,5 +1,7 @@
 #include "cell.h"
 
+#include "sheet.h"
+
 #include <cassert>
 #include <iostream>
 #include <string>
@@ -7,104 +9,118 @@
 
 Cell::Impl::Impl() {}
 
-Cell::TextImpl::TextImpl(CellParents& parents) {
-    if (parents.has_value()) {
-        for (const auto & parent : parents.value()) {
-            parents_.emplace(parent);
-        }
-    }
+Cell::TextImpl::TextImpl(Sheet& sheet)
+: sheet_(sheet) {
 }
 
 void Cell::TextImpl::Set(std::string text)  {
-    text_ = std::move(text);
+    text_ = sheet_.GetStringPool().Intern(text);
 }
 
 CellInterface::Value Cell::TextImpl::GetValue() const {
-    if (text_ == "") {
+    std::string_view text = text_.View();
+    if (text == "") {
         return 0.0;
     }
 
-    double number = std::atoi(text_.c_str());
-    if (!(number == 0 && text_ != "0")) {
+    double number = std::atoi(text_.CStr());
+    if (!(number == 0 && text != "0")) {
         return number;
     }
 
-    if (text_.at(0) == '\'') {
-        return text_.substr(1);
+    if (text.at(0) == '\'') {
+        return std::string(text.substr(1));
     } else {
-        return text_;
+        return std::string(text);
     } 
           
 }
 
 std::string Cell::TextImpl::GetText() const {
-    return text_;
+    return std::string(text_.View());
 }
 
 bool Cell::TextImpl::IsReferenced() const {
     return is_referenced_;
 }
 
-void Cell::TextImpl::SetParent(const Position& parent_pos) {
-    parents_.emplace(parent_pos);
+void Cell::TextImpl::Evaluate() {
+}
+
+bool Cell::TextImpl::IsStale() const {
+    return false;
+}
+
+bool Cell::TextImpl::MarkStale() {
+    return false;
 }
 
-std::unordered_set<Position, PositionHasher> Cell::TextImpl::GetParents() const {
-    return parents_;
+std::pmr::memory_resource* Cell::TextImpl::GetMemoryResource() const {
+    return sheet_.GetMemoryResource();
 }
 
-Cell::FormulaImpl::FormulaImpl(Position& pos, const SheetInterface& sheet, CellParents& parents) 
+size_t Cell::TextImpl::GetAllocationSize() const {
+    return sizeof(TextImpl);
+}
+
+Cell::FormulaImpl::FormulaImpl(Position pos, Sheet& sheet)
 : pos_(pos), sheet_(sheet) {
-    if (parents.has_value()) {
-        for (const auto & parent : parents.value()) {
-            parents_.emplace(parent);
-        }
-    }
 }
 
 void Cell::FormulaImpl::Set(std::string text)  {
-    formula_ = ParseFormula(text);
-    value_ = formula_->Evaluate(sheet_);
-    referenced_cells_ = formula_->GetReferencedCells();
-    if (!referenced_cells_.empty()) {
-        is_referenced_ = true;
-    }
+    Install(sheet_.GetFormulaCache().Get(text, pos_));
 
-    stack_.push_back((Impl*)this);
-    DFS(stack_, pos_, stack_.front(), visited_);
+    std::vector<Position> refs = GetReferencedCells();
+    std::vector<PositionRange> ranges = GetReferencedRanges();
+    if (sheet_.GetDependencyGraph().WouldCreateCycle(pos_, PositionSpan(refs.data(), refs.data() + refs.size()),
+                                                     RangeSpan(ranges.data(), ranges.data() + ranges.size()))) {
+        throw CircularDependencyException("The circle here");
+    }
 
-    if (is_referenced_) {
-        for (const auto child : referenced_cells_) {
-            auto child_cell = (Cell*)(sheet_.GetCell({ child.row, child.col }));
-            auto impl_ref_child = child_cell->GetImplRef();
-            impl_ref_child->SetParent(pos_);
+    // referenced positions that are still empty get an empty cell; the
+    // empty parts of ranges stay empty
+    for (const auto ref : refs) {
+        if (!sheet_.Contains(ref)) {
+            sheet_.SetCell(ref, "");
         }
     }
+    if (sheet_.GetEvaluationMode() == Sheet::EvaluationMode::Eager) {
+        Evaluate();
+    }
 }
 
-void Cell::FormulaImpl::DFS(std::deque<Impl*>& stack, Position pos, Impl* impl_ref, std::unordered_set<Position, PositionHasher>& visited) {
-    if (visited.count(pos) > 0) {
-        throw CircularDependencyException("The circle here");
-    } else {
-        visited.emplace(pos);
-    }
-    
-    stack.pop_front();
-    if (impl_ref->IsReferenced()) {
-        for (const auto ref : ((FormulaImpl*)impl_ref)->GetReferencedCells()) {
-            auto cell = (Cell*)(sheet_.GetCell({ ref.row, ref.col }));
-            auto impl_ref_internal = cell->GetImplRef();
-            stack.push_front(impl_ref_internal);
-            DFS(stack, { ref.row, ref.col }, stack.front(), visited);
-        }
-    }   
+void Cell::FormulaImpl::Install(FormulaCache::Handle formula) {
+    formula_ = std::move(formula);
+    is_stale_ = true;
+    is_referenced_ = !formula_->GetReferencedCells().empty() || !formula_->GetReferencedRanges().empty();
+}
+
+void Cell::FormulaImpl::Evaluate() {
+    value_ = formula_->Evaluate(sheet_, formula_.GetOffset(pos_));
+    is_stale_ = false;
 }
 
-void Cell::FormulaImpl::SetParent(const Position& parent_pos) {
-    parents_.emplace(parent_pos);
+void Cell::FormulaImpl::SetValue(FormulaInterface::Value value) {
+    value_ = value;
+    is_stale_ = false;
+}
+
+bool Cell::FormulaImpl::IsStale() const {
+    return is_stale_;
+}
+
+bool Cell::FormulaImpl::MarkStale() {
+    if (is_stale_) {
+        return false;
+    }
+    is_stale_ = true;
+    return true;
 }
 
 CellInterface::Value Cell::FormulaImpl::GetValue() const {
+    if (is_stale_) {
+        sheet_.EvaluateStale(pos_);
+    }
     if (std::holds_alternative<double>(value_)) {
         return std::get<double>(value_);
     } else  {
@@ -113,53 +129,76 @@ CellInterface::Value Cell::FormulaImpl::GetValue() const {
 }
 
 std::string Cell::FormulaImpl::GetText() const {
-    return '=' + formula_->GetExpression();
+    return '=' + formula_->GetExpression(formula_.GetOffset(pos_));
 }
 
 std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const {
-    return referenced_cells_;
+    return formula_->GetReferencedCells(formula_.GetOffset(pos_));
+}
+
+std::vector<PositionRange> Cell::FormulaImpl::GetReferencedRanges() const {
+    return formula_->GetReferencedRanges(formula_.GetOffset(pos_));
 }
 
 bool Cell::FormulaImpl::IsReferenced() const {
     return is_referenced_;
 }
 
-std::unordered_set<Position, PositionHasher> Cell::FormulaImpl::GetParents() const {
-    return parents_;
+std::pmr::memory_resource* Cell::FormulaImpl::GetMemoryResource() const {
+    return sheet_.GetMemoryResource();
+}
+
+size_t Cell::FormulaImpl::GetAllocationSize() const {
+    return sizeof(FormulaImpl);
 }
 
-Cell::Cell(Position pos, SheetInterface& sheet)
-: pos_(pos), sheet_(sheet) { }
+Cell::Cell(Position pos, Sheet& sheet)
+: resource_(sheet.GetMemoryResource()), pos_(pos), sheet_(sheet) { }
+
+Cell::~Cell() = default;
 
-Cell::~Cell() {
-    impl_.release();
+std::pmr::memory_resource* Cell::GetMemoryResource() const {
+    return resource_;
 }
 
 void Cell::Set(std::string text) {
-    CellParents parents;
-    if (impl_ != nullptr) {
-        parents = impl_->GetParents();
-    }
-
+    std::vector<Position> refs;
+    std::vector<PositionRange> ranges;
     if (text.size() > 1 && text.at(0) == '=') {
-        std::unique_ptr<FormulaImpl> form(new FormulaImpl(pos_, sheet_, parents));
-        std::unique_ptr<Impl> temp = std::move(form);
-        try {
-            temp->Set(text.substr(1));
-        } catch (const CircularDependencyException&) {
-            temp.release();
-            throw CircularDependencyException("The circle here");
-        }
+        PmrPtr<Impl> temp = MakePmr<FormulaImpl>(resource_, pos_, sheet_);
+        temp->Set(text.substr(1));
         impl_ = std::move(temp);
+        refs = GetReferencedCells();
+        ranges = GetReferencedRanges();
     } else {
-        std::unique_ptr<TextImpl> txt(new TextImpl(parents));
-        impl_ = std::move(txt);
+        impl_ = MakePmr<TextImpl>(resource_, sheet_);
         impl_->Set(text);
     }  
+    sheet_.GetDependencyGraph().SetReferences(pos_, PositionSpan(refs.data(), refs.data() + refs.size()),
+                                              RangeSpan(ranges.data(), ranges.data() + ranges.size()));
+}
+
+void Cell::SetFormula(FormulaCache::Handle formula) {
+    auto impl = MakePmr<FormulaImpl>(resource_, pos_, sheet_);
+    impl->Install(std::move(formula));
+    impl_ = std::move(impl);
+    std::vector<Position> refs = GetReferencedCells();
+    std::vector<PositionRange> ranges = GetReferencedRanges();
+    sheet_.GetDependencyGraph().SetReferences(pos_, PositionSpan(refs.data(), refs.data() + refs.size()),
+                                              RangeSpan(ranges.data(), ranges.data() + ranges.size()));
+}
+
+void Cell::Evaluate() {
+    impl_->Evaluate();
+}
+
+void Cell::SetFormulaValue(FormulaInterface::Value value) {
+    ((Cell::FormulaImpl*)(impl_.get()))->SetValue(value);
 }
 
 void Cell::Clear() {
-    impl_.release();
+    sheet_.GetDependencyGraph().SetReferences(pos_, {});
+    impl_.reset();
 }
 
 Cell::Value Cell::GetValue() const {
@@ -178,14 +217,38 @@ std::vector<Position> Cell::GetReferencedCells() const {
     }
 }
 
+std::vector<PositionRange> Cell::GetReferencedRanges() const {
+    if (impl_.get()->IsReferenced()) {
+        return ((Cell::FormulaImpl*)(impl_.get()))->GetReferencedRanges();
+    } else {
+        return std::vector<PositionRange>{};
+    }
+}
+
+bool Cell::IsStale() const {
+    return impl_.get()->IsStale();
+}
+
+bool Cell::MarkStale() {
+    return impl_.get()->MarkStale();
+}
+
 bool Cell::IsReferenced() const {
     return impl_.get()->IsReferenced();
 }
 
-Cell::Impl* Cell::GetImplRef() {
-    return impl_.get();
+NumberCell::NumberCell(double value)
+: value_(value) {
+}
+
+CellInterface::Value NumberCell::GetValue() const {
+    return value_;
 }
 
-std::unordered_set<Position, PositionHasher> Cell::GetParents() const {
-    return impl_.get()->GetParents();
-}
\ No newline at end of file
+std::string NumberCell::GetText() const {
+    return std::to_string(static_cast<int>(value_));
+}
+
+std::vector<Position> NumberCell::GetReferencedCells() const {
+    return {};
+}
@@ -2,30 +2,48 @@
 
 #include "common.h"
 #include "formula.h"
+#include "formula_cache.h"
+#include "pmr_ptr.h"
+#include "string_pool.h"
 
-#include <unordered_set>
-#include <deque>
 #include <optional>
 #include <functional>
+#include <memory_resource>
 
 class Sheet;
 
-class Cell : public CellInterface {
+class Cell final : public CellInterface {
 public:
-    using CellParents = std::optional<std::unordered_set<Position, PositionHasher>>;
-
-    Cell(Position pos, SheetInterface& sheet);
+    Cell(Position pos, Sheet& sheet);
     ~Cell();
 
+    // The sheet's pool the cell and its contents are allocated from
+    std::pmr::memory_resource* GetMemoryResource() const;
+
     void Set(std::string text);
     void Clear();
 
+    // Installs an already parsed formula without checking it for cycles
+    // and without evaluating it; the value is computed by Evaluate()
+    void SetFormula(FormulaCache::Handle formula);
+    void Evaluate();
+    // Stores the value of the formula computed elsewhere, e.g. for a whole
+    // column run at once
+    void SetFormulaValue(FormulaInterface::Value value);
+
+    // A stale formula is evaluated by the sheet when its value is read,
+    // see Sheet::EvaluationMode. Text cells are never stale.
+    bool IsStale() const;
+    // Whether the cell holds a formula that was not stale before
+    bool MarkStale();
+
     CellInterface::Value GetValue() const override;
     std::string GetText() const override;
     std::vector<Position> GetReferencedCells() const override;
+    // Ranges the formula aggregates over, see FormulaInterface
+    std::vector<PositionRange> GetReferencedRanges() const;
 
     bool IsReferenced() const;
-    std::unordered_set<Position, PositionHasher> GetParents() const;
 private:
     class Impl {
     public:
@@ -35,52 +53,76 @@ private:
         virtual CellInterface::Value GetValue() const = 0;
         virtual std::string GetText() const = 0;
         virtual bool IsReferenced() const = 0;
-        virtual std::unordered_set<Position, PositionHasher> GetParents() const = 0;
-        virtual void SetParent(const Position& parent_pos) = 0;
+        virtual void Evaluate() = 0;
+        virtual bool IsStale() const = 0;
+        virtual bool MarkStale() = 0;
+        // for PmrDeleter
+        virtual std::pmr::memory_resource* GetMemoryResource() const = 0;
+        virtual size_t GetAllocationSize() const = 0;
     };
 
     class TextImpl : public Impl {
     public:
-        TextImpl(CellParents& parents);
+        TextImpl(Sheet& sheet);
         void Set(std::string text);
         CellInterface::Value GetValue() const;
         std::string GetText() const;
         bool IsReferenced() const;
-        std::unordered_set<Position, PositionHasher> GetParents() const;
-        void SetParent(const Position& parent_pos);
+        void Evaluate();
+        bool IsStale() const;
+        bool MarkStale();
+        std::pmr::memory_resource* GetMemoryResource() const;
+        size_t GetAllocationSize() const;
     private:
-        std::string text_;
+        Sheet& sheet_;
+        StringPool::Handle text_;
         bool is_referenced_ = false;
-        std::unordered_set<Position, PositionHasher> parents_;
     };
 
     class FormulaImpl : public Impl {
     public:
-        FormulaImpl(Position& pos, const SheetInterface& sheet, CellParents& parents);
+        FormulaImpl(Position pos, Sheet& sheet);
         void Set(std::string text);
+        void Install(FormulaCache::Handle formula);
         CellInterface::Value GetValue() const;
         std::string GetText() const;
         std::vector<Position> GetReferencedCells() const;
+        std::vector<PositionRange> GetReferencedRanges() const;
         bool IsReferenced() const;
-        std::unordered_set<Position, PositionHasher> GetParents() const;
-        void SetParent(const Position& parent_pos);
+        void Evaluate();
+        void SetValue(FormulaInterface::Value value);
+        bool IsStale() const;
+        bool MarkStale();
+        std::pmr::memory_resource* GetMemoryResource() const;
+        size_t GetAllocationSize() const;
     private:
-        std::unique_ptr<FormulaInterface> formula_;   
-        FormulaInterface::Value value_ = 0.0;      
+        // shared with every cell holding the same relative form, moved
+        // here by the offset of pos_ from its anchor
+        FormulaCache::Handle formula_;
+        FormulaInterface::Value value_ = 0.0;
         Position pos_;
-        const SheetInterface& sheet_;
-        std::vector<Position> referenced_cells_;
-        bool is_referenced_ = false;       
-        std::unordered_set<Position, PositionHasher> visited_;
-        std::deque<Impl*> stack_;
-        std::unordered_set<Position, PositionHasher> parents_;
-        
-        void DFS(std::deque<Impl*>& stack, Position pos, Impl* impl_ref, std::unordered_set<Position, PositionHasher>& visited);
+        Sheet& sheet_;
+        bool is_referenced_ = false;
+        // value_ is not computed for the current formula and inputs
+        bool is_stale_ = true;
     };
 
-    std::unique_ptr<Impl> impl_;
+    std::pmr::memory_resource* resource_;
+    PmrPtr<Impl> impl_;
     Position pos_;
-    const SheetInterface& sheet_;
+    Sheet& sheet_;
     bool is_referenced_ = false;
-    Impl* GetImplRef();
-};
\ No newline at end of file
+};
+
+// Read-only stand-in for a number that is stored without a Cell object
+class NumberCell : public CellInterface {
+public:
+    explicit NumberCell(double value = 0.0);
+
+    CellInterface::Value GetValue() const override;
+    std::string GetText() const override;
+    std::vector<Position> GetReferencedCells() const override;
+
+private:
+    double value_;
+};
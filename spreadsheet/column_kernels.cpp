@@ -0,0 +1,211 @@
+#include "column_kernels.h"
+
+#include <cmath>
+#include <initializer_list>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define COLUMN_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+
+#ifdef COLUMN_KERNELS_X86
+// AVX2 code is compiled for its own functions only, the rest of the
+// program keeps running on CPUs without it
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+struct Add {
+    static double Apply(double lhs, double rhs) {
+        return lhs + rhs;
+    }
+#ifdef COLUMN_KERNELS_X86
+    static __m128d Apply(__m128d lhs, __m128d rhs) {
+        return _mm_add_pd(lhs, rhs);
+    }
+    AVX2_TARGET static __m256d Apply(__m256d lhs, __m256d rhs) {
+        return _mm256_add_pd(lhs, rhs);
+    }
+#endif
+};
+
+struct Subtract {
+    static double Apply(double lhs, double rhs) {
+        return lhs - rhs;
+    }
+#ifdef COLUMN_KERNELS_X86
+    static __m128d Apply(__m128d lhs, __m128d rhs) {
+        return _mm_sub_pd(lhs, rhs);
+    }
+    AVX2_TARGET static __m256d Apply(__m256d lhs, __m256d rhs) {
+        return _mm256_sub_pd(lhs, rhs);
+    }
+#endif
+};
+
+struct Multiply {
+    static double Apply(double lhs, double rhs) {
+        return lhs * rhs;
+    }
+#ifdef COLUMN_KERNELS_X86
+    static __m128d Apply(__m128d lhs, __m128d rhs) {
+        return _mm_mul_pd(lhs, rhs);
+    }
+    AVX2_TARGET static __m256d Apply(__m256d lhs, __m256d rhs) {
+        return _mm256_mul_pd(lhs, rhs);
+    }
+#endif
+};
+
+struct Divide {
+    static double Apply(double lhs, double rhs) {
+        return lhs / rhs;
+    }
+#ifdef COLUMN_KERNELS_X86
+    static __m128d Apply(__m128d lhs, __m128d rhs) {
+        return _mm_div_pd(lhs, rhs);
+    }
+    AVX2_TARGET static __m256d Apply(__m256d lhs, __m256d rhs) {
+        return _mm256_div_pd(lhs, rhs);
+    }
+#endif
+};
+
+template <typename Op>
+bool ApplyScalar(double* lhs, const double* rhs, size_t count) {
+    bool not_finite = false;
+    for (size_t i = 0; i < count; ++i) {
+        lhs[i] = Op::Apply(lhs[i], rhs[i]);
+        not_finite |= !std::isfinite(lhs[i]);
+    }
+    return not_finite;
+}
+
+void NegateScalar(double* values, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        values[i] = -values[i];
+    }
+}
+
+constexpr ColumnKernels SCALAR_KERNELS = {
+    InstructionSet::Scalar,
+    ApplyScalar<Add>,
+    ApplyScalar<Subtract>,
+    ApplyScalar<Multiply>,
+    ApplyScalar<Divide>,
+    NegateScalar,
+};
+
+#ifdef COLUMN_KERNELS_X86
+
+// x - x is 0 for a finite x and NaN for infinities and NaN, so the lanes
+// that compare unordered with themselves are the ones that are not finite
+
+template <typename Op>
+bool ApplySse2(double* lhs, const double* rhs, size_t count) {
+    __m128d not_finite = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        const __m128d result = Op::Apply(_mm_loadu_pd(lhs + i), _mm_loadu_pd(rhs + i));
+        _mm_storeu_pd(lhs + i, result);
+        const __m128d zero_if_finite = _mm_sub_pd(result, result);
+        not_finite = _mm_or_pd(not_finite, _mm_cmpunord_pd(zero_if_finite, zero_if_finite));
+    }
+    const bool tail_not_finite = ApplyScalar<Op>(lhs + i, rhs + i, count - i);
+    return _mm_movemask_pd(not_finite) != 0 || tail_not_finite;
+}
+
+void NegateSse2(double* values, size_t count) {
+    const __m128d sign = _mm_set1_pd(-0.0);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        _mm_storeu_pd(values + i, _mm_xor_pd(_mm_loadu_pd(values + i), sign));
+    }
+    NegateScalar(values + i, count - i);
+}
+
+template <typename Op>
+AVX2_TARGET bool ApplyAvx2(double* lhs, const double* rhs, size_t count) {
+    __m256d not_finite = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m256d result = Op::Apply(_mm256_loadu_pd(lhs + i), _mm256_loadu_pd(rhs + i));
+        _mm256_storeu_pd(lhs + i, result);
+        const __m256d zero_if_finite = _mm256_sub_pd(result, result);
+        not_finite = _mm256_or_pd(not_finite, _mm256_cmp_pd(zero_if_finite, zero_if_finite, _CMP_UNORD_Q));
+    }
+    const bool tail_not_finite = ApplySse2<Op>(lhs + i, rhs + i, count - i);
+    return _mm256_movemask_pd(not_finite) != 0 || tail_not_finite;
+}
+
+AVX2_TARGET void NegateAvx2(double* values, size_t count) {
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm256_storeu_pd(values + i, _mm256_xor_pd(_mm256_loadu_pd(values + i), sign));
+    }
+    NegateSse2(values + i, count - i);
+}
+
+constexpr ColumnKernels SSE2_KERNELS = {
+    InstructionSet::Sse2,
+    ApplySse2<Add>,
+    ApplySse2<Subtract>,
+    ApplySse2<Multiply>,
+    ApplySse2<Divide>,
+    NegateSse2,
+};
+
+constexpr ColumnKernels AVX2_KERNELS = {
+    InstructionSet::Avx2,
+    ApplyAvx2<Add>,
+    ApplyAvx2<Subtract>,
+    ApplyAvx2<Multiply>,
+    ApplyAvx2<Divide>,
+    NegateAvx2,
+};
+
+#endif
+
+}  // namespace
+
+const ColumnKernels* GetColumnKernels(InstructionSet instruction_set) {
+    switch (instruction_set) {
+        case InstructionSet::Scalar:
+            return &SCALAR_KERNELS;
+#ifdef COLUMN_KERNELS_X86
+        case InstructionSet::Sse2:
+            return &SSE2_KERNELS;
+        case InstructionSet::Avx2:
+            return __builtin_cpu_supports("avx2") ? &AVX2_KERNELS : nullptr;
+#endif
+        default:
+            return nullptr;
+    }
+}
+
+const ColumnKernels& GetBestColumnKernels() {
+    static const ColumnKernels* best = [] {
+        for (auto instruction_set : {InstructionSet::Avx2, InstructionSet::Sse2}) {
+            if (const ColumnKernels* kernels = GetColumnKernels(instruction_set)) {
+                return kernels;
+            }
+        }
+        return &SCALAR_KERNELS;
+    }();
+    return *best;
+}
+
+const char* ToString(InstructionSet instruction_set) {
+    switch (instruction_set) {
+        case InstructionSet::Scalar:
+            return "scalar";
+        case InstructionSet::Sse2:
+            return "SSE2";
+        case InstructionSet::Avx2:
+            return "AVX2";
+        default:
+            return "unknown";
+    }
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+
+enum class InstructionSet {
+    Scalar,
+    Sse2,
+    Avx2,
+};
+
+// Element-wise arithmetic over arrays of doubles, used to evaluate one
+// formula for a whole run of cells in a column. There is a table per
+// instruction set; the binary operations store lhs[i] op rhs[i] into
+// lhs[i] and return true if any of the results is not finite.
+struct ColumnKernels {
+    InstructionSet instruction_set;
+    bool (*add)(double* lhs, const double* rhs, size_t count);
+    bool (*subtract)(double* lhs, const double* rhs, size_t count);
+    bool (*multiply)(double* lhs, const double* rhs, size_t count);
+    bool (*divide)(double* lhs, const double* rhs, size_t count);
+    void (*negate)(double* values, size_t count);
+};
+
+// nullptr if the build or the CPU does not support the instruction set
+const ColumnKernels* GetColumnKernels(InstructionSet instruction_set);
+
+// The widest instruction set the CPU supports, detected on the first call
+const ColumnKernels& GetBestColumnKernels();
+
+const char* ToString(InstructionSet instruction_set);
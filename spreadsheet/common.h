@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <iosfwd>
 #include <memory>
 #include <stdexcept>
@@ -23,16 +24,61 @@ struct Position {
     static const int MAX_ROWS = 16384;
     static const int MAX_COLS = 16384;
     static const Position NONE;
+
+    // Valid position packed into 28 bits: row above, column in the low bits
+    static constexpr int PACKED_COL_BITS = 14;
+
+    uint32_t Pack() const {
+        return (static_cast<uint32_t>(row) << PACKED_COL_BITS) | static_cast<uint32_t>(col);
+    }
+
+    static Position Unpack(uint32_t key) {
+        return {static_cast<int>(key >> PACKED_COL_BITS),
+                static_cast<int>(key & ((1u << PACKED_COL_BITS) - 1))};
+    }
 };
 
-struct PositionHasher { 
-    size_t operator() (Position pos) const {          
-        size_t h_col = u_hasher_((uint64_t)pos.col);
-        size_t h_row = u_hasher_((uint64_t)pos.row);        
-        return h_col + h_row * 37;
+// Rectangle of cells, both corners included
+struct PositionRange {
+    Position top_left;
+    Position bottom_right;
+
+    bool operator==(const PositionRange& rhs) const {
+        return top_left == rhs.top_left && bottom_right == rhs.bottom_right;
+    }
+
+    bool Contains(Position pos) const {
+        return pos.row >= top_left.row && pos.row <= bottom_right.row
+            && pos.col >= top_left.col && pos.col <= bottom_right.col;
+    }
+
+    // A1:B2 form
+    std::string ToString() const;
+};
+
+// Numbers of a range folded together for the aggregate functions of
+// formulas (SUM, AVERAGE, MIN, MAX, COUNT)
+struct RangeAggregate {
+    double sum = 0.0;
+    double min = 0.0;
+    double max = 0.0;
+    size_t count = 0;
+    // MIN and MAX have to see every number; SUM, AVERAGE and COUNT can take
+    // the totals of a range at once, see AddTotals()
+    bool needs_extremes = true;
+
+    void Add(double value) {
+        sum += value;
+        min = count == 0 || value < min ? value : min;
+        max = count == 0 || value > max ? value : max;
+        ++count;
+    }
+
+    // Leaves min and max as they are
+    void AddTotals(double range_sum, size_t range_count) {
+        sum += range_sum;
+        count += range_count;
     }
-private:
-    std::hash<uint64_t> u_hasher_;
 };
 
 struct Size {
@@ -103,6 +149,45 @@ public:
     virtual Size GetPrintableSize() const = 0;
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Значение ячейки для вычисления формул; пустая ячейка равна нулю.
+    // Таблица может переопределить метод, чтобы не создавать объект ячейки.
+    virtual CellInterface::Value GetCellValue(Position pos) const {
+        const CellInterface* cell = GetCell(pos);
+        return cell == nullptr ? CellInterface::Value(0.0) : cell->GetValue();
+    }
+
+    // Значения count ячеек столбца, начиная с first, для вычисления формул
+    // сразу для отрезка столбца; not_number отмечает ячейки, значение
+    // которых не число.
+    virtual void GetColumnValues(Position first, size_t count, double* values, bool* not_number) const {
+        for (size_t i = 0; i < count; ++i) {
+            auto value = GetCellValue({first.row + static_cast<int>(i), first.col});
+            not_number[i] = !std::holds_alternative<double>(value);
+            values[i] = not_number[i] ? 0.0 : std::get<double>(value);
+        }
+    }
+
+    // Добавляет к aggregate числа из диапазона; пустые ячейки и текст
+    // пропускаются. Возвращает false, если в диапазоне есть ошибка.
+    virtual bool AggregateRange(PositionRange range, RangeAggregate& aggregate) const {
+        for (int row = range.top_left.row; row <= range.bottom_right.row; ++row) {
+            for (int col = range.top_left.col; col <= range.bottom_right.col; ++col) {
+                const CellInterface* cell = GetCell({row, col});
+                if (cell == nullptr || cell->GetText().empty()) {
+                    continue;
+                }
+                auto value = cell->GetValue();
+                if (std::holds_alternative<FormulaError>(value)) {
+                    return false;
+                }
+                if (std::holds_alternative<double>(value)) {
+                    aggregate.Add(std::get<double>(value));
+                }
+            }
+        }
+        return true;
+    }
 };
 
 std::unique_ptr<SheetInterface> CreateSheet();
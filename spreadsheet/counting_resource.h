@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <memory_resource>
+
+// Passes allocations through to an upstream resource and keeps the number
+// of outstanding blocks and bytes, so usage can be read at any time.
+class CountingResource : public std::pmr::memory_resource {
+public:
+    explicit CountingResource(std::pmr::memory_resource* upstream)
+        : upstream_(upstream) {
+    }
+
+    size_t GetBytes() const {
+        return bytes_;
+    }
+
+    size_t GetBlocks() const {
+        return blocks_;
+    }
+
+private:
+    std::pmr::memory_resource* upstream_;
+    size_t bytes_ = 0;
+    size_t blocks_ = 0;
+
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        void* memory = upstream_->allocate(bytes, alignment);
+        bytes_ += bytes;
+        ++blocks_;
+        return memory;
+    }
+
+    void do_deallocate(void* memory, size_t bytes, size_t alignment) override {
+        upstream_->deallocate(memory, bytes, alignment);
+        bytes_ -= bytes;
+        --blocks_;
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+};
@@ -0,0 +1,217 @@
+#include "dependency_graph.h"
+
+#include <algorithm>
+
+DependencyGraph::DependencyGraph(std::pmr::memory_resource* resource)
+    : index_(resource)
+    , nodes_(resource)
+    , edges_(resource)
+    , range_edges_(resource)
+    , column_ranges_(resource) {
+}
+
+PositionSpan DependencyGraph::GetReferences(Position pos) const {
+    uint32_t node = FindNode(pos);
+    return node == NO_NODE ? PositionSpan{} : View(nodes_[node].refs);
+}
+
+RangeSpan DependencyGraph::GetRangeReferences(Position pos) const {
+    uint32_t node = FindNode(pos);
+    if (node == NO_NODE) {
+        return {};
+    }
+    const PositionRange* first = range_edges_.data() + nodes_[node].ranges.offset;
+    return {first, first + nodes_[node].ranges.size};
+}
+
+PositionSpan DependencyGraph::GetDependents(Position pos) const {
+    uint32_t node = FindNode(pos);
+    return node == NO_NODE ? PositionSpan{} : View(nodes_[node].deps);
+}
+
+void DependencyGraph::SetReferences(Position pos, PositionSpan refs, RangeSpan ranges) {
+    uint32_t node = FindNode(pos);
+    if (node == NO_NODE) {
+        if (refs.empty() && ranges.empty()) {
+            return;
+        }
+        node = GetOrCreateNode(pos);
+    }
+
+    // drop the reverse edges of the old references
+    const Run old_refs = nodes_[node].refs;
+    for (uint32_t i = 0; i < old_refs.size; ++i) {
+        Remove(nodes_[FindNode(edges_[old_refs.offset + i])].deps, pos);
+    }
+    edge_count_ -= old_refs.size;
+    nodes_[node].refs.size = 0;
+
+    for (Position ref : refs) {
+        if (Contains(nodes_[node].refs, ref)) {
+            continue;
+        }
+        uint32_t target = GetOrCreateNode(ref);
+        Append(nodes_[node].refs, ref);
+        Append(nodes_[target].deps, pos);
+        ++edge_count_;
+    }
+
+    CompactIfNeeded();
+    SetRanges(node, ranges);
+}
+
+bool DependencyGraph::WouldCreateCycle(Position pos, PositionSpan refs, RangeSpan ranges) const {
+    FlatPositionSet visited;
+    std::vector<Position> stack(refs.begin(), refs.end());
+    // a range refers to the formulas inside it
+    auto push_range = [&](const PositionRange& range) {
+        if (range.Contains(pos)) {
+            return true;
+        }
+        ForEachReferrerIn(range, [&stack](Position referrer) {
+            stack.push_back(referrer);
+        });
+        return false;
+    };
+    for (const PositionRange& range : ranges) {
+        if (push_range(range)) {
+            return true;
+        }
+    }
+    while (!stack.empty()) {
+        Position current = stack.back();
+        stack.pop_back();
+        if (current == pos) {
+            return true;
+        }
+        if (!visited.Insert(current)) {
+            continue;
+        }
+        for (Position next : GetReferences(current)) {
+            stack.push_back(next);
+        }
+        for (const PositionRange& range : GetRangeReferences(current)) {
+            if (push_range(range)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+uint32_t DependencyGraph::FindNode(Position pos) const {
+    const uint32_t* node = index_.Find(pos);
+    return node == nullptr ? NO_NODE : *node;
+}
+
+uint32_t DependencyGraph::GetOrCreateNode(Position pos) {
+    if (const uint32_t* node = index_.Find(pos)) {
+        return *node;
+    }
+    const uint32_t node = static_cast<uint32_t>(nodes_.size());
+    nodes_.push_back(Node{pos, {}, {}, {}});
+    index_[pos] = node;
+    return node;
+}
+
+PositionSpan DependencyGraph::View(const Run& run) const {
+    const Position* first = edges_.data() + run.offset;
+    return {first, first + run.size};
+}
+
+bool DependencyGraph::Contains(const Run& run, Position pos) const {
+    auto span = View(run);
+    return std::find(span.begin(), span.end(), pos) != span.end();
+}
+
+void DependencyGraph::Append(Run& run, Position pos) {
+    if (run.size == run.capacity) {
+        const uint32_t capacity = std::max<uint32_t>(2, run.capacity * 2);
+        if (run.capacity > 0 && run.offset + run.capacity == edges_.size()) {
+            // the run is the tail of the array and can grow in place
+            edges_.resize(run.offset + capacity);
+        } else {
+            const uint32_t offset = static_cast<uint32_t>(edges_.size());
+            edges_.resize(offset + capacity);
+            std::copy_n(edges_.begin() + run.offset, run.size, edges_.begin() + offset);
+            garbage_ += run.capacity;
+            run.offset = offset;
+        }
+        run.capacity = capacity;
+    }
+    edges_[run.offset + run.size++] = pos;
+}
+
+void DependencyGraph::Remove(Run& run, Position pos) {
+    auto first = edges_.begin() + run.offset;
+    auto last = first + run.size;
+    auto it = std::find(first, last, pos);
+    if (it != last) {
+        *it = *(last - 1);
+        --run.size;
+    }
+}
+
+void DependencyGraph::CompactIfNeeded() {
+    if (garbage_ < MIN_GARBAGE_TO_COMPACT || garbage_ * 2 < edges_.size()) {
+        return;
+    }
+
+    std::pmr::vector<Position> compacted(edges_.get_allocator().resource());
+    compacted.reserve(edges_.size() - garbage_);
+    auto move_run = [&](Run& run) {
+        const uint32_t offset = static_cast<uint32_t>(compacted.size());
+        compacted.insert(compacted.end(), edges_.begin() + run.offset,
+                         edges_.begin() + run.offset + run.size);
+        run.offset = offset;
+        run.capacity = run.size;
+    };
+    for (Node& node : nodes_) {
+        move_run(node.refs);
+        move_run(node.deps);
+    }
+    edges_.swap(compacted);
+    garbage_ = 0;
+}
+
+void DependencyGraph::SetRanges(uint32_t node, RangeSpan ranges) {
+    Run& run = nodes_[node].ranges;
+    for (uint32_t i = 0; i < run.size; ++i) {
+        const PositionRange& old = range_edges_[run.offset + i];
+        for (int col = old.top_left.col; col <= old.bottom_right.col; ++col) {
+            auto& column = column_ranges_[col];
+            column.erase(std::remove_if(column.begin(), column.end(), [node](const ColumnRange& range) {
+                return range.node == node;
+            }), column.end());
+        }
+    }
+    range_garbage_ += run.size;
+    range_count_ -= run.size;
+    run = {static_cast<uint32_t>(range_edges_.size()), static_cast<uint32_t>(ranges.size()),
+           static_cast<uint32_t>(ranges.size())};
+
+    range_edges_.insert(range_edges_.end(), ranges.begin(), ranges.end());
+    range_count_ += ranges.size();
+    for (const PositionRange& range : ranges) {
+        if (range.bottom_right.col >= static_cast<int>(column_ranges_.size())) {
+            column_ranges_.resize(range.bottom_right.col + 1);
+        }
+        for (int col = range.top_left.col; col <= range.bottom_right.col; ++col) {
+            column_ranges_[col].push_back({node, range.top_left.row, range.bottom_right.row});
+        }
+    }
+
+    if (range_garbage_ < MIN_GARBAGE_TO_COMPACT || range_garbage_ * 2 < range_edges_.size()) {
+        return;
+    }
+    std::pmr::vector<PositionRange> compacted(range_edges_.get_allocator().resource());
+    compacted.reserve(range_count_);
+    for (Node& owner : nodes_) {
+        const uint32_t offset = static_cast<uint32_t>(compacted.size());
+        compacted.insert(compacted.end(), range_edges_.begin() + owner.ranges.offset,
+                         range_edges_.begin() + owner.ranges.offset + owner.ranges.size);
+        owner.ranges = {offset, owner.ranges.size, owner.ranges.size};
+    }
+    range_edges_.swap(compacted);
+    range_garbage_ = 0;
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include "common.h"
+#include "flat_position_map.h"
+
+#include <cstdint>
+#include <memory_resource>
+#include <vector>
+
+// Read-only view of a contiguous run of positions or ranges
+template <typename T>
+class Span {
+public:
+    Span() = default;
+    Span(const T* first, const T* last)
+        : first_(first)
+        , last_(last) {
+    }
+
+    const T* begin() const {
+        return first_;
+    }
+
+    const T* end() const {
+        return last_;
+    }
+
+    size_t size() const {
+        return last_ - first_;
+    }
+
+    bool empty() const {
+        return first_ == last_;
+    }
+
+private:
+    const T* first_ = nullptr;
+    const T* last_ = nullptr;
+};
+
+using PositionSpan = Span<Position>;
+using RangeSpan = Span<PositionRange>;
+
+// Sheet-wide graph of references between cells. Outgoing (referenced cells)
+// and incoming (dependent cells) edges of every node are runs in a single
+// edge array, as in a compressed sparse row layout. A run that outgrows its
+// capacity moves to the end of the array; the holes it leaves are squeezed
+// out once they make up half of the array.
+//
+// A range reference stays one edge however many cells it covers. Ranges
+// are kept in an array of their own and in per-column lists of the rows
+// they span, so the formulas whose ranges cover a cell are found by
+// looking at the ranges of its column only.
+class DependencyGraph {
+public:
+    explicit DependencyGraph(std::pmr::memory_resource* resource);
+
+    // Spans stay valid until the next modification of the graph
+    PositionSpan GetReferences(Position pos) const;
+    RangeSpan GetRangeReferences(Position pos) const;
+    // Dependents through single cell references only, see ForEachRangeDependent
+    PositionSpan GetDependents(Position pos) const;
+
+    // Calls visitor(dependent) once for every range reference containing pos
+    template <typename Visitor>
+    void ForEachRangeDependent(Position pos, Visitor visitor) const {
+        if (pos.col >= static_cast<int>(column_ranges_.size())) {
+            return;
+        }
+        for (const ColumnRange& range : column_ranges_[pos.col]) {
+            if (pos.row >= range.top && pos.row <= range.bottom) {
+                visitor(nodes_[range.node].pos);
+            }
+        }
+    }
+
+    // Calls visitor(pos) for every cell in the range that has references
+    // of its own, that is for the formulas in it
+    template <typename Visitor>
+    void ForEachReferrerIn(PositionRange range, Visitor visitor) const {
+        auto has_references = [](const Node& node) {
+            return node.refs.size > 0 || node.ranges.size > 0;
+        };
+        const int64_t area = int64_t{range.bottom_right.row - range.top_left.row + 1}
+                           * (range.bottom_right.col - range.top_left.col + 1);
+        if (area > static_cast<int64_t>(nodes_.size())) {
+            for (const Node& node : nodes_) {
+                if (range.Contains(node.pos) && has_references(node)) {
+                    visitor(node.pos);
+                }
+            }
+            return;
+        }
+        for (int row = range.top_left.row; row <= range.bottom_right.row; ++row) {
+            for (int col = range.top_left.col; col <= range.bottom_right.col; ++col) {
+                const uint32_t node = FindNode({row, col});
+                if (node != NO_NODE && has_references(nodes_[node])) {
+                    visitor(nodes_[node].pos);
+                }
+            }
+        }
+    }
+
+    // Replaces the outgoing edges of pos; duplicates in refs are ignored
+    void SetReferences(Position pos, PositionSpan refs, RangeSpan ranges = {});
+
+    // Whether pos can be reached from one of refs or ranges by following
+    // references, i.e. whether giving pos these references would close a cycle
+    bool WouldCreateCycle(Position pos, PositionSpan refs, RangeSpan ranges = {}) const;
+
+    size_t GetNodeCount() const {
+        return nodes_.size();
+    }
+
+    size_t GetEdgeCount() const {
+        return edge_count_;
+    }
+
+    size_t GetRangeEdgeCount() const {
+        return range_count_;
+    }
+
+private:
+    struct Run {
+        uint32_t offset = 0;
+        uint32_t size = 0;
+        uint32_t capacity = 0;
+    };
+
+    struct Node {
+        Position pos;
+        Run refs;
+        Run deps;
+        Run ranges;
+    };
+
+    // rows a range of the node covers in one column
+    struct ColumnRange {
+        uint32_t node;
+        int top;
+        int bottom;
+    };
+
+    static constexpr uint32_t NO_NODE = UINT32_MAX;
+    static constexpr size_t MIN_GARBAGE_TO_COMPACT = 1024;
+
+    FlatPositionMap<uint32_t> index_;
+    std::pmr::vector<Node> nodes_;
+    std::pmr::vector<Position> edges_;
+    size_t garbage_ = 0;
+    size_t edge_count_ = 0;
+    // ranges of a node are one exactly sized run, moved to the end on change
+    std::pmr::vector<PositionRange> range_edges_;
+    size_t range_garbage_ = 0;
+    size_t range_count_ = 0;
+    std::pmr::vector<std::pmr::vector<ColumnRange>> column_ranges_;
+
+    uint32_t FindNode(Position pos) const;
+    uint32_t GetOrCreateNode(Position pos);
+
+    PositionSpan View(const Run& run) const;
+    bool Contains(const Run& run, Position pos) const;
+    void Append(Run& run, Position pos);
+    void Remove(Run& run, Position pos);
+    void CompactIfNeeded();
+    void SetRanges(uint32_t node, RangeSpan ranges);
+};
@@ -0,0 +1,239 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <memory_resource>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Open-addressing hash table keyed by Position::Pack(). Keys and values
+// live in two flat arrays, collisions are resolved by linear probing and
+// erasure shifts the following run back, so there are no tombstones.
+// With an empty V the value array is not allocated and the table is a set.
+template <typename V>
+class FlatPositionMap {
+    static constexpr bool IS_SET = std::is_empty_v<V>;
+    static constexpr uint32_t EMPTY_KEY = UINT32_MAX;
+    static constexpr size_t MIN_CAPACITY = 8;
+
+public:
+    explicit FlatPositionMap(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : keys_(resource)
+        , values_(resource) {
+    }
+
+    class Iterator {
+    public:
+        Iterator(const FlatPositionMap* map, size_t slot)
+            : map_(map)
+            , slot_(slot) {
+            SkipEmpty();
+        }
+
+        Position operator*() const {
+            return Position::Unpack(map_->keys_[slot_]);
+        }
+
+        Iterator& operator++() {
+            ++slot_;
+            SkipEmpty();
+            return *this;
+        }
+
+        bool operator==(const Iterator& other) const {
+            return slot_ == other.slot_;
+        }
+
+        bool operator!=(const Iterator& other) const {
+            return slot_ != other.slot_;
+        }
+
+    private:
+        const FlatPositionMap* map_;
+        size_t slot_;
+
+        void SkipEmpty() {
+            while (slot_ < map_->keys_.size() && map_->keys_[slot_] == EMPTY_KEY) {
+                ++slot_;
+            }
+        }
+    };
+
+    // Iteration yields the stored positions in table order
+    Iterator begin() const {
+        return Iterator(this, 0);
+    }
+
+    Iterator end() const {
+        return Iterator(this, keys_.size());
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+    size_t Capacity() const {
+        return keys_.size();
+    }
+
+    bool Contains(Position pos) const {
+        return FindSlot(pos.Pack()) != NPOS;
+    }
+
+    const V* Find(Position pos) const {
+        static_assert(!IS_SET);
+        size_t slot = FindSlot(pos.Pack());
+        return slot == NPOS ? nullptr : &values_[slot];
+    }
+
+    V* Find(Position pos) {
+        return const_cast<V*>(static_cast<const FlatPositionMap&>(*this).Find(pos));
+    }
+
+    const V& At(Position pos) const {
+        if (const V* value = Find(pos)) {
+            return *value;
+        }
+        throw std::out_of_range("FlatPositionMap::At");
+    }
+
+    V& operator[](Position pos) {
+        static_assert(!IS_SET);
+        return values_[InsertSlot(pos.Pack()).first];
+    }
+
+    // Returns false if the position was already present
+    bool Insert(Position pos) {
+        return InsertSlot(pos.Pack()).second;
+    }
+
+    bool Erase(Position pos) {
+        size_t slot = FindSlot(pos.Pack());
+        if (slot == NPOS) {
+            return false;
+        }
+
+        const size_t mask = keys_.size() - 1;
+        size_t hole = slot;
+        for (size_t next = (hole + 1) & mask; keys_[next] != EMPTY_KEY; next = (next + 1) & mask) {
+            size_t home = Home(keys_[next]);
+            // the entry may fill the hole only if its home is not in (hole, next]
+            if (((next - home) & mask) >= ((next - hole) & mask)) {
+                keys_[hole] = keys_[next];
+                if constexpr (!IS_SET) {
+                    values_[hole] = std::move(values_[next]);
+                }
+                hole = next;
+            }
+        }
+        keys_[hole] = EMPTY_KEY;
+        if constexpr (!IS_SET) {
+            values_[hole] = V{};
+        }
+        --size_;
+        return true;
+    }
+
+    void Clear() {
+        keys_.clear();
+        values_.clear();
+        size_ = 0;
+        shift_ = 0;
+    }
+
+    void Reserve(size_t count) {
+        size_t capacity = MIN_CAPACITY;
+        while (capacity * 3 < count * 4) {
+            capacity *= 2;
+        }
+        if (capacity > keys_.size()) {
+            Rehash(capacity);
+        }
+    }
+
+private:
+    static constexpr size_t NPOS = SIZE_MAX;
+
+    std::pmr::vector<uint32_t> keys_;
+    std::pmr::vector<V> values_;
+    size_t size_ = 0;
+    int shift_ = 0;
+
+    size_t Home(uint32_t key) const {
+        return static_cast<size_t>((key * 0x9E3779B97F4A7C15ull) >> shift_);
+    }
+
+    size_t FindSlot(uint32_t key) const {
+        if (size_ == 0) {
+            return NPOS;
+        }
+        const size_t mask = keys_.size() - 1;
+        for (size_t slot = Home(key);; slot = (slot + 1) & mask) {
+            if (keys_[slot] == key) {
+                return slot;
+            }
+            if (keys_[slot] == EMPTY_KEY) {
+                return NPOS;
+            }
+        }
+    }
+
+    std::pair<size_t, bool> InsertSlot(uint32_t key) {
+        if ((size_ + 1) * 4 > keys_.size() * 3) {
+            Rehash(keys_.empty() ? MIN_CAPACITY : keys_.size() * 2);
+        }
+        const size_t mask = keys_.size() - 1;
+        for (size_t slot = Home(key);; slot = (slot + 1) & mask) {
+            if (keys_[slot] == key) {
+                return {slot, false};
+            }
+            if (keys_[slot] == EMPTY_KEY) {
+                keys_[slot] = key;
+                ++size_;
+                return {slot, true};
+            }
+        }
+    }
+
+    void Rehash(size_t capacity) {
+        auto* resource = keys_.get_allocator().resource();
+        std::pmr::vector<uint32_t> old_keys(capacity, EMPTY_KEY, resource);
+        std::pmr::vector<V> old_values(resource);
+        if constexpr (!IS_SET) {
+            old_values.resize(capacity);
+        }
+        old_keys.swap(keys_);
+        old_values.swap(values_);
+
+        shift_ = 64;
+        for (size_t c = capacity; c > 1; c >>= 1) {
+            --shift_;
+        }
+
+        const size_t mask = capacity - 1;
+        for (size_t i = 0; i < old_keys.size(); ++i) {
+            if (old_keys[i] == EMPTY_KEY) {
+                continue;
+            }
+            size_t slot = Home(old_keys[i]);
+            while (keys_[slot] != EMPTY_KEY) {
+                slot = (slot + 1) & mask;
+            }
+            keys_[slot] = old_keys[i];
+            if constexpr (!IS_SET) {
+                values_[slot] = std::move(old_values[i]);
+            }
+        }
+    }
+};
+
+struct FlatPositionSetTag {};
+
+using FlatPositionSet = FlatPositionMap<FlatPositionSetTag>;
@@ -6,6 +6,7 @@
 #include <cassert>
 #include <cctype>
 #include <sstream>
+#include <utility>
 
 using namespace std::literals;
 
@@ -13,55 +14,126 @@ std::ostream& operator<<(std::ostream& output, FormulaError fe) {
     return output << "#ARITHM!";
 }
 
-class GetCell
-{
-public:
-    GetCell(const SheetInterface& sheet) : sheet_(const_cast<SheetInterface&>(sheet)) { }
-    CellInterface* operator()(Position pos){
-        return sheet_.GetCell(pos);
-    }
-private:
-    SheetInterface& sheet_;
-};
-
 namespace {
 class Formula : public FormulaInterface {
 public:
-    explicit Formula(std::string expression)
-    : ast_(ParseFormulaAST(std::move(expression))) {
-        
+    explicit Formula(std::string expression, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+    : ast_(ParseFormulaAST(std::move(expression), resource))
+    , text_(resource)
+    , slots_(resource) {
+        std::ostringstream tmp;
+        ast_.PrintFormula(tmp, slots_);
+        text_ = tmp.str();
     }
 
     Value Evaluate(const SheetInterface& sheet) const override {
-        try {
-            for (auto cell : ast_.GetCells()) {
-                Position pos = { cell.row, cell.col };
-                if (sheet.GetCell(pos) == nullptr) {
-                    const_cast<SheetInterface&>(sheet).SetCell(pos, "");
-                }
-            }
-            return ast_.Execute(GetCell{sheet});
-        } catch (const FormulaError& e) {
-            return e;
-        }
-        
+        return Evaluate(sheet, {});
     }
 
     std::string GetExpression() const override {
-        std::stringstream tmp;
-        ast_.PrintFormula(tmp);
-        return tmp.str();
+        return GetExpression({});
     }
 
     std::vector<Position> GetReferencedCells() const override {
-        std::forward_list<Position>& temp = const_cast<std::forward_list<Position>&>(ast_.GetCells());
-        std::vector<Position> vec = std::vector<Position>(temp.begin(), temp.end());
+        return GetReferencedCells({});
+    }
+
+    std::vector<PositionRange> GetReferencedRanges() const override {
+        return GetReferencedRanges({});
+    }
+
+    Value Evaluate(const SheetInterface& sheet, Position offset) const override {
+        return Evaluate(sheet, offset, nullptr);
+    }
+
+    void EvaluateColumn(const SheetInterface& sheet, Position offset, size_t count,
+                        Value* results) const override {
+        if (ast_.GetProgram().HasAggregates()) {
+            // the cells of the run read the same sheet, so what does not
+            // move with them is computed once
+            FormulaAST::Memo memo(ast_);
+            for (size_t i = 0; i < count; ++i) {
+                results[i] = Evaluate(sheet, {offset.row + static_cast<int>(i), offset.col}, &memo);
+            }
+            return;
+        }
+        ast_.ExecuteColumn([&sheet](Position first, size_t size, double* values, bool* not_number) {
+            sheet.GetColumnValues(first, size, values, not_number);
+        }, offset, count, results);
+    }
+
+    // The text printed at parse time with the references that move
+    // printed anew
+    std::string GetExpression(Position offset) const override {
+        if (offset == Position{} || slots_.empty()) {
+            return std::string(text_);
+        }
+        std::string result;
+        result.reserve(text_.size() + slots_.size());
+        size_t done = 0;
+        for (const auto& slot : slots_) {
+            result.append(text_, done, slot.begin - done);
+            result += slot.is_range ? ast_.GetRanges()[slot.index].ToString(offset)
+                                    : ast_.GetCells()[slot.index].ToString(offset);
+            done = slot.begin + slot.length;
+        }
+        result.append(text_, done);
+        return result;
+    }
+
+    // Sorted by row, then by column
+    std::vector<Position> GetReferencedCells(Position offset) const override {
+        std::vector<Position> vec;
+        for (const auto& cell : ast_.GetCells()) {
+            const Position pos = cell.Resolve(offset);
+            if (pos.IsValid()) {
+                vec.push_back(pos);
+            }
+        }
+        std::sort(vec.begin(), vec.end(), [](Position lhs, Position rhs) {
+            return lhs.Pack() < rhs.Pack();
+        });
         vec.erase( std::unique( vec.begin(), vec.end() ), vec.end() );
         return vec;
     }
 
+    // In the order of the top left corners, repeats removed
+    std::vector<PositionRange> GetReferencedRanges(Position offset) const override {
+        std::vector<PositionRange> vec;
+        for (const auto& range : ast_.GetRanges()) {
+            if (range.IsValid(offset)) {
+                vec.push_back(range.Resolve(offset));
+            }
+        }
+        std::sort(vec.begin(), vec.end(), [](const PositionRange& lhs, const PositionRange& rhs) {
+            return std::pair(lhs.top_left.Pack(), lhs.bottom_right.Pack())
+                 < std::pair(rhs.top_left.Pack(), rhs.bottom_right.Pack());
+        });
+        vec.erase(std::unique(vec.begin(), vec.end()), vec.end());
+        return vec;
+    }
+
+    std::pmr::memory_resource* GetMemoryResource() const override {
+        return text_.get_allocator().resource();
+    }
+
+    size_t GetAllocationSize() const override {
+        return sizeof(Formula);
+    }
+
 private:
+    Value Evaluate(const SheetInterface& sheet, Position offset, FormulaAST::Memo* memo) const {
+        return ast_.Execute([&sheet](Position pos) {
+            return sheet.GetCellValue(pos);
+        }, [&sheet](PositionRange range, RangeAggregate& aggregate) {
+            return sheet.AggregateRange(range, aggregate);
+        }, offset, memo);
+    }
+
     FormulaAST ast_;
+    // the expression as printed for the cell it was parsed for
+    std::pmr::string text_;
+    std::pmr::vector<FormulaAST::ReferenceSlot> slots_;
 };
 }  // namespace
 
@@ -72,4 +144,12 @@ std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
         throw FormulaException("Incorect formula");
     }
     
+}
+
+PmrPtr<FormulaInterface> ParseFormula(std::string expression, std::pmr::memory_resource* resource) {
+    try {
+        return MakePmr<Formula>(resource, std::move(expression), resource);
+    } catch (const std::exception& e) {
+        throw FormulaException("Incorect formula");
+    }
 }
\ No newline at end of file
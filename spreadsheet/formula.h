@@ -1,8 +1,10 @@
 #pragma once
 
 #include "common.h"
+#include "pmr_ptr.h"
 
 #include <memory>
+#include <memory_resource>
 #include <vector>
 
 class FormulaInterface {
@@ -13,6 +15,32 @@ public:
     virtual Value Evaluate(const SheetInterface& sheet) const = 0;
     virtual std::string GetExpression() const = 0;
     virtual std::vector<Position> GetReferencedCells() const = 0;
+    // Arguments like A1:B10 of the functions; their cells are not listed
+    // by GetReferencedCells() unless referenced on their own as well
+    virtual std::vector<PositionRange> GetReferencedRanges() const = 0;
+
+    // The formula as if it were filled offset rows and columns away from
+    // the cell it was written for: references without '$' move along.
+    // References moved off the sheet evaluate to #REF!, print as "#REF!"
+    // and are not listed.
+    virtual Value Evaluate(const SheetInterface& sheet, Position offset) const = 0;
+    virtual std::string GetExpression(Position offset) const = 0;
+    virtual std::vector<Position> GetReferencedCells(Position offset) const = 0;
+    virtual std::vector<PositionRange> GetReferencedRanges(Position offset) const = 0;
+
+    // Evaluate() for count cells stacked in a column, the i-th one moved by
+    // {offset.row + i, offset.col}. Inputs are read a column run at a time
+    // and the arithmetic runs on vectors of cells; formulas with function
+    // calls are evaluated cell by cell.
+    virtual void EvaluateColumn(const SheetInterface& sheet, Position offset, size_t count,
+                                Value* results) const = 0;
+
+    // The resource the formula was allocated from and the size of the
+    // object, for PmrDeleter
+    virtual std::pmr::memory_resource* GetMemoryResource() const = 0;
+    virtual size_t GetAllocationSize() const = 0;
 };
 
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+// Formula object and its AST are allocated from the given resource
+PmrPtr<FormulaInterface> ParseFormula(std::string expression, std::pmr::memory_resource* resource);
\ No newline at end of file
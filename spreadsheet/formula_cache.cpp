@@ -0,0 +1,123 @@
+#include "formula_cache.h"
+
+#include "FormulaAST.h"
+
+#include <utility>
+
+FormulaCache::Handle::Handle(FormulaCache* cache, Entry* entry)
+    : cache_(cache)
+    , entry_(entry) {
+}
+
+FormulaCache::Handle::Handle(const Handle& other)
+    : cache_(other.cache_)
+    , entry_(other.entry_) {
+    if (entry_ != nullptr) {
+        cache_->AddRef(entry_);
+    }
+}
+
+FormulaCache::Handle::Handle(Handle&& other) noexcept
+    : cache_(std::exchange(other.cache_, nullptr))
+    , entry_(std::exchange(other.entry_, nullptr)) {
+}
+
+FormulaCache::Handle& FormulaCache::Handle::operator=(Handle other) noexcept {
+    std::swap(cache_, other.cache_);
+    std::swap(entry_, other.entry_);
+    return *this;
+}
+
+FormulaCache::Handle::~Handle() {
+    if (entry_ != nullptr) {
+        cache_->Release(entry_);
+    }
+}
+
+const FormulaInterface& FormulaCache::Handle::operator*() const {
+    return *entry_->formula;
+}
+
+const FormulaInterface* FormulaCache::Handle::operator->() const {
+    return entry_->formula.get();
+}
+
+Position FormulaCache::Handle::GetOffset(Position pos) const {
+    return {pos.row - entry_->anchor.row, pos.col - entry_->anchor.col};
+}
+
+FormulaCache::FormulaCache(std::pmr::memory_resource* resource, size_t max_unused)
+    : resource_(resource)
+    , entries_(resource)
+    , max_unused_(max_unused) {
+}
+
+FormulaCache::~FormulaCache() = default;
+
+FormulaCache::Handle FormulaCache::Get(std::string_view expression, Position pos) {
+    std::string key;
+    try {
+        key = ToRelativeForm(expression, pos);
+    } catch (const std::exception&) {
+        throw FormulaException("Incorect formula");
+    }
+    if (auto it = entries_.find(key); it != entries_.end()) {
+        ++hits_;
+        AddRef(it->second.get());
+        return Handle(this, it->second.get());
+    }
+
+    ++misses_;
+    auto entry = MakePmr<Entry>(resource_, Entry{
+        std::pmr::string(key, resource_),
+        ParseFormula(std::string(expression), resource_),
+        pos,
+    });
+
+    Entry* raw = entry.get();
+    raw->refs = 1;
+    entries_.emplace(std::string_view(raw->key), std::move(entry));
+    return Handle(this, raw);
+}
+
+FormulaCache::Stats FormulaCache::GetStats() const {
+    return {hits_, misses_, evictions_, entries_.size(), unused_count_};
+}
+
+// an entry nobody holds is on the unused list
+void FormulaCache::AddRef(Entry* entry) {
+    if (entry->refs++ == 0) {
+        Unlink(entry);
+    }
+}
+
+void FormulaCache::Release(Entry* entry) {
+    if (--entry->refs > 0) {
+        return;
+    }
+
+    entry->older = newest_unused_;
+    entry->newer = nullptr;
+    if (newest_unused_ != nullptr) {
+        newest_unused_->newer = entry;
+    } else {
+        oldest_unused_ = entry;
+    }
+    newest_unused_ = entry;
+    ++unused_count_;
+
+    if (unused_count_ > max_unused_) {
+        Entry* evicted = oldest_unused_;
+        Unlink(evicted);
+        ++evictions_;
+        entries_.erase(std::string_view(evicted->key));
+    }
+}
+
+void FormulaCache::Unlink(Entry* entry) {
+    (entry->newer != nullptr ? entry->newer->older : newest_unused_) = entry->older;
+    (entry->older != nullptr ? entry->older->newer : oldest_unused_) = entry->newer;
+    entry->newer = nullptr;
+    entry->older = nullptr;
+    --unused_count_;
+}
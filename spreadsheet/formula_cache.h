@@ -0,0 +1,107 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+#include "pmr_ptr.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Sheet-wide cache of parsed formulas. Formulas are keyed by their relative
+// form (see ToRelativeForm), so cells holding the same expression and
+// cells of a filled column, =A1*B1 in C1, =A2*B2 in C2 and so on, share
+// one immutable formula; each cell evaluates and prints it moved by its
+// offset from the anchor, the cell the formula was parsed for. Entries
+// are reference counted; an entry nobody holds stays cached until more
+// than max_unused such entries pile up, then the one released longest
+// ago is evicted.
+class FormulaCache {
+    struct Entry;
+
+public:
+    static constexpr size_t DEFAULT_MAX_UNUSED = 1024;
+
+    class Handle {
+    public:
+        Handle() = default;
+        Handle(const Handle& other);
+        Handle(Handle&& other) noexcept;
+        Handle& operator=(Handle other) noexcept;
+        ~Handle();
+
+        const FormulaInterface& operator*() const;
+        const FormulaInterface* operator->() const;
+
+        // The offset to pass to the formula for the cell at pos
+        Position GetOffset(Position pos) const;
+
+        explicit operator bool() const {
+            return entry_ != nullptr;
+        }
+
+        bool operator==(const Handle& other) const {
+            return entry_ == other.entry_;
+        }
+
+    private:
+        friend class FormulaCache;
+
+        FormulaCache* cache_ = nullptr;
+        Entry* entry_ = nullptr;
+
+        Handle(FormulaCache* cache, Entry* entry);
+    };
+
+    struct Stats {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t evictions = 0;
+        size_t entries = 0;
+        size_t unused_entries = 0;
+    };
+
+    explicit FormulaCache(std::pmr::memory_resource* resource, size_t max_unused = DEFAULT_MAX_UNUSED);
+    FormulaCache(const FormulaCache&) = delete;
+    FormulaCache& operator=(const FormulaCache&) = delete;
+    ~FormulaCache();
+
+    // Expression without the leading '=', as written in the cell at pos.
+    // Parses on a miss and throws FormulaException like ParseFormula does.
+    Handle Get(std::string_view expression, Position pos);
+
+    Stats GetStats() const;
+
+private:
+    struct Entry {
+        std::pmr::string key;
+        PmrPtr<FormulaInterface> formula;
+        Position anchor;
+        uint32_t refs = 0;
+        // list of unused entries, most recently released first
+        Entry* newer = nullptr;
+        Entry* older = nullptr;
+
+        // for PmrDeleter
+        std::pmr::memory_resource* GetMemoryResource() const {
+            return key.get_allocator().resource();
+        }
+    };
+
+    std::pmr::memory_resource* resource_;
+    std::pmr::unordered_map<std::string_view, PmrPtr<Entry>> entries_;
+    size_t max_unused_;
+    Entry* newest_unused_ = nullptr;
+    Entry* oldest_unused_ = nullptr;
+    size_t unused_count_ = 0;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+    size_t evictions_ = 0;
+
+    void AddRef(Entry* entry);
+    void Release(Entry* entry);
+    void Unlink(Entry* entry);
+};
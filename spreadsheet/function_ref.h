@@ -0,0 +1,34 @@
+#pragma once
+
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+template <typename Signature>
+class FunctionRef;
+
+// Non-owning reference to a callable: a pointer to the object and a pointer
+// to a function that invokes it. Copying is free and nothing is allocated,
+// so the callable must outlive every call made through the reference.
+template <typename R, typename... Args>
+class FunctionRef<R(Args...)> {
+public:
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, FunctionRef>>>
+    FunctionRef(F&& callable) noexcept
+        : object_(const_cast<void*>(static_cast<const void*>(std::addressof(callable))))
+        , invoke_(&Invoke<std::remove_reference_t<F>>) {
+    }
+
+    R operator()(Args... args) const {
+        return invoke_(object_, std::forward<Args>(args)...);
+    }
+
+private:
+    void* object_;
+    R (*invoke_)(void*, Args...);
+
+    template <typename F>
+    static R Invoke(void* object, Args... args) {
+        return (*static_cast<F*>(object))(std::forward<Args>(args)...);
+    }
+};
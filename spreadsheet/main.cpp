@@ -1,7 +1,20 @@
+#include <cmath>
+#include <cstring>
 #include <limits>
+#include <map>
+#include <memory_resource>
+#include <random>
+#include <regex>
+#include <set>
+#include <string_view>
+#include "benchmarks.h"
 #include "common.h"
+#include "flat_position_map.h"
+#include "FormulaAST.h"
 #include "formula.h"
+#include "sheet.h"
 #include "test_runner_p.h"
+#include "tiled_grid.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -399,9 +412,1176 @@ void TestClearPrint() {
     std::cerr << std::endl;
 }
 
+void TestFormulaFromMemoryResource() {
+    std::pmr::monotonic_buffer_resource arena;
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "3");
+
+    auto formula = ParseFormula("(A1 + 1) * -2", &arena);
+    ASSERT_EQUAL(formula->GetExpression(), "(A1+1)*-2");
+    ASSERT_EQUAL(std::get<double>(formula->Evaluate(*sheet)), -8);
+    ASSERT_EQUAL(formula->GetReferencedCells(), std::vector{"A1"_pos});
+}
+
+void TestFlatPositionMap() {
+    FlatPositionMap<int> map;
+    std::map<std::pair<int, int>, int> reference;
+    std::mt19937 gen(7);
+    std::uniform_int_distribution<int> coord(0, 40);
+
+    for (int i = 0; i < 5000; ++i) {
+        Position pos{coord(gen), coord(gen)};
+        if (i % 3 == 0) {
+            ASSERT_EQUAL(map.Erase(pos), reference.erase({pos.row, pos.col}) > 0);
+        } else {
+            map[pos] = i;
+            reference[{pos.row, pos.col}] = i;
+        }
+    }
+
+    ASSERT_EQUAL(map.Size(), reference.size());
+    for (const auto& [key, value] : reference) {
+        Position pos{key.first, key.second};
+        ASSERT(map.Find(pos) != nullptr);
+        ASSERT_EQUAL(map.At(pos), value);
+    }
+    size_t iterated = 0;
+    for (Position pos : map) {
+        ASSERT(reference.count({pos.row, pos.col}));
+        ++iterated;
+    }
+    ASSERT_EQUAL(iterated, reference.size());
+
+    FlatPositionSet set;
+    ASSERT(set.Insert("B2"_pos));
+    ASSERT(!set.Insert("B2"_pos));
+    ASSERT(set.Contains("B2"_pos));
+    ASSERT(!set.Contains("B3"_pos));
+}
+
+void TestPrintableSizeTracksBoundingBox() {
+    auto sheet = CreateSheet();
+    std::set<std::pair<int, int>> occupied;
+    std::mt19937 gen(11);
+    std::uniform_int_distribution<int> coord(0, 150);
+
+    for (int i = 0; i < 3000; ++i) {
+        Position pos{coord(gen), coord(gen)};
+        if (i % 2 == 0) {
+            sheet->SetCell(pos, "x");
+            occupied.insert({pos.row, pos.col});
+        } else {
+            sheet->ClearCell(pos);
+            occupied.erase({pos.row, pos.col});
+        }
+
+        Size expected;
+        for (auto [row, col] : occupied) {
+            expected.rows = std::max(expected.rows, row + 1);
+            expected.cols = std::max(expected.cols, col + 1);
+        }
+        ASSERT_EQUAL(sheet->GetPrintableSize(), expected);
+    }
+
+    sheet->SetCell(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "corner");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{Position::MAX_ROWS, Position::MAX_COLS}));
+}
+
+void TestNumericLiteralCells() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "42");
+    sheet->SetCell("B1"_pos, "-7");
+    sheet->SetCell("C1"_pos, "007");
+    sheet->SetCell("D1"_pos, "123456789");
+    sheet->SetCell("A2"_pos, "=A1+B1");
+
+    std::ostringstream texts;
+    sheet->PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "42\t-7\t007\t123456789\n=A1+B1\t\t\t\n");
+
+    std::ostringstream values;
+    sheet->PrintValues(values);
+    ASSERT_EQUAL(values.str(), "42\t-7\t7\t1.23457e+08\n35\t\t\t\n");
+
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetText(), "123456789");
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(123456789.0));
+
+    // a number is shown through a view that lasts until the position changes
+    const SheetInterface& const_sheet = *sheet;
+    const CellInterface* a1 = const_sheet.GetCell("A1"_pos);
+    ASSERT_EQUAL(a1->GetText(), "42");
+    ASSERT(const_sheet.GetCell("A1"_pos) == a1);
+    ASSERT(sheet->GetCell("A1"_pos) == a1);
+    sheet->SetCell("A1"_pos, "43");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(43.0));
+    sheet->SetCell("A1"_pos, "=6*7");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "=6*7");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(42.0));
+
+    sheet->SetCell("B1"_pos, "text");
+    CellInterface* b1 = sheet->GetCell("B1"_pos);
+    ASSERT_EQUAL(b1->GetText(), "text");
+    sheet->SetCell("B1"_pos, "5");
+    // a Cell object that was handed out survives getting a literal
+    ASSERT_EQUAL(b1->GetText(), "5");
+    ASSERT_EQUAL(b1->GetValue(), CellInterface::Value(5.0));
+    ASSERT(sheet->GetCell("B1"_pos) == b1);
+
+    sheet->ClearCell("D1"_pos);
+    ASSERT(sheet->GetCell("D1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 3}));
+}
+
+void TestTextCellsShareInternedStrings() {
+    Sheet sheet;
+    for (int row = 0; row < 100; ++row) {
+        sheet.SetCell({row, 0}, row % 2 ? "ACTIVE" : "SUSPENDED");
+    }
+    sheet.SetCell("B1"_pos, "'=escaped");
+
+    const StringPool& pool = sheet.GetStringPool();
+    ASSERT_EQUAL(pool.GetUniqueCount(), 3u);
+    ASSERT_EQUAL(pool.GetStoredBytes(), std::string("ACTIVESUSPENDED'=escaped").size());
+    ASSERT_EQUAL(pool.GetSavedBytes(), 49u * 6 + 49u * 9);
+
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "ACTIVE");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value("=escaped"));
+
+    for (int row = 0; row < 100; row += 2) {
+        sheet.ClearCell({row, 0});
+    }
+    ASSERT_EQUAL(pool.GetUniqueCount(), 2u);
+    ASSERT_EQUAL(pool.GetSavedBytes(), 49u * 6);
+}
+
+void TestDependencyGraph() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "7");
+    for (int row = 1; row <= 20; ++row) {
+        sheet.SetCell({row, 1}, "=A1+A2");
+    }
+
+    const DependencyGraph& graph = sheet.GetDependencyGraph();
+    ASSERT_EQUAL(graph.GetDependents("A1"_pos).size(), 20u);
+    ASSERT_EQUAL(graph.GetEdgeCount(), 40u);
+    // referenced cells get no Cell object of their own
+    ASSERT(sheet.Contains("A1"_pos));
+    ASSERT_EQUAL(sheet.GetCellValue("A1"_pos), CellInterface::Value(7.0));
+
+    sheet.SetCell("B2"_pos, "=A3");
+    ASSERT_EQUAL(graph.GetDependents("A1"_pos).size(), 19u);
+    ASSERT_EQUAL(graph.GetReferences("B2"_pos).size(), 1u);
+    ASSERT_EQUAL(*graph.GetReferences("B2"_pos).begin(), "A3"_pos);
+
+    sheet.ClearCell("B3"_pos);
+    ASSERT_EQUAL(graph.GetDependents("A1"_pos).size(), 18u);
+    ASSERT_EQUAL(graph.GetEdgeCount(), 37u);
+
+    sheet.SetCell("A3"_pos, "=B4");
+    ASSERT(graph.WouldCreateCycle("B4"_pos, graph.GetReferences("B2"_pos)));
+    try {
+        sheet.SetCell("A1"_pos, "=A1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "7");
+}
+
+void TestSetCellsInBulk() {
+    Sheet sheet;
+    sheet.SetCells({
+        {"C1"_pos, "=B1+1"},
+        {"B1"_pos, "=A2*2"},
+        {"A2"_pos, "5"},
+        {"D1"_pos, "=E1"},
+        {"D2"_pos, "text"},
+        {"D2"_pos, "'last"},
+    });
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(11.0));
+    ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), CellInterface::Value("last"));
+    ASSERT(sheet.GetCell("E1"_pos) != nullptr);
+    ASSERT_EQUAL(sheet.GetDependencyGraph().GetDependents("B1"_pos).size(), 1u);
+
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    ASSERT_EQUAL(values.str(), "\t10\t11\t0\t0\n5\t\t\tlast\t\n");
+
+    // a cycle through a cell outside the batch rejects the whole batch
+    try {
+        sheet.SetCells({{"F1"_pos, "1"}, {"B1"_pos, "=C1"}});
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    try {
+        sheet.SetCells({{"F1"_pos, "1"}, {"G1"_pos, "=1+"}});
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    ASSERT(sheet.GetCell("F1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A2*2");
+}
+
+void TestRangeIteration() {
+    Sheet sheet;
+    sheet.SetCell("B2"_pos, "42");
+    sheet.SetCell("A3"_pos, "text");
+    sheet.SetCell("C2"_pos, "=B2+1");
+    sheet.SetCell("A1"_pos, "7");
+    sheet.SetCell({200, 100}, "far");
+    sheet.SetCell({70, 1}, "-3");
+
+    std::vector<std::string> texts;
+    std::vector<Position> positions;
+    for (const auto& entry : sheet.GetRange("A1"_pos, {300, 300})) {
+        positions.push_back(entry.pos);
+        texts.push_back(entry.cell->GetText());
+    }
+    const std::vector<Position> expected_positions = {
+        "A1"_pos, "B2"_pos, "C2"_pos, "A3"_pos, {70, 1}, {200, 100}};
+    ASSERT(positions == expected_positions);
+    ASSERT(texts == (std::vector<std::string>{"7", "42", "=B2+1", "text", "-3", "far"}));
+
+    double sum = 0.0;
+    int count = 0;
+    sheet.ForEachInRange("B1"_pos, {100, 2}, [&](Position, const CellInterface& cell) {
+        auto value = cell.GetValue();
+        if (std::holds_alternative<double>(value)) {
+            sum += std::get<double>(value);
+        }
+        ++count;
+    });
+    ASSERT_EQUAL(count, 3);
+    ASSERT_EQUAL(sum, 42.0 + 43.0 - 3.0);
+
+    ASSERT(sheet.GetRange("D1"_pos, {199, 99}).begin() == sheet.GetRange("D1"_pos, {199, 99}).end());
+    ASSERT(sheet.GetRange("B2"_pos, "A1"_pos).begin() == Sheet::RangeIterator());
+}
+
+void TestMemoryStats() {
+    // the deleter of a slot in the grid takes no space
+    static_assert(sizeof(PmrPtr<Cell>) == sizeof(Cell*));
+
+    Sheet sheet;
+    const auto empty = sheet.GetMemoryStats();
+    ASSERT_EQUAL(empty.cells.objects, 0u);
+    ASSERT_EQUAL(empty.formulas.bytes, 0u);
+    ASSERT(empty.occupancy.bytes > 0);
+
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "text");
+    sheet.SetCell("A3"_pos, "text");
+    sheet.SetCell("B1"_pos, "=A1+A2*3");
+    // reading a number through GetCell does not turn it into a Cell
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+    const auto filled = sheet.GetMemoryStats();
+    ASSERT_EQUAL(filled.cells.objects, 3u);
+    ASSERT_EQUAL(filled.numbers.objects, 1u);
+    ASSERT_EQUAL(filled.views.objects, 1u);
+    ASSERT(filled.views.bytes >= sizeof(NumberCell));
+    ASSERT_EQUAL(filled.texts.objects, 1u);
+    ASSERT_EQUAL(filled.dependencies.objects, 2u);
+    ASSERT_EQUAL(filled.cache.objects, 3u);
+    ASSERT_EQUAL(filled.grid.objects, 1u);
+    // a tile allocates only the rows it has cells in
+    ASSERT(filled.grid.bytes < 16 * 1024);
+    ASSERT(filled.cells.bytes >= 3 * sizeof(Cell));
+    ASSERT(filled.formulas.objects > 0 && filled.formulas.bytes > 0);
+    ASSERT(filled.GetTotalBytes() > empty.GetTotalBytes());
+
+    for (Position pos : {"A1"_pos, "A2"_pos, "A3"_pos, "B1"_pos}) {
+        sheet.ClearCell(pos);
+    }
+    const auto cleared = sheet.GetMemoryStats();
+    ASSERT_EQUAL(cleared.cells.bytes, 0u);
+    // the parsed formula stays cached for reuse
+    ASSERT_EQUAL(sheet.GetFormulaCache().GetStats().unused_entries, 1u);
+    ASSERT_EQUAL(cleared.texts.objects, 0u);
+    ASSERT_EQUAL(cleared.numbers.objects, 0u);
+    ASSERT_EQUAL(cleared.views.objects, 0u);
+    ASSERT_EQUAL(cleared.dependencies.objects, 0u);
+    ASSERT_EQUAL(cleared.cache.objects, 0u);
+    ASSERT_EQUAL(cleared.grid.objects, 0u);
+    ASSERT(cleared.grid.bytes < filled.grid.bytes);
+
+    // a tall single column takes a slot per cell, not a row of slots
+    Sheet tall;
+    for (int row = 0; row < 1000; ++row) {
+        tall.SetCell({row, 0}, "=" + std::to_string(row) + "*2");
+    }
+    const auto column = tall.GetMemoryStats();
+    ASSERT_EQUAL(column.grid.objects, 16u);
+    ASSERT(column.grid.bytes < 1000 * 40);
+
+    // a number takes the block of rows around it, not the column above it
+    Sheet bottom;
+    const Position last_row{Position::MAX_ROWS - 1, 2};
+    bottom.SetCell(last_row, "7");
+    const size_t one_number = bottom.GetMemoryStats().numbers.bytes;
+    ASSERT(one_number < 8 * 1024);
+    bottom.SetCell({last_row.row - 1, last_row.col}, "8");
+    ASSERT_EQUAL(bottom.GetMemoryStats().numbers.bytes, one_number);
+    bottom.ClearCell(last_row);
+    bottom.ClearCell({last_row.row - 1, last_row.col});
+    ASSERT_EQUAL(bottom.GetMemoryStats().numbers.bytes, 0u);
+}
+
+void TestTiledGrid() {
+    std::pmr::monotonic_buffer_resource resource;
+    TiledGrid<int> grid(&resource);
+    const size_t empty_bytes = grid.GetAllocatedBytes();
+    // filled from the right, so every insert moves the slots after it
+    for (int col = 63; col >= 0; col -= 3) {
+        grid.Insert({5, col}, col + 1);
+    }
+    grid.Insert({5, 100}, 101);
+    grid.Insert({5, 30}, -1);
+    ASSERT_EQUAL(grid.Size(), 23u);
+    ASSERT_EQUAL(*grid.Find({5, 30}), -1);
+    ASSERT(grid.Find({5, 31}) == nullptr);
+
+    ASSERT(grid.Erase({5, 3}));
+    ASSERT(!grid.Erase({5, 3}));
+    std::vector<int> visited;
+    grid.ForEachInRect({0, 2}, {10, 200}, [&visited](Position pos, int value) {
+        ASSERT_EQUAL(value, pos.col == 30 ? -1 : pos.col + 1);
+        visited.push_back(pos.col);
+    });
+    std::vector<int> expected;
+    for (int col = 6; col <= 63; col += 3) {
+        expected.push_back(col);
+    }
+    expected.push_back(100);
+    ASSERT(visited == expected);
+
+    for (int col : expected) {
+        ASSERT(grid.Erase({5, col}));
+    }
+    ASSERT(grid.Erase({5, 0}));
+    ASSERT_EQUAL(grid.Size(), 0u);
+    ASSERT_EQUAL(grid.GetTileCount(), 0u);
+    ASSERT_EQUAL(grid.GetAllocatedBytes(), empty_bytes);
+}
+
+void TestDeeplyNestedFormula() {
+    // right-nested sums keep every operand on the value stack at once
+    std::string expression = "A1";
+    for (int i = 0; i < 100; ++i) {
+        expression = "1+(" + expression + ")";
+    }
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "5");
+    auto formula = ParseFormula(expression);
+    ASSERT_EQUAL(std::get<double>(formula->Evaluate(sheet)), 105.0);
+
+    sheet.SetCell("A1"_pos, "text");
+    ASSERT(std::get<FormulaError>(formula->Evaluate(sheet)) == FormulaError::Category::Value);
+    ASSERT_EQUAL(std::get<double>(ParseFormula("-(-2)*-3")->Evaluate(sheet)), -6.0);
+}
+
+void TestFunctionRef() {
+    int calls = 0;
+    auto twice = [&calls](int x) {
+        ++calls;
+        return 2 * x;
+    };
+    FunctionRef<int(int)> ref = twice;
+    FunctionRef<int(int)> copy = ref;
+    ASSERT_EQUAL(ref(3) + copy(4), 14);
+    ASSERT_EQUAL(calls, 2);
+
+    // the formula VM reads every referenced cell through the borrowed
+    // resolver, a repeated one once
+    std::vector<Position> requested;
+    auto ast = ParseFormulaAST("A1*B2+A1");
+    auto value = ast.Execute([&requested](Position pos) -> CellInterface::Value {
+        requested.push_back(pos);
+        return pos.col + 1.0;
+    });
+    ASSERT_EQUAL(std::get<double>(value), 3.0);
+    ASSERT(requested == (std::vector<Position>{"A1"_pos, "B2"_pos}));
+}
+
+void TestFirstErrorWins() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "text");
+    auto evaluate = [&sheet](std::string expression) {
+        return std::get<FormulaError>(ParseFormula(std::move(expression))->Evaluate(sheet)).GetCategory();
+    };
+    ASSERT(evaluate("A1/0") == FormulaError::Category::Value);
+    ASSERT(evaluate("1/0+A1") == FormulaError::Category::Div0);
+    ASSERT(evaluate("(1+A1)*(1/0)") == FormulaError::Category::Value);
+
+    sheet.SetCell("B1"_pos, "=1/0");
+    sheet.SetCell("B2"_pos, "=B1+1");
+    ASSERT(std::get<FormulaError>(sheet.GetCell("B2"_pos)->GetValue()) == FormulaError::Category::Value);
+}
+
+void TestConstantFolding() {
+    auto code_size = [](const std::string& expression) {
+        return ParseFormulaAST(expression).GetProgram().GetCode().size();
+    };
+    ASSERT_EQUAL(code_size("(1+2)*A1/4"), 5u);
+    ASSERT_EQUAL(code_size("A1*1+0"), 3u);
+    ASSERT_EQUAL(code_size("1*(A1/1)-0"), 1u);
+    ASSERT_EQUAL(code_size("-(-A1)"), 1u);
+    ASSERT_EQUAL(code_size("-(2*3)+-(-4)"), 1u);
+    // -0 - (-0) is +0, so the subtraction has to stay
+    ASSERT_EQUAL(code_size("A1-(-0)"), 3u);
+    // the division by zero is reported when evaluated
+    ASSERT_EQUAL(code_size("1/0"), 3u);
+
+    Sheet sheet;
+    sheet.SetCell("B1"_pos, "2");
+    sheet.SetCell("A1"_pos, "=(1+2)*B1/4");
+    sheet.SetCell("A2"_pos, "=A1*1+0");
+    sheet.SetCell("A3"_pos, "=2*3/(1-1)");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=(1+2)*B1/4");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=A1*1+0");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(1.5));
+    ASSERT(std::get<FormulaError>(sheet.GetCell("A3"_pos)->GetValue()) == FormulaError::Category::Div0);
+    ASSERT_EQUAL(std::get<double>(ParseFormula("(1+2)*B1/4")->Evaluate(sheet)), 1.5);
+
+    // a folded constant that is -0 keeps its sign
+    auto negative_zero = ParseFormulaAST("-0*1").Execute([](Position) -> CellInterface::Value {
+        return 0.0;
+    });
+    ASSERT(std::signbit(std::get<double>(negative_zero)));
+}
+
+// Parse result in a comparable form: the printed tree and the cells, or
+// the fact that parsing failed. A formula that is well-formed but names a
+// bad position, number or function shows the first such error, which the
+// listener reports in the order of the text.
+std::string DescribeParse(FormulaAST (*parse)(const std::string&, std::pmr::memory_resource*),
+                          const std::string& expression) {
+    try {
+        FormulaAST ast = parse(expression, std::pmr::get_default_resource());
+        std::ostringstream out;
+        ast.Print(out);
+        out << " | ";
+        ast.PrintCells(out);
+        return out.str();
+    } catch (const FormulaException& e) {
+        return "error: " + std::string(e.what());
+    } catch (const std::exception& e) {
+        const std::string_view message = e.what();
+        if (message.substr(0, 15) == "Invalid number:" || message.substr(0, 17) == "Unknown function:") {
+            return "error: " + std::string(message);
+        }
+        return "error";
+    }
+}
+
+void TestHandWrittenParserMatchesAntlr() {
+    const std::vector<std::string> expressions = {
+        "1", "1+2*3", "(1+2)*3", "1-2-3", "8/4/2", "-A1*2", "-(A1*2)", "+-+1", "--1-(-1)",
+        "A1+ZZ99*(B2-C3)/.5", " 1 +\t2\n", "1.5e3", "1E-3", ".25", "1e+2*2",
+        "", " ", "1+", "*1", "(1", "1)", "()", "1 2", "A", "a1", "A1B", "A1E5", "1A1",
+        "1.", "1.e5", "1e", "1e+", "..1", "1..2", "$A$1", "$B2*C$3", "$", "$1", "A$", "$$A1",
+        "A$$1", "A1$", "$A0", "A0", "ZZZZ1", "A16385", "XFD16384",
+        "ZZZZ1+", "1e999", "1e999+(", "XFE1*1e999", "1/0", "=1",
+        "SUM(A1:B2)", "SUM(A1:B2,C3*2,-1)", "AVERAGE( A1 : $B$2 )", "MAX(SUM(A1:A3),1)-MIN(B1,B2)",
+        "COUNT(B2:A1)", "SUM", "SUM(", "SUM()", "SUM(1,)", "SUM(1 2)", "SUM(A1:)", "SUM(:A1)",
+        "SUM(A1:B2+1)", "A1:B2", "FOO(1)", "FOO(ZZZZ1)", "SUM(A1:ZZZZ1)", "SUM (1)", "SUM1(1)",
+        // the first bad position, number or function in the text wins,
+        // and only once the whole formula has parsed
+        "FOO(1)+ZZZZ1", "ZZZZ1+FOO(1)", "1e999*A0", "A0*1e999", "SUM(A0:ZZZZ1)", "SUM(A1:A0,1e999)",
+        "MAX(1e999,BAR(A1))", "$A$0+1", "A$0*FOO($B1:C$2)", "ZZZZ1+(", "FOO(1)*", "1e999 1", "FOO(A0",
+        "$A1:$B$2", "SUM($A1:B$2,$C$3)", "MIN(-$A$1,+B$2)", "COUNT((A1:B2))", "SUM(A1:B2:C3)",
+    };
+    for (const auto& expression : expressions) {
+        ASSERT_EQUAL(DescribeParse(ParseFormulaAST, expression), DescribeParse(ParseFormulaASTWithAntlr, expression));
+    }
+
+    // random strings over the formula alphabet, mostly malformed
+    const std::vector<std::string> pieces = {
+        "1", "23", ".5", "e", "E2", "+", "-", "*", "/", "(", ")", " ", "A", "B7", "ZZ", "1.", "0", "$",
+        "SUM(", ",", ":"};
+    std::mt19937 gen(15);
+    std::uniform_int_distribution<size_t> piece(0, pieces.size() - 1);
+    std::uniform_int_distribution<int> length(1, 8);
+    size_t parsed = 0;
+    for (int i = 0; i < 5000; ++i) {
+        std::string expression;
+        for (int n = length(gen); n > 0; --n) {
+            expression += pieces[piece(gen)];
+        }
+        auto fast = DescribeParse(ParseFormulaAST, expression);
+        ASSERT_EQUAL(fast, DescribeParse(ParseFormulaASTWithAntlr, expression));
+        parsed += fast.substr(0, 5) != "error";
+    }
+    ASSERT(parsed > 100);
+}
+
+void TestFormulaCache() {
+    Sheet sheet;
+    for (int row = 0; row < 1000; ++row) {
+        sheet.SetCell({row, 2}, row % 2 ? "=$A$1*$B$1" : "= $A$1 * $B$1");
+    }
+    sheet.SetCell("D1"_pos, "=$A$1*$B$1+1");
+    auto stats = sheet.GetFormulaCache().GetStats();
+    ASSERT_EQUAL(stats.misses, 2u);
+    ASSERT_EQUAL(stats.hits, 999u);
+    ASSERT_EQUAL(stats.entries, 2u);
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "=$A$1*$B$1");
+    ASSERT_EQUAL(sheet.GetDependencyGraph().GetDependents("A1"_pos).size(), 1001u);
+    ASSERT(sheet.GetMemoryStats().formulas.bytes < 10000);
+
+    std::pmr::unsynchronized_pool_resource memory;
+    FormulaCache cache(&memory, 2);
+    {
+        auto first = cache.Get("1+A1", "B1"_pos);
+        auto copy = first;
+        auto second = cache.Get("2+A1", "B1"_pos);
+        auto third = cache.Get("3+A1", "B1"_pos);
+        ASSERT(cache.Get("1 + A1", "B1"_pos) == first);
+        ASSERT_EQUAL(std::get<double>(copy->Evaluate(sheet)), 1.0);
+        ASSERT_EQUAL(third->GetReferencedCells().size(), 1u);
+    }
+    // released in reverse order of creation, so "1+A1" went unused last
+    stats = cache.GetStats();
+    ASSERT_EQUAL(stats.entries, 2u);
+    ASSERT_EQUAL(stats.unused_entries, 2u);
+    ASSERT_EQUAL(stats.evictions, 1u);
+    cache.Get("1+A1", "B1"_pos);
+    ASSERT_EQUAL(cache.GetStats().misses, 3u);
+    cache.Get("3+A1", "B1"_pos);
+    ASSERT_EQUAL(cache.GetStats().misses, 4u);
+
+    // entries that are held survive the evictions around them
+    std::vector<FormulaCache::Handle> held;
+    for (int i = 0; i < 200; ++i) {
+        auto handle = cache.Get(std::to_string(i) + "+A1", "B1"_pos);
+        if (i % 3 == 0) {
+            held.push_back(handle);
+        }
+    }
+    for (size_t i = 0; i < held.size(); ++i) {
+        ASSERT_EQUAL(held[i]->GetExpression(), std::to_string(i * 3) + "+A1");
+    }
+    stats = cache.GetStats();
+    ASSERT_EQUAL(stats.unused_entries, 2u);
+    ASSERT_EQUAL(stats.entries, held.size() + 2);
+    // the two released last are still there, the one before is not
+    const size_t misses = stats.misses;
+    cache.Get("199+A1", "B1"_pos);
+    cache.Get("197+A1", "B1"_pos);
+    ASSERT_EQUAL(cache.GetStats().misses, misses);
+    cache.Get("196+A1", "B1"_pos);
+    ASSERT_EQUAL(cache.GetStats().misses, misses + 1);
+
+    try {
+        cache.Get("1+", "B1"_pos);
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+}
+
+void TestRelativeFormulas() {
+    Sheet sheet;
+    for (int row = 0; row < 1000; ++row) {
+        const std::string n = std::to_string(row + 1);
+        sheet.SetCell({row, 0}, n);
+        sheet.SetCell({row, 1}, "2");
+        sheet.SetCell({row, 2}, "=A" + n + "*B" + n);
+        sheet.SetCell({row, 3}, "=$A$1+A" + n);
+        sheet.SetCell({row, 4}, "=A$1*$B" + n);
+    }
+    auto stats = sheet.GetFormulaCache().GetStats();
+    ASSERT_EQUAL(stats.entries, 3u);
+    ASSERT_EQUAL(stats.misses, 3u);
+    ASSERT(sheet.GetMemoryStats().formulas.bytes < 10000);
+
+    ASSERT_EQUAL(sheet.GetCell("C500"_pos)->GetText(), "=A500*B500");
+    ASSERT_EQUAL(sheet.GetCell("D500"_pos)->GetText(), "=$A$1+A500");
+    ASSERT_EQUAL(sheet.GetCell("E500"_pos)->GetText(), "=A$1*$B500");
+    ASSERT_EQUAL(sheet.GetCell("C500"_pos)->GetValue(), CellInterface::Value(1000.0));
+    ASSERT_EQUAL(sheet.GetCell("D500"_pos)->GetValue(), CellInterface::Value(501.0));
+    ASSERT_EQUAL(sheet.GetCell("E500"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT_EQUAL(sheet.GetCell("D500"_pos)->GetReferencedCells(), (std::vector{"A1"_pos, "A500"_pos}));
+    ASSERT_EQUAL(sheet.GetDependencyGraph().GetDependents("B500"_pos).size(), 2u);
+
+    // a shared formula may be entered at a column other than its anchor's
+    sheet.SetCell("F2"_pos, "=B$1*$B2");
+    ASSERT_EQUAL(sheet.GetFormulaCache().GetStats().entries, 3u);
+    ASSERT_EQUAL(sheet.GetCell("F2"_pos)->GetText(), "=B$1*$B2");
+    ASSERT_EQUAL(sheet.GetCell("F2"_pos)->GetReferencedCells(), (std::vector{"B1"_pos, "B2"_pos}));
+
+    ASSERT_EQUAL(ToRelativeForm(" A1 *\t$B$2", "B2"_pos), "R[-1]C[-1]*R2C2");
+    ASSERT_EQUAL(ToRelativeForm("$A3-B$1", "A1"_pos), "R[2]C1-R1C[1]");
+    ASSERT_EQUAL(ToRelativeForm("1 2 (A1)", "A1"_pos), "1 2(R[0]C[0])");
+
+    auto formula = ParseFormula("$A$1+A$2+$B3+B4");
+    ASSERT_EQUAL(formula->GetExpression(), "$A$1+A$2+$B3+B4");
+    ASSERT_EQUAL(formula->GetExpression({1, 1}), "$A$1+B$2+$B4+C5");
+    ASSERT_EQUAL(formula->GetReferencedCells({1, 1}), (std::vector{"A1"_pos, "B2"_pos, "B4"_pos, "C5"_pos}));
+    ASSERT_EQUAL(formula->GetExpression({0, -1}), "$A$1+#REF!+$B3+A4");
+    ASSERT_EQUAL(formula->GetReferencedCells({0, -1}), (std::vector{"A1"_pos, "B3"_pos, "A4"_pos}));
+    ASSERT(formula->Evaluate(sheet, {0, -1}) == FormulaInterface::Value(FormulaError(FormulaError::Category::Ref)));
+
+    for (const char* bad : {"$1", "A$", "$$A1", "A$$1", "A1$", "$A0"}) {
+        try {
+            sheet.SetCell("Z1"_pos, std::string("=") + bad);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+    }
+}
+
+void TestColumnKernels() {
+    size_t tested = 0;
+    for (auto instruction_set : {InstructionSet::Scalar, InstructionSet::Sse2, InstructionSet::Avx2}) {
+        const ColumnKernels* kernels = GetColumnKernels(instruction_set);
+        if (kernels == nullptr) {
+            continue;
+        }
+        ++tested;
+        ASSERT(kernels->instruction_set == instruction_set);
+        // lengths around the vector widths exercise the scalar tails
+        for (size_t count : {0, 1, 2, 3, 4, 5, 7, 8, 37}) {
+            std::vector<double> lhs(count);
+            std::vector<double> rhs(count);
+            for (size_t i = 0; i < count; ++i) {
+                lhs[i] = i + 1.5;
+                rhs[i] = i % 5 - 2.0;
+            }
+            auto quotients = lhs;
+            auto products = lhs;
+            for (size_t i = 0; i < count; ++i) {
+                quotients[i] /= rhs[i];
+                products[i] = -(products[i] * rhs[i]);
+            }
+
+            auto values = lhs;
+            ASSERT_EQUAL(kernels->divide(values.data(), rhs.data(), count), count > 2);
+            ASSERT_EQUAL(values, quotients);
+            values = lhs;
+            ASSERT(!kernels->multiply(values.data(), rhs.data(), count));
+            kernels->negate(values.data(), count);
+            ASSERT_EQUAL(values, products);
+        }
+    }
+    ASSERT(tested >= 1);
+    ASSERT(GetColumnKernels(GetBestColumnKernels().instruction_set) == &GetBestColumnKernels());
+}
+
+void TestColumnEvaluation() {
+    Sheet sheet;
+    for (int row = 0; row < 300; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row));
+        sheet.SetCell({row, 1}, row % 7 == 3 ? "text" : std::to_string(row % 5));
+        sheet.SetCell({row, 2}, row % 17 == 0 ? "=1/0" : "=A" + std::to_string(row + 1) + "/2");
+        sheet.SetCell({Position::MAX_ROWS - 1 - row, 0}, std::to_string(row));
+    }
+
+    auto load_column = [&sheet](Position first, size_t count, double* values, bool* not_number) {
+        sheet.GetColumnValues(first, count, values, not_number);
+    };
+    auto get_cell_value = [&sheet](Position pos) {
+        return sheet.GetCellValue(pos);
+    };
+    const std::vector<std::string> expressions = {
+        "A1*B1+C1", "A1/B1", "-A1-$A$5*B1", "$B$4+1", "A$3*2", "A1/(B1-B1)+C1", "A1-1", "-(A1)", "7",
+        "(A1*B1+C1)/(A1*B1+C1+B1)", "$A$5*$B$4+A1*($A$5*$B$4)", "A1+A1*-A1",
+    };
+    // the offsets move the column off the top and off the bottom of the sheet
+    const std::vector<Position> offsets = {{0, 0}, {-3, 1}, {Position::MAX_ROWS - 290, 0}, {5, -1}};
+    for (auto instruction_set : {InstructionSet::Scalar, InstructionSet::Sse2, InstructionSet::Avx2}) {
+        const ColumnKernels* kernels = GetColumnKernels(instruction_set);
+        if (kernels == nullptr) {
+            continue;
+        }
+        for (const auto& expression : expressions) {
+            FormulaAST ast = ParseFormulaAST(expression);
+            for (Position offset : offsets) {
+                std::vector<FormulaAST::Result> results(300, 0.0);
+                ast.ExecuteColumn(load_column, offset, results.size(), results.data(), *kernels);
+                for (int i = 0; i < 300; ++i) {
+                    ASSERT(results[i] == ast.Execute(get_cell_value, {offset.row + i, offset.col}));
+                }
+            }
+        }
+    }
+
+    // a filled column set at once gets the values it gets cell by cell
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < 100; ++row) {
+        const std::string n = std::to_string(row + 1);
+        cells.push_back({{row, 3}, "=A" + n + "*2+$A$3/B" + n});
+        // each cell of this one refers to the one above
+        cells.push_back({{row, 4}, row == 0 ? "1" : "=E" + std::to_string(row) + "+D" + n});
+    }
+    Sheet one_by_one;
+    for (int row = 0; row < 300; ++row) {
+        one_by_one.SetCell({row, 0}, std::to_string(row));
+        one_by_one.SetCell({row, 1}, row % 7 == 3 ? "text" : std::to_string(row % 5));
+    }
+    for (const auto& [pos, text] : cells) {
+        one_by_one.SetCell(pos, text);
+    }
+    sheet.SetCells(cells);
+    for (int row = 0; row < 100; ++row) {
+        for (int col : {3, 4}) {
+            ASSERT_EQUAL(sheet.GetCell({row, col})->GetValue(), one_by_one.GetCell({row, col})->GetValue());
+        }
+    }
+    ASSERT_EQUAL(sheet.GetCell("D4"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(sheet.GetCell("D5"_pos)->GetValue(), CellInterface::Value(8.5));
+    ASSERT_EQUAL(sheet.GetCell("D6"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Div0)));
+}
+
+void TestRangeFunctions() {
+    Sheet sheet;
+    for (int row = 0; row < 5; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row + 1));
+    }
+    sheet.SetCell("B1"_pos, "text");
+    sheet.SetCell("B2"_pos, "=A1*10");
+    sheet.SetCell("B3"_pos, "");
+    auto value_of = [&sheet](const std::string& formula) {
+        sheet.SetCell("C1"_pos, formula);
+        return sheet.GetCell("C1"_pos)->GetValue();
+    };
+    // text and empty cells are not numbers
+    ASSERT_EQUAL(value_of("=SUM(A1:A5)"), CellInterface::Value(15.0));
+    ASSERT_EQUAL(value_of("=AVERAGE(A1:B3)"), CellInterface::Value(4.0));
+    ASSERT_EQUAL(value_of("=MIN(A1:A5,0-1)"), CellInterface::Value(-1.0));
+    ASSERT_EQUAL(value_of("=MAX(A1:B5)"), CellInterface::Value(10.0));
+    ASSERT_EQUAL(value_of("=COUNT(A1:B5)"), CellInterface::Value(6.0));
+    ASSERT_EQUAL(value_of("=SUM(A1:A2,MAX(A3:A5)*2,1)"), CellInterface::Value(14.0));
+    ASSERT_EQUAL(value_of("=SUM(F1:F3)+MIN(F1:F3)+COUNT(F1:F3)"), CellInterface::Value(0.0));
+    ASSERT_EQUAL(value_of("=AVERAGE(F1:F3)"), CellInterface::Value(FormulaError(FormulaError::Category::Div0)));
+    ASSERT_EQUAL(value_of("=SUM(A5:A1)"), CellInterface::Value(15.0));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=SUM(A5:A1)");
+    ASSERT(sheet.GetCell("C1"_pos)->GetReferencedCells().empty());
+    const auto ranges = static_cast<const Cell*>(sheet.GetCell("C1"_pos))->GetReferencedRanges();
+    ASSERT_EQUAL(ranges.size(), 1u);
+    ASSERT(ranges[0] == PositionRange({"A1"_pos, "A5"_pos}));
+    ASSERT(!sheet.Contains("F1"_pos));
+    sheet.SetCell("D1"_pos, "=1/0");
+    ASSERT_EQUAL(value_of("=SUM(D1:D2)"), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(value_of("=SUM(A1:A2,1/0)"), CellInterface::Value(FormulaError(FormulaError::Category::Div0)));
+
+    // the block-wise walk agrees with the cell-by-cell one
+    for (PositionRange range : {PositionRange{"A1"_pos, "B5"_pos}, PositionRange{"A2"_pos, "B4"_pos}}) {
+        RangeAggregate fast;
+        RangeAggregate slow;
+        ASSERT(sheet.AggregateRange(range, fast));
+        ASSERT(sheet.SheetInterface::AggregateRange(range, slow));
+        ASSERT_EQUAL(fast.sum, slow.sum);
+        ASSERT_EQUAL(fast.count, slow.count);
+    }
+    RangeAggregate with_error;
+    ASSERT(!sheet.AggregateRange({"A1"_pos, "D5"_pos}, with_error));
+
+    // a range is one edge and a cycle through it is found
+    ASSERT_EQUAL(sheet.GetDependencyGraph().GetRangeEdgeCount(), 1u);
+    sheet.SetCell("E1"_pos, "=SUM(E2:E3)");
+    try {
+        sheet.SetCell("E3"_pos, "=E1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    try {
+        sheet.SetCell("E2"_pos, "=MAX(E1:E2)");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    // a filled column shares the formula and the batch orders cells by ranges
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < 20; ++row) {
+        cells.push_back({{row, 6}, "=SUM($A$1:A" + std::to_string(row + 1) + ")"});
+    }
+    cells.push_back({"H1"_pos, "=SUM(H2:H3)"});
+    cells.push_back({"H2"_pos, "=1+1"});
+    cells.push_back({"H3"_pos, "=H2*2"});
+    sheet.SetCells(cells);
+    ASSERT_EQUAL(sheet.GetCell("G3"_pos)->GetText(), "=SUM($A$1:A3)");
+    ASSERT_EQUAL(sheet.GetCell("G3"_pos)->GetValue(), CellInterface::Value(6.0));
+    ASSERT_EQUAL(sheet.GetCell("G20"_pos)->GetValue(), CellInterface::Value(15.0));
+    ASSERT_EQUAL(sheet.GetCell("H1"_pos)->GetValue(), CellInterface::Value(6.0));
+    try {
+        sheet.SetCells({{"I1"_pos, "=SUM(I2:I3)"}, {"I2"_pos, "=I1"}});
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT(!sheet.Contains("I1"_pos));
+
+    // a range moved off the sheet
+    FormulaAST ast = ParseFormulaAST("SUM(A1:B2)");
+    auto get_cell_value = [](Position pos) -> CellInterface::Value {
+        return pos.row + 1.0;
+    };
+    ASSERT(ast.Execute(get_cell_value) == FormulaAST::Result(6.0));
+    ASSERT(ast.Execute(get_cell_value, {-1, 0}) == FormulaAST::Result(FormulaError(FormulaError::Category::Ref)));
+}
+
+void TestAggregateIndex() {
+    std::pmr::unsynchronized_pool_resource memory;
+    AggregateIndex index(&memory);
+    index.AddColumn(1);
+    index.Set({5, 0}, AggregateIndex::Kind::Number, 100.0);  // not indexed
+    std::vector<double> values(300, 0.0);
+    std::vector<AggregateIndex::Kind> kinds(300, AggregateIndex::Kind::None);
+    std::mt19937 gen(20);
+    std::uniform_int_distribution<int> row(0, 299);
+    std::uniform_int_distribution<int> number(-50, 50);
+    for (int i = 0; i < 3000; ++i) {
+        const int changed = row(gen);
+        kinds[changed] = static_cast<AggregateIndex::Kind>(i % 3);
+        values[changed] = kinds[changed] == AggregateIndex::Kind::Number ? number(gen) : 0.0;
+        index.Set({changed, 1}, kinds[changed], values[changed]);
+
+        int top = row(gen);
+        int bottom = row(gen);
+        if (top > bottom) {
+            std::swap(top, bottom);
+        }
+        AggregateIndex::Totals expected;
+        for (int r = top; r <= bottom; ++r) {
+            expected.sum += values[r];
+            expected.count += kinds[r] == AggregateIndex::Kind::Number;
+            expected.errors += kinds[r] == AggregateIndex::Kind::Error;
+        }
+        // rows past the last one set are empty
+        const auto totals = index.Query({{top, 1}, {bottom == 299 ? 5000 : bottom, 1}});
+        ASSERT_EQUAL(totals.sum, expected.sum);
+        ASSERT_EQUAL(totals.count, expected.count);
+        ASSERT_EQUAL(totals.errors, expected.errors);
+    }
+    ASSERT_EQUAL(index.GetIndexedColumnCount(), 1u);
+
+    // the sheet keeps the indexed columns up to date
+    Sheet sheet;
+    for (int r = 0; r < 100; ++r) {
+        sheet.SetCell({r, 0}, std::to_string(r));
+    }
+    auto sum = ParseFormula("SUM(A1:A100)");
+    auto average = ParseFormula("AVERAGE(A11:A20)");
+    ASSERT_EQUAL(std::get<double>(sum->Evaluate(sheet)), 4950.0);
+    ASSERT_EQUAL(sheet.GetMemoryStats().aggregates.objects, 1u);
+    sheet.SetCell("A1"_pos, "1000");
+    sheet.SetCell("A12"_pos, "text");
+    sheet.SetCell("A13"_pos, "");
+    sheet.SetCell("A14"_pos, "=A11*2");
+    sheet.ClearCell("A15"_pos);
+    ASSERT_EQUAL(std::get<double>(sum->Evaluate(sheet)), 4950.0 + 1000 - 11 - 12 - 14 - 13 + 20);
+    ASSERT_EQUAL(std::get<double>(average->Evaluate(sheet)), (10.0 + 20 + 15 + 16 + 17 + 18 + 19) / 7);
+    sheet.SetCell("A16"_pos, "=1/0");
+    ASSERT(std::holds_alternative<FormulaError>(sum->Evaluate(sheet)));
+    // MIN and MAX walk the cells
+    ASSERT_EQUAL(std::get<double>(ParseFormula("MIN(A1:A15)")->Evaluate(sheet)), 1.0);
+    ASSERT_EQUAL(sheet.GetMemoryStats().aggregates.objects, 1u);
+}
+
+// The text printed at parse time, with the moving references spliced in,
+// has to match printing the tree at the offset
+void TestFormulaTextAtOffsets() {
+    const std::vector<std::string> expressions = {
+        "1", "(1+2)*3", "-A1*2", "A1+B2/C3", "$A$1+A$2+$B3+B4", "$A$1*$B$2", "SUM(A1:B2,C3*2,-1)",
+        "AVERAGE(A1:$B$2)", "MAX(SUM($A$1:$A$3),B1)-MIN(B1,B2)", "COUNT(B2:A1)+B2", "1.5e3+.25",
+    };
+    const std::vector<Position> offsets = {{0, 0}, {1, 1}, {100, 3}, {0, -1}, {-1, 0}, {-5, -5}};
+    for (const auto& expression : expressions) {
+        auto formula = ParseFormula(expression);
+        FormulaAST ast = ParseFormulaAST(expression);
+        for (Position offset : offsets) {
+            std::ostringstream expected;
+            ast.PrintFormula(expected, offset);
+            ASSERT_EQUAL(formula->GetExpression(offset), expected.str());
+        }
+    }
+
+    auto formula = ParseFormula("SUM(A1:$B$2)*A1");
+    ASSERT_EQUAL(formula->GetExpression({2, 0}), "SUM(A3:$B$2)*A3");
+    ASSERT_EQUAL(formula->GetExpression({0, -1}), "SUM(#REF!)*#REF!");
+
+    Sheet sheet;
+    sheet.SetCell("C1"_pos, "=A1 + $B$1*(2)");
+    sheet.SetCell("C2"_pos, "=A2+$B$1*2");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=A1+$B$1*2");
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "=A2+$B$1*2");
+}
+
+// The decoders of number literals and cell names accept what the stream
+// extraction and the regular expression they replaced accepted
+void TestLiteralAndReferenceDecoding() {
+    const std::regex name_pattern(
+        R"(([A-Z]?[A-Z]|[A-W][A-Z]{2}|X[A-E][A-Z]|XF[A-D])([1-9]|[1-9][0-9]{1,3}|1[0-5][0-9]{3}|16[0-2][0-9]{2}|163[0-7][0-9]|1638[0-4]))");
+    const std::string name_alphabet = "ABDEFWXZa0123456789$-";
+    std::mt19937 gen(21);
+    std::uniform_int_distribution<size_t> name_char(0, name_alphabet.size() - 1);
+    std::uniform_int_distribution<int> name_length(0, 9);
+    size_t valid = 0;
+    for (int i = 0; i < 200000; ++i) {
+        std::string name;
+        for (int n = name_length(gen); n > 0; --n) {
+            name += name_alphabet[name_char(gen)];
+        }
+        const Position pos = Position::FromString(name);
+        ASSERT_EQUAL(pos.IsValid(), std::regex_match(name, name_pattern));
+        if (pos.IsValid()) {
+            const size_t letters = name.find_first_of("0123456789");
+            int col = 0;
+            for (size_t j = 0; j < letters; ++j) {
+                col = col * 26 + (name[j] - 'A' + 1);
+            }
+            ASSERT(pos == (Position{std::stoi(name.substr(letters)) - 1, col - 1}));
+            ++valid;
+        }
+    }
+    ASSERT(valid > 1000);
+    ASSERT(Position::FromString("XFD16384") == (Position{16383, 16383}));
+    ASSERT(Position::FromString("AA10") == (Position{9, 26}));
+    ASSERT(Position::FromString(std::string_view("A12", 2)) == (Position{0, 0}));
+
+    std::vector<std::string> numbers = {
+        "0", "00", "0.0", ".0", "1e0", "1E+0", "1e-0", "0e999", "1e308", "1.7976931348623157e308",
+        "1.7976931348623158e308", "1.7976931348623159e308", "1.8e308", "1e309", "1e999",
+        "2.2250738585072014e-308", "4.9e-324", "2.4703282292062328e-324", "2.4703282292062327e-324",
+        "2e-324", "1e-400", ".1e-330", "123456789012345678901234567890", "0.1", "0.30000000000000004",
+        "9007199254740993", "000000000000000000001.5",
+    };
+    std::uniform_int_distribution<int> digits(0, 25);
+    std::uniform_int_distribution<int> digit(0, 9);
+    std::uniform_int_distribution<int> exponent(-400, 400);
+    for (int i = 0; i < 5000; ++i) {
+        std::string number;
+        for (int n = digits(gen); n > 0; --n) {
+            number += static_cast<char>('0' + digit(gen));
+        }
+        if (number.empty() || i % 2) {
+            number += '.';
+            for (int n = digits(gen) + 1; n > 0; --n) {
+                number += static_cast<char>('0' + digit(gen));
+            }
+        }
+        if (i % 3) {
+            number += (i % 5 ? "e" : "E-") + std::to_string(exponent(gen));
+        }
+        numbers.push_back(number);
+    }
+
+    Sheet sheet;
+    for (const auto& number : numbers) {
+        std::istringstream in(number);
+        double expected = 0;
+        in >> expected;
+        try {
+            const auto value = ParseFormula(number)->Evaluate(sheet);
+            ASSERT(!in.fail());
+            ASSERT(std::holds_alternative<double>(value));
+            const double actual = std::get<double>(value);
+            ASSERT(std::memcmp(&actual, &expected, sizeof(double)) == 0);
+        } catch (const FormulaException&) {
+            ASSERT(in.fail());
+        }
+    }
+}
+
+// A repeated subexpression is computed once and gives the value and the
+// first error the tree would give
+void TestCommonSubexpressions() {
+    std::vector<Position> requested;
+    auto record = [&requested](Position pos) -> CellInterface::Value {
+        requested.push_back(pos);
+        return pos.col + 1.0;
+    };
+    auto ast = ParseFormulaAST("(A1*B1+C1)/(A1*B1+C1+D1)");
+    ASSERT_EQUAL(std::get<double>(ast.Execute(record)), 5.0 / 9.0);
+    ASSERT(requested == (std::vector<Position>{"A1"_pos, "B1"_pos, "C1"_pos, "D1"_pos}));
+    ASSERT(ast.GetProgram().GetCode().size() < ParseFormulaAST("(A1*B1+C1)/(A2*B2+C2+D2)").GetProgram().GetCode().size());
+
+    // random formulas made of a few pieces used over and over
+    Sheet sheet;
+    const std::map<std::string, CellInterface::Value> cells = {
+        {"A1", 2.0}, {"B1", -3.0}, {"C1", FormulaError(FormulaError::Category::Value)}, {"D1", 0.0},
+    };
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("B1"_pos, "-3");
+    sheet.SetCell("C1"_pos, "text");
+    std::mt19937 gen(22);
+    for (int i = 0; i < 3000; ++i) {
+        std::vector<std::pair<std::string, FormulaAST::Result>> pieces;
+        for (const auto& [name, value] : cells) {
+            pieces.push_back({name, std::holds_alternative<double>(value)
+                                        ? FormulaAST::Result(std::get<double>(value))
+                                        : FormulaAST::Result(std::get<FormulaError>(value))});
+        }
+        pieces.push_back({"SUM($A$1:$B$1)", -1.0});
+        for (int n = 0; n < 6; ++n) {
+            std::uniform_int_distribution<size_t> piece(0, pieces.size() - 1);
+            const auto& [lhs_text, lhs] = pieces[piece(gen)];
+            const auto& [rhs_text, rhs] = pieces[piece(gen)];
+            const char op = "+-*/"[gen() % 4];
+            FormulaAST::Result result = lhs;
+            if (std::holds_alternative<double>(lhs)) {
+                result = rhs;
+                if (std::holds_alternative<double>(rhs)) {
+                    const double x = std::get<double>(lhs);
+                    const double y = std::get<double>(rhs);
+                    const double value = op == '+' ? x + y : op == '-' ? x - y : op == '*' ? x * y : x / y;
+                    result = std::isfinite(value) ? FormulaAST::Result(value)
+                                                  : FormulaAST::Result(FormulaError(FormulaError::Category::Div0));
+                }
+            }
+            pieces.push_back({"(" + lhs_text + op + rhs_text + ")", result});
+        }
+        const auto& [text, expected] = pieces.back();
+        const auto actual = ParseFormula(text)->Evaluate(sheet);
+        ASSERT(actual == expected);
+    }
+
+    // invariant parts are shared through a memo by the cells of a run
+    auto filled = ParseFormulaAST("A1/MAX($B$1:$B$9)+SUM(A1:A2)+MAX($B$1:$B$9)");
+    int aggregated = 0;
+    auto aggregate_range = [&aggregated](PositionRange range, RangeAggregate& aggregate) {
+        ++aggregated;
+        aggregate.Add(range.top_left.row + 1.0);
+        return true;
+    };
+    auto get_cell_value = [](Position pos) -> CellInterface::Value {
+        return pos.row + 1.0;
+    };
+    FormulaAST::Memo memo(filled);
+    for (int row = 0; row < 10; ++row) {
+        const auto with_memo = filled.Execute(get_cell_value, aggregate_range, {row, 0}, &memo);
+        ASSERT(with_memo == filled.Execute(get_cell_value, aggregate_range, {row, 0}));
+    }
+    ASSERT_EQUAL(aggregated, 1 + 10 * 2 + 10 * 1);
+
+    // an error is not kept, the next cell meets it again
+    FormulaAST::Memo failing_memo(filled);
+    for (int row = 0; row < 3; ++row) {
+        const auto result = filled.Execute(get_cell_value, [](PositionRange, RangeAggregate&) {
+            return false;
+        }, {row, 0}, &failing_memo);
+        ASSERT(result == FormulaAST::Result(FormulaError(FormulaError::Category::Value)));
+    }
+
+    // and SetCells evaluates a filled column through one
+    std::vector<std::pair<Position, std::string>> column;
+    for (int row = 0; row < 100; ++row) {
+        sheet.SetCell({row, 5}, std::to_string(row));
+        column.push_back({{row, 6}, "=F" + std::to_string(row + 1) + "/MAX($F$1:$F$100)"});
+    }
+    sheet.SetCells(column);
+    ASSERT_EQUAL(sheet.GetCell("G51"_pos)->GetValue(), CellInterface::Value(50.0 / 99.0));
+    ASSERT_EQUAL(sheet.GetCell("G100"_pos)->GetValue(), CellInterface::Value(1.0));
+}
+
+// Lazy formulas are evaluated when read and again after an input changes,
+// and end up with the values an eager sheet computes from the same texts
+void TestLazyEvaluation() {
+    Sheet sheet;
+    sheet.SetEvaluationMode(Sheet::EvaluationMode::Lazy);
+    auto is_stale = [&sheet](Position pos) {
+        return static_cast<const Cell*>(sheet.GetCell(pos))->IsStale();
+    };
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+1");
+    sheet.SetCell("C1"_pos, "=B1*2");
+    sheet.SetCell("D1"_pos, "=SUM(A1:C1)");
+    sheet.SetCell("E1"_pos, "=D1/F1");
+    ASSERT(is_stale("B1"_pos) && is_stale("C1"_pos) && is_stale("D1"_pos) && is_stale("E1"_pos));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+    ASSERT(!is_stale("B1"_pos) && is_stale("D1"_pos));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(7.0));
+
+    sheet.SetCell("A1"_pos, "10");
+    ASSERT(is_stale("B1"_pos) && is_stale("C1"_pos) && is_stale("D1"_pos) && is_stale("E1"_pos));
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    ASSERT_EQUAL(values.str(), "10\t11\t22\t43\t#ARITHM!\t0\n");
+    sheet.SetCell("F1"_pos, "=1+1");
+    ASSERT(is_stale("E1"_pos) && !is_stale("D1"_pos));
+    sheet.SetCell("B2"_pos, "=SUM(A1:A3)");
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(10.0));
+    // a cell appearing inside a range
+    sheet.SetCell("A3"_pos, "5");
+    ASSERT(is_stale("B2"_pos) && !is_stale("D1"_pos));
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(43.0 / 2));
+    ASSERT_EQUAL(std::get<double>(ParseFormula("SUM(B1:B2)")->Evaluate(sheet)), 26.0);
+
+    // a long chain is evaluated without recursion
+    auto link = [](int i) {
+        return Position{i % Position::MAX_ROWS, 30 + i / Position::MAX_ROWS};
+    };
+    std::vector<std::pair<Position, std::string>> chain{{link(0), "1"}};
+    for (int i = 1; i < 100000; ++i) {
+        chain.push_back({link(i), "=" + link(i - 1).ToString() + "+1"});
+    }
+    sheet.SetCells(std::move(chain));
+    ASSERT(is_stale(link(99999)));
+    ASSERT_EQUAL(sheet.GetCell(link(99999))->GetValue(), CellInterface::Value(100000.0));
+
+    // random edits and reads against a sheet built eagerly at the end
+    Sheet lazy;
+    lazy.SetEvaluationMode(Sheet::EvaluationMode::Lazy);
+    std::mt19937 gen(23);
+    std::uniform_int_distribution<int> coordinate(0, 5);
+    auto random_name = [&]() {
+        return Position{coordinate(gen), coordinate(gen)}.ToString();
+    };
+    for (int i = 0; i < 5000; ++i) {
+        const Position pos{coordinate(gen), coordinate(gen)};
+        std::string text;
+        switch (gen() % 6) {
+            case 0:
+                text = std::to_string(gen() % 10);
+                break;
+            case 1:
+                lazy.ClearCell(pos);
+                continue;
+            case 2:
+                text = "=SUM(" + random_name() + ":" + random_name() + ")";
+                break;
+            case 3:
+                text = "=MAX(" + random_name() + ":" + random_name() + ")-" + random_name();
+                break;
+            default:
+                text = "=" + random_name() + "+" + random_name() + "/2";
+                break;
+        }
+        try {
+            lazy.SetCell(pos, text);
+        } catch (const CircularDependencyException&) {
+        } catch (const FormulaException&) {
+        }
+        if (const CellInterface* cell = lazy.GetCell({coordinate(gen), coordinate(gen)})) {
+            cell->GetValue();
+        }
+    }
+    std::vector<std::pair<Position, std::string>> texts;
+    for (int row = 0; row < 6; ++row) {
+        for (int col = 0; col < 6; ++col) {
+            if (const CellInterface* cell = lazy.GetCell({row, col})) {
+                texts.push_back({{row, col}, cell->GetText()});
+            }
+        }
+    }
+    Sheet eager;
+    eager.SetCells(texts);
+    for (const auto& [pos, text] : texts) {
+        ASSERT_EQUAL(lazy.GetCell(pos)->GetValue(), eager.GetCell(pos)->GetValue());
+    }
+
+    // back to eager, every value is known
+    lazy.SetCell("A1"_pos, "=B1+1");
+    lazy.SetEvaluationMode(Sheet::EvaluationMode::Eager);
+    ASSERT(!static_cast<const Cell*>(lazy.GetCell("A1"_pos))->IsStale());
+}
+
 }  // namespace
 
-int main() {
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string_view(argv[1]) == "--bench") {
+        RunBenchmarks();
+        return 0;
+    }
+
     TestRunner tr;
     RUN_TEST(tr, TestPositionAndStringConversion);
     RUN_TEST(tr, TestPositionToStringInvalid);
@@ -424,5 +1604,30 @@ int main() {
     RUN_TEST(tr, TestCellCircularReferences);
     RUN_TEST(tr, TestCache);
     RUN_TEST(tr, TestClearPrint);
+    RUN_TEST(tr, TestFormulaFromMemoryResource);
+    RUN_TEST(tr, TestFlatPositionMap);
+    RUN_TEST(tr, TestPrintableSizeTracksBoundingBox);
+    RUN_TEST(tr, TestNumericLiteralCells);
+    RUN_TEST(tr, TestTextCellsShareInternedStrings);
+    RUN_TEST(tr, TestDependencyGraph);
+    RUN_TEST(tr, TestSetCellsInBulk);
+    RUN_TEST(tr, TestRangeIteration);
+    RUN_TEST(tr, TestMemoryStats);
+    RUN_TEST(tr, TestTiledGrid);
+    RUN_TEST(tr, TestDeeplyNestedFormula);
+    RUN_TEST(tr, TestFunctionRef);
+    RUN_TEST(tr, TestFirstErrorWins);
+    RUN_TEST(tr, TestConstantFolding);
+    RUN_TEST(tr, TestHandWrittenParserMatchesAntlr);
+    RUN_TEST(tr, TestFormulaCache);
+    RUN_TEST(tr, TestRelativeFormulas);
+    RUN_TEST(tr, TestColumnKernels);
+    RUN_TEST(tr, TestColumnEvaluation);
+    RUN_TEST(tr, TestRangeFunctions);
+    RUN_TEST(tr, TestAggregateIndex);
+    RUN_TEST(tr, TestFormulaTextAtOffsets);
+    RUN_TEST(tr, TestLiteralAndReferenceDecoding);
+    RUN_TEST(tr, TestCommonSubexpressions);
+    RUN_TEST(tr, TestLazyEvaluation);
     return 0;
 }
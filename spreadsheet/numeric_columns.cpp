@@ -0,0 +1,134 @@
+#include "numeric_columns.h"
+
+#include <new>
+
+namespace {
+
+constexpr int MAX_LITERAL_DIGITS = 9;
+
+}  // namespace
+
+NumericColumns::NumericColumns(std::pmr::memory_resource* resource)
+    : resource_(resource)
+    , columns_(resource) {
+}
+
+NumericColumns::~NumericColumns() {
+    for (const Column& column : columns_) {
+        for (Block* block : column.blocks) {
+            if (block != nullptr) {
+                resource_->deallocate(block, sizeof(Block), alignof(Block));
+            }
+        }
+    }
+}
+
+std::optional<double> NumericColumns::ParseLiteral(std::string_view text) {
+    bool negative = false;
+    if (!text.empty() && text.front() == '-') {
+        negative = true;
+        text.remove_prefix(1);
+    }
+    if (text.empty() || text.size() > MAX_LITERAL_DIGITS) {
+        return std::nullopt;
+    }
+    if (text.front() == '0' && (text.size() > 1 || negative)) {
+        return std::nullopt;
+    }
+
+    int value = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9') {
+            return std::nullopt;
+        }
+        value = value * 10 + (c - '0');
+    }
+    return negative ? -value : value;
+}
+
+const double* NumericColumns::Find(Position pos) const {
+    if (pos.col >= static_cast<int>(columns_.size())) {
+        return nullptr;
+    }
+    const Column& column = columns_[pos.col];
+    const size_t index = pos.row / BLOCK_ROWS;
+    if (index >= column.present.size() || !((column.present[index] >> (pos.row % BLOCK_ROWS)) & 1u)) {
+        return nullptr;
+    }
+    return &(*column.blocks[index])[pos.row % BLOCK_ROWS];
+}
+
+bool NumericColumns::Set(Position pos, double value) {
+    while (static_cast<int>(columns_.size()) <= pos.col) {
+        columns_.push_back(Column{std::pmr::vector<uint64_t>(resource_), std::pmr::vector<Block*>(resource_)});
+    }
+
+    Column& column = columns_[pos.col];
+    const size_t index = pos.row / BLOCK_ROWS;
+    if (index >= column.present.size()) {
+        column.present.resize(index + 1, 0);
+        column.blocks.resize(index + 1, nullptr);
+    }
+    if (column.blocks[index] == nullptr) {
+        column.blocks[index] = new (resource_->allocate(sizeof(Block), alignof(Block))) Block{};
+    }
+
+    const uint64_t bit = uint64_t{1} << (pos.row % BLOCK_ROWS);
+    const bool inserted = (column.present[index] & bit) == 0;
+    (*column.blocks[index])[pos.row % BLOCK_ROWS] = value;
+    column.present[index] |= bit;
+    size_ += inserted;
+    return inserted;
+}
+
+bool NumericColumns::Erase(Position pos) {
+    if (!Contains(pos)) {
+        return false;
+    }
+    Column& column = columns_[pos.col];
+    const size_t index = pos.row / BLOCK_ROWS;
+    (*column.blocks[index])[pos.row % BLOCK_ROWS] = 0.0;
+    column.present[index] &= ~(uint64_t{1} << (pos.row % BLOCK_ROWS));
+    --size_;
+    if (column.present[index] == 0) {
+        resource_->deallocate(column.blocks[index], sizeof(Block), alignof(Block));
+        column.blocks[index] = nullptr;
+        TrimColumn(pos.col);
+    }
+    return true;
+}
+
+void NumericColumns::TrimColumn(int col) {
+    Column& column = columns_[col];
+    while (!column.present.empty() && column.present.back() == 0) {
+        column.present.pop_back();
+        column.blocks.pop_back();
+    }
+    if (!column.present.empty()) {
+        return;
+    }
+    column.present.shrink_to_fit();
+    column.blocks.shrink_to_fit();
+    while (!columns_.empty() && columns_.back().present.empty()) {
+        columns_.pop_back();
+    }
+    if (columns_.empty()) {
+        columns_.shrink_to_fit();
+    }
+}
+
+void NumericColumns::CopyColumn(Position first, size_t count, double* values) const {
+    const Column* column = first.col < static_cast<int>(columns_.size()) ? &columns_[first.col] : nullptr;
+    for (size_t i = 0; i < count;) {
+        const int row = first.row + static_cast<int>(i);
+        const size_t index = row / BLOCK_ROWS;
+        const size_t offset = row % BLOCK_ROWS;
+        const size_t span = std::min(BLOCK_ROWS - offset, count - i);
+        if (column != nullptr && index < column->blocks.size() && column->blocks[index] != nullptr) {
+            std::copy_n(column->blocks[index]->data() + offset, span, values + i);
+        } else {
+            std::fill_n(values + i, span, 0.0);
+        }
+        i += span;
+    }
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "common.h"
+#include "occupancy_index.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory_resource>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+// Column-oriented storage for cells whose text is a plain integer literal.
+// Every column keeps a presence word and a pointer to an array of doubles
+// per block of BLOCK_ROWS rows, so such a cell costs 8 bytes and a bit
+// instead of a Cell object. The array of a block is allocated with the
+// first number in its rows and freed when its presence word becomes 0, so
+// a column pays for values only in the blocks that hold numbers.
+class NumericColumns {
+public:
+    static constexpr int BLOCK_ROWS = 64;
+
+    explicit NumericColumns(std::pmr::memory_resource* resource);
+
+    NumericColumns(const NumericColumns&) = delete;
+    NumericColumns& operator=(const NumericColumns&) = delete;
+
+    ~NumericColumns();
+
+    // Texts stored here must print back unchanged and must give the same
+    // value Cell would give, so only canonical integers of up to 9 digits
+    // qualify: "0", "42", "-17", but not "007", "+1", "-0" or "1.5".
+    static std::optional<double> ParseLiteral(std::string_view text);
+
+    bool Contains(Position pos) const {
+        return Find(pos) != nullptr;
+    }
+
+    const double* Find(Position pos) const;
+
+    // Returns true if the position was empty before
+    bool Set(Position pos, double value);
+    bool Erase(Position pos);
+
+    size_t Size() const {
+        return size_;
+    }
+
+    // Calls visitor(pos, value) for every number in the rectangle, column by
+    // column, testing the rows of a block with its presence word
+    template <typename Visitor>
+    void ForEachInRect(Position top_left, Position bottom_right, Visitor visitor) const {
+        const int last_col = std::min(bottom_right.col, static_cast<int>(columns_.size()) - 1);
+        for (int col = top_left.col; col <= last_col; ++col) {
+            const Column& column = columns_[col];
+            const int last_row = std::min(bottom_right.row, static_cast<int>(column.present.size()) * BLOCK_ROWS - 1);
+            for (int row = top_left.row; row <= last_row; row = (row | (BLOCK_ROWS - 1)) + 1) {
+                uint64_t bits = column.present[row / BLOCK_ROWS] >> (row % BLOCK_ROWS);
+                const int span = std::min(last_row, row | (BLOCK_ROWS - 1)) - row + 1;
+                if (span < BLOCK_ROWS) {
+                    bits &= (uint64_t{1} << span) - 1;
+                }
+                for (; bits != 0; bits &= bits - 1) {
+                    const int found = row + CountTrailingZeros(bits);
+                    visitor(Position{found, col}, (*column.blocks[row / BLOCK_ROWS])[found % BLOCK_ROWS]);
+                }
+            }
+        }
+    }
+
+    // Copies count rows of a column from first on; empty rows give 0
+    void CopyColumn(Position first, size_t count, double* values) const;
+
+private:
+    // values of a block of rows; 0 where no number is present
+    using Block = std::array<double, BLOCK_ROWS>;
+
+    // Both vectors run up to the last block holding a number
+    struct Column {
+        std::pmr::vector<uint64_t> present;
+        // null where the presence word is 0
+        std::pmr::vector<Block*> blocks;
+    };
+
+    std::pmr::memory_resource* resource_;
+    // up to the rightmost column holding a number
+    std::pmr::vector<Column> columns_;
+    size_t size_ = 0;
+
+    // Drops the blocks left without numbers at the end of a column and the
+    // columns left without numbers at the end, releasing emptied vectors
+    void TrimColumn(int col);
+};
@@ -0,0 +1,32 @@
+#include "occupancy_index.h"
+
+#include <cassert>
+
+void OccupancyIndex::Add(int index) {
+    if (counts_[index]++ == 0) {
+        int word = index / WORD_BITS;
+        words_[word] |= uint64_t{1} << (index % WORD_BITS);
+        summary_[word / WORD_BITS] |= uint64_t{1} << (word % WORD_BITS);
+    }
+}
+
+void OccupancyIndex::Remove(int index) {
+    assert(counts_[index] > 0);
+    if (--counts_[index] == 0) {
+        int word = index / WORD_BITS;
+        words_[word] &= ~(uint64_t{1} << (index % WORD_BITS));
+        if (words_[word] == 0) {
+            summary_[word / WORD_BITS] &= ~(uint64_t{1} << (word % WORD_BITS));
+        }
+    }
+}
+
+int OccupancyIndex::GetMax() const {
+    for (int i = SUMMARY_WORDS - 1; i >= 0; --i) {
+        if (summary_[i] != 0) {
+            int word = i * WORD_BITS + HighestBit(summary_[i]);
+            return word * WORD_BITS + HighestBit(words_[word]);
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstdint>
+
+// Bit operations on a word, with a portable loop where the compiler has
+// no builtin. The scans need a non-zero word.
+inline int HighestBit(uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(word);
+#else
+    int bit = 0;
+    while (word >>= 1) {
+        ++bit;
+    }
+    return bit;
+#endif
+}
+
+inline int PopCount(uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(word);
+#else
+    int count = 0;
+    for (; word != 0; word &= word - 1) {
+        ++count;
+    }
+    return count;
+#endif
+}
+
+inline int CountTrailingZeros(uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(word);
+#else
+    int bit = 0;
+    while ((word & 1) == 0) {
+        word >>= 1;
+        ++bit;
+    }
+    return bit;
+#endif
+}
+
+// Number of occupied cells in every row (or column) of the sheet. Indices
+// with a non-zero count are mirrored in a two-level bitmap, so the highest
+// occupied index is found with two bit scans instead of a linear search.
+class OccupancyIndex {
+public:
+    static constexpr int SIZE = Position::MAX_ROWS;
+    static_assert(Position::MAX_ROWS == Position::MAX_COLS);
+
+    void Add(int index);
+    void Remove(int index);
+
+    int GetCount(int index) const {
+        return counts_[index];
+    }
+
+    // -1 when nothing is occupied
+    int GetMax() const;
+
+private:
+    static constexpr int WORD_BITS = 64;
+    static constexpr int WORDS = SIZE / WORD_BITS;
+    static constexpr int SUMMARY_WORDS = WORDS / WORD_BITS;
+
+    std::array<uint16_t, SIZE> counts_{};
+    std::array<uint64_t, WORDS> words_{};
+    std::array<uint64_t, SUMMARY_WORDS> summary_{};
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <type_traits>
+#include <utility>
+
+// Deleter for objects placed into a std::pmr::memory_resource by MakePmr.
+// It has no state, so a PmrPtr is as wide as a raw pointer. The object
+// names the resource it was taken from through GetMemoryResource(), and
+// the block is sizeof(T). A polymorphic T that is not final may point to
+// a derived object, so it reports the size of its most derived type
+// through GetAllocationSize() instead.
+struct PmrDeleter {
+    template <typename T>
+    void operator()(T* ptr) const {
+        std::pmr::memory_resource* resource = ptr->GetMemoryResource();
+        size_t size = sizeof(T);
+        if constexpr (std::is_polymorphic_v<T> && !std::is_final_v<T>) {
+            size = ptr->GetAllocationSize();
+        }
+        ptr->~T();
+        resource->deallocate(ptr, size, alignof(std::max_align_t));
+    }
+};
+
+template <typename T>
+using PmrPtr = std::unique_ptr<T, PmrDeleter>;
+
+// The object has to report the resource passed here
+template <typename T, typename... Args>
+PmrPtr<T> MakePmr(std::pmr::memory_resource* resource, Args&&... args) {
+    static_assert(alignof(T) <= alignof(std::max_align_t));
+    void* memory = resource->allocate(sizeof(T), alignof(std::max_align_t));
+    try {
+        return PmrPtr<T>(new (memory) T(std::forward<Args>(args)...));
+    } catch (...) {
+        resource->deallocate(memory, sizeof(T), alignof(std::max_align_t));
+        throw;
+    }
+}
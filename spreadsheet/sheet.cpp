@@ -6,59 +6,401 @@
 #include <algorithm>
 #include <functional>
 #include <iostream>
+#include <new>
 #include <optional>
 
 using namespace std::literals;
 
-Sheet::~Sheet() {}
+namespace {
+
+// What the cell adds to an aggregate over a range; value is set for numbers
+AggregateIndex::Kind GetAggregateKind(const CellInterface& cell, double& value) {
+    auto cell_value = cell.GetValue();
+    if (std::holds_alternative<FormulaError>(cell_value)) {
+        return AggregateIndex::Kind::Error;
+    }
+    if (!std::holds_alternative<double>(cell_value)) {
+        return AggregateIndex::Kind::None;
+    }
+    // an empty cell reads as 0 but is not a number
+    value = std::get<double>(cell_value);
+    return value != 0.0 || !cell.GetText().empty() ? AggregateIndex::Kind::Number : AggregateIndex::Kind::None;
+}
+
+// The same for the index, which keeps a stale formula as such instead of
+// evaluating it
+AggregateIndex::Kind GetIndexKind(const PmrPtr<Cell>& cell, double& value) {
+    if (((const Cell*)(cell.get()))->IsStale()) {
+        return AggregateIndex::Kind::Stale;
+    }
+    return GetAggregateKind(*cell, value);
+}
+
+}  // namespace
+
+Sheet::~Sheet() {
+    while (!number_views_.Empty()) {
+        DropNumberView(*number_views_.begin());
+    }
+}
+
+void Sheet::SetEvaluationMode(EvaluationMode mode) {
+    if (mode == evaluation_mode_) {
+        return;
+    }
+    evaluation_mode_ = mode;
+
+    // the values kept by the eager mode are not recomputed when an input
+    // changes, so none of them can be trusted
+    std::vector<Position> changed;
+    cells_.ForEachInRect({0, 0}, {Position::MAX_ROWS - 1, Position::MAX_COLS - 1},
+                         [&](Position pos, const PmrPtr<Cell>& cell) {
+                             Cell* current = (Cell*)(cell.get());
+                             if (mode == EvaluationMode::Lazy ? current->MarkStale() : current->IsStale()) {
+                                 changed.push_back(pos);
+                             }
+                         });
+    for (Position pos : changed) {
+        if (mode == EvaluationMode::Eager) {
+            EvaluateStale(pos);
+        } else {
+            if (auto cached = cache_.Find(pos)) {
+                *cached = std::nullopt;
+            }
+            IndexCell(pos);
+        }
+    }
+}
+
+void Sheet::EvaluateStale(Position pos) {
+    if (!IsStale(pos)) {
+        return;
+    }
+
+    // Stale formulas among the inputs. Those inside ranges are found by
+    // the aggregate index, which starts following their columns.
+    auto stale_inputs = [this](Position formula) {
+        std::vector<Position> inputs;
+        for (Position ref : dependency_graph_.GetReferences(formula)) {
+            if (IsStale(ref)) {
+                inputs.push_back(ref);
+            }
+        }
+        for (const PositionRange& range : dependency_graph_.GetRangeReferences(formula)) {
+            for (int col = range.top_left.col; col <= range.bottom_right.col; ++col) {
+                if (!aggregates_.IsIndexed(col)) {
+                    IndexColumn(col);
+                }
+            }
+            const std::vector<Position> stale = aggregates_.GetStale(range);
+            inputs.insert(inputs.end(), stale.begin(), stale.end());
+        }
+        return inputs;
+    };
+
+    // Post-order evaluates every formula after its inputs, so evaluating
+    // it never comes back here. There are no cycles, so a formula in
+    // progress cannot be reached again.
+    struct Frame {
+        Position pos;
+        std::vector<Position> inputs;
+        size_t next;
+    };
+    std::vector<Frame> stack;
+    stack.push_back({pos, stale_inputs(pos), 0});
+    while (!stack.empty()) {
+        Frame& frame = stack.back();
+        if (frame.next < frame.inputs.size()) {
+            const Position input = frame.inputs[frame.next++];
+            // unless another formula has needed it first
+            if (IsStale(input)) {
+                stack.push_back({input, stale_inputs(input), 0});
+            }
+            continue;
+        }
+        Cell* cell = (Cell*)(cells_.Find(frame.pos)->get());
+        cell->Evaluate();
+        cache_[frame.pos] = cell->GetValue();
+        IndexCell(frame.pos);
+        stack.pop_back();
+    }
+}
 
 void Sheet::SetCell(Position pos, std::string text) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("No such cell"s);
     }
 
-    if (pos_to_cell_.count(pos)) {
+    auto existing = cells_.Find(pos);
+    // a Cell object is kept whatever its new text, since pointers to it
+    // may have been handed out
+    auto number = existing == nullptr ? NumericColumns::ParseLiteral(text) : std::nullopt;
+    if (number) {
+        InvalidateCache(pos);
+        DropNumberView(pos);
+        if (numbers_.Set(pos, *number)) {
+            row_occupancy_.Add(pos.row);
+            col_occupancy_.Add(pos.col);
+        }
+        IndexCell(pos);
+        return;
+    }
+
+    if (existing) {
         InvalidateCache(pos);
-        ((Cell*)(pos_to_cell_.at(pos).get()))->Set(text);
+        ((Cell*)(existing->get()))->Set(text);
     }
     else {
-        std::unique_ptr<CellInterface> cell = std::make_unique<Cell>(pos, *this);
+        if (evaluation_mode_ == EvaluationMode::Lazy) {
+            // a range over an empty position may see the new cell
+            MarkDependentsStale(pos);
+        }
+        PmrPtr<Cell> cell = MakePmr<Cell>(&cell_memory_, pos, *this);
         ((Cell*)(cell.get()))->Set(text);
 
-        cache_[pos] = cell.get()->GetValue();
+        if (((Cell*)(cell.get()))->IsStale()) {
+            cache_[pos] = std::nullopt;
+        } else {
+            cache_[pos] = cell.get()->GetValue();
+        }
+
+        DropNumberView(pos);
+        // evaluating the formula may have already created an empty cell here
+        if (cells_.Find(pos) == nullptr && !numbers_.Erase(pos)) {
+            row_occupancy_.Add(pos.row);
+            col_occupancy_.Add(pos.col);
+        }
+        cells_.Insert(pos, std::move(cell));
+    }
+    IndexCell(pos);
+}
+
+namespace {
 
-        pos_to_cell_[pos] = std::move(cell);
+struct PendingFormula {
+    Position pos;
+    FormulaCache::Handle formula;
+    std::vector<Position> refs;
+    std::vector<PositionRange> ranges;
+};
+
+int64_t GetArea(const PositionRange& range) {
+    return int64_t{range.bottom_right.row - range.top_left.row + 1}
+         * (range.bottom_right.col - range.top_left.col + 1);
+}
 
-        if (printable_size_.rows == 0 && printable_size_.cols == 0) {
-            printable_size_ = { pos.row + 1, pos.col + 1};
+// Shorter runs are not worth filling the vectors for
+constexpr size_t MIN_COLUMN_RUN = 16;
 
-            max_in_row_[pos.row] = pos.col;
-            max_in_col_[pos.col] = pos.row;
+}  // namespace
+
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+    FlatPositionMap<uint32_t> last_entry;
+    last_entry.Reserve(cells.size());
+    for (uint32_t i = 0; i < cells.size(); ++i) {
+        if (!cells[i].first.IsValid()) {
+            throw InvalidPositionException("No such cell"s);
+        }
+        last_entry[cells[i].first] = i;
+    }
 
+    // parse every formula before anything is changed
+    std::vector<PendingFormula> formulas;
+    FlatPositionMap<uint32_t> formula_index;
+    std::vector<uint32_t> plain;
+    for (uint32_t i = 0; i < cells.size(); ++i) {
+        auto& [pos, text] = cells[i];
+        if (last_entry.At(pos) != i) {
+            continue;
+        }
+        if (text.size() > 1 && text.at(0) == '=') {
+            formula_index[pos] = static_cast<uint32_t>(formulas.size());
+            auto formula = formulas_.Get(std::string_view(text).substr(1), pos);
+            auto refs = formula->GetReferencedCells(formula.GetOffset(pos));
+            auto ranges = formula->GetReferencedRanges(formula.GetOffset(pos));
+            formulas.push_back({pos, std::move(formula), std::move(refs), std::move(ranges)});
         } else {
-            auto max_col_in_printable_area = printable_size_.cols - 1;
-            auto max_row_in_printable_area = printable_size_.rows - 1;
-
-            if (pos.col > max_col_in_printable_area) {
-                printable_size_.cols = pos.col + 1;
-            }       
-            if (pos.row > max_row_in_printable_area) {
-                printable_size_.rows = pos.row + 1;
+            plain.push_back(i);
+        }
+    }
+
+    // One depth-first pass over the batch. References of batch cells come
+    // from the batch, those of other cells from the graph. Post-order gives
+    // the evaluation order: every formula follows the formulas it refers to.
+    auto references = [&](Position pos) {
+        if (const uint32_t* index = formula_index.Find(pos)) {
+            const auto& refs = formulas[*index].refs;
+            return PositionSpan(refs.data(), refs.data() + refs.size());
+        }
+        if (last_entry.Contains(pos)) {
+            return PositionSpan{};
+        }
+        return dependency_graph_.GetReferences(pos);
+    };
+    // A range refers to the formulas inside it: those of the batch and
+    // those of the other cells
+    auto range_references = [&](Position pos) {
+        std::vector<Position> result;
+        RangeSpan ranges;
+        if (const uint32_t* index = formula_index.Find(pos)) {
+            const auto& batch_ranges = formulas[*index].ranges;
+            ranges = RangeSpan(batch_ranges.data(), batch_ranges.data() + batch_ranges.size());
+        } else if (!last_entry.Contains(pos)) {
+            ranges = dependency_graph_.GetRangeReferences(pos);
+        }
+        for (const PositionRange& range : ranges) {
+            if (GetArea(range) > static_cast<int64_t>(formulas.size())) {
+                for (const auto& pending : formulas) {
+                    if (range.Contains(pending.pos)) {
+                        result.push_back(pending.pos);
+                    }
+                }
+            } else {
+                for (int row = range.top_left.row; row <= range.bottom_right.row; ++row) {
+                    for (int col = range.top_left.col; col <= range.bottom_right.col; ++col) {
+                        if (formula_index.Contains({row, col})) {
+                            result.push_back({row, col});
+                        }
+                    }
+                }
+            }
+            dependency_graph_.ForEachReferrerIn(range, [&](Position referrer) {
+                if (!last_entry.Contains(referrer)) {
+                    result.push_back(referrer);
+                }
+            });
+        }
+        return result;
+    };
+
+    enum : uint8_t { IN_PROGRESS = 1, DONE = 2 };
+    FlatPositionMap<uint8_t> state;
+    std::vector<uint32_t> order;
+    order.reserve(formulas.size());
+    struct Frame {
+        Position pos;
+        PositionSpan refs;
+        // visited after refs
+        std::vector<Position> range_refs;
+        size_t next;
+
+        size_t GetCount() const {
+            return refs.size() + range_refs.size();
+        }
+
+        Position Get(size_t index) const {
+            return index < refs.size() ? refs.begin()[index] : range_refs[index - refs.size()];
+        }
+    };
+    std::vector<Frame> stack;
+    // Roots go column by column, top to bottom, so that the cells of a
+    // filled column that do not depend on each other end up next to each
+    // other in the order
+    std::vector<uint32_t> roots(formulas.size());
+    for (uint32_t i = 0; i < roots.size(); ++i) {
+        roots[i] = i;
+    }
+    std::sort(roots.begin(), roots.end(), [&formulas](uint32_t lhs, uint32_t rhs) {
+        const Position a = formulas[lhs].pos;
+        const Position b = formulas[rhs].pos;
+        return a.col != b.col ? a.col < b.col : a.row < b.row;
+    });
+    for (uint32_t root_index : roots) {
+        const auto& root = formulas[root_index];
+        if (state.Contains(root.pos)) {
+            continue;
+        }
+        state[root.pos] = IN_PROGRESS;
+        stack.push_back({root.pos, references(root.pos), range_references(root.pos), 0});
+        while (!stack.empty()) {
+            Frame& frame = stack.back();
+            if (frame.next == frame.GetCount()) {
+                state[frame.pos] = DONE;
+                if (const uint32_t* index = formula_index.Find(frame.pos)) {
+                    order.push_back(*index);
+                }
+                stack.pop_back();
+                continue;
+            }
+            Position ref = frame.Get(frame.next++);
+            uint8_t& ref_state = state[ref];
+            if (ref_state == IN_PROGRESS) {
+                throw CircularDependencyException("The circle here");
+            }
+            if (ref_state == 0) {
+                ref_state = IN_PROGRESS;
+                stack.push_back({ref, references(ref), range_references(ref), 0});
             }
+        }
+    }
 
-            if (!max_in_col_[pos.col].has_value()) {
-                max_in_col_[pos.col] = pos.row;
-            } else if (pos.row > max_in_col_[pos.col]) {
-                max_in_col_[pos.col] = pos.row;
+    for (uint32_t i : plain) {
+        SetCell(cells[i].first, std::move(cells[i].second));
+    }
+    for (const auto& pending : formulas) {
+        InsertFormula(pending.pos, pending.formula);
+    }
+    // referenced positions that are still empty get an empty cell; the
+    // empty parts of ranges stay empty
+    for (const auto& pending : formulas) {
+        for (Position ref : pending.refs) {
+            if (!Contains(ref)) {
+                SetCell(ref, "");
             }
+        }
+    }
+
+    if (evaluation_mode_ == EvaluationMode::Lazy) {
+        for (const auto& pending : formulas) {
+            IndexCell(pending.pos);
+        }
+        return;
+    }
 
-            if (!max_in_row_[pos.row].has_value()) {
-                max_in_row_[pos.row] = pos.col;
-            } else if (pos.col > max_in_row_[pos.row]) {
-                max_in_row_[pos.row] = pos.col;
+    // A run is a stretch of the order sharing one formula down consecutive
+    // rows of a column. Its cells are evaluated together unless one of them
+    // refers into the run, directly or through a range.
+    std::vector<FormulaInterface::Value> results;
+    for (size_t run = 0; run < order.size();) {
+        const PendingFormula& first = formulas[order[run]];
+        size_t end = run + 1;
+        while (end < order.size()) {
+            const PendingFormula& next = formulas[order[end]];
+            if (!(next.formula == first.formula && next.pos.col == first.pos.col
+                  && next.pos.row == first.pos.row + static_cast<int>(end - run))) {
+                break;
             }
+            ++end;
+        }
+        const int last_row = first.pos.row + static_cast<int>(end - run) - 1;
+        bool batch = end - run >= MIN_COLUMN_RUN;
+        const PositionRange run_range{first.pos, {last_row, first.pos.col}};
+        for (size_t i = run; batch && i < end; ++i) {
+            const PendingFormula& pending = formulas[order[i]];
+            batch = std::none_of(pending.refs.begin(), pending.refs.end(), [&run_range](Position ref) {
+                return run_range.Contains(ref);
+            }) && std::none_of(pending.ranges.begin(), pending.ranges.end(), [&run_range](const PositionRange& range) {
+                return range.top_left.row <= run_range.bottom_right.row && range.bottom_right.row >= run_range.top_left.row
+                    && range.top_left.col <= run_range.top_left.col && range.bottom_right.col >= run_range.top_left.col;
+            });
         }
 
+        if (batch) {
+            results.resize(end - run);
+            first.formula->EvaluateColumn(*this, first.formula.GetOffset(first.pos), results.size(), results.data());
+        }
+        for (size_t i = run; i < end; ++i) {
+            const Position pos = formulas[order[i]].pos;
+            CellInterface* cell = cells_.Find(pos)->get();
+            if (batch) {
+                ((Cell*)cell)->SetFormulaValue(results[i - run]);
+            } else {
+                ((Cell*)cell)->Evaluate();
+            }
+            cache_[pos] = cell->GetValue();
+            IndexCell(pos);
+        }
+        run = end;
     }
 }
 
@@ -67,158 +409,380 @@ const CellInterface* Sheet::GetCell(Position pos) const {
         throw InvalidPositionException("No such cell"s);
     }
 
-    if (pos_to_cell_.count(pos)) {
-        return pos_to_cell_.at(pos).get();
-    } else {
+    if (auto cell = cells_.Find(pos)) {
+        return cell->get();
+    }
+    const double* number = numbers_.Find(pos);
+    if (number == nullptr) {
         return nullptr;
-    }  
+    }
+    NumberCell*& view = number_views_[pos];
+    if (view == nullptr) {
+        view = new (view_memory_.allocate(sizeof(NumberCell), alignof(NumberCell))) NumberCell(*number);
+    }
+    return view;
 }
 
 CellInterface* Sheet::GetCell(Position pos) {
+    // a number has no Cell object to change, so it gets the same view
+    return const_cast<CellInterface*>(static_cast<const Sheet&>(*this).GetCell(pos));
+}
+
+void Sheet::ClearCell(Position pos) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("No such cell"s);
     }
 
-    if (pos_to_cell_.count(pos)) {
-        return pos_to_cell_.at(pos).get();
-    } else {
-        return nullptr;
+    if (auto cell = cells_.Find(pos)) {
+        ((Cell*)(cell->get()))->Clear();
+    }
+    DropNumberView(pos);
+    if (cells_.Erase(pos) || numbers_.Erase(pos)) {
+        InvalidateCache(pos);
+        cache_.Erase(pos);
+        row_occupancy_.Remove(pos.row);
+        col_occupancy_.Remove(pos.col);
+        IndexCell(pos);
     }
 }
 
-void Sheet::ClearCell(Position pos) {
-    if (!pos.IsValid()) {
+Size Sheet::GetPrintableSize() const {
+    return {row_occupancy_.GetMax() + 1, col_occupancy_.GetMax() + 1};
+}
+
+inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value& value) {
+    std::visit(
+        [&](const auto& x) {
+            output << x;
+        },
+        value);
+    return output;
+}
+
+Sheet::Range Sheet::GetRange(Position top_left, Position bottom_right) const {
+    if (!top_left.IsValid() || !bottom_right.IsValid()) {
         throw InvalidPositionException("No such cell"s);
     }
+    return Range(this, top_left, bottom_right);
+}
 
-    if (pos_to_cell_.count(pos)) {
-        pos_to_cell_.erase(pos);
+Sheet::RangeIterator::RangeIterator(const Sheet* sheet, Position top_left, Position bottom_right)
+    : sheet_(sheet)
+    , top_left_(top_left)
+    , bottom_right_(bottom_right)
+    , next_row_(top_left.row) {
+    if (top_left.row > bottom_right.row || top_left.col > bottom_right.col) {
+        sheet_ = nullptr;
+        return;
+    }
+    LoadNextBand();
+}
 
-        if (printable_size_.rows == 1 && printable_size_.cols == 1) {
-            printable_size_ = {0, 0};
+Sheet::RangeEntry Sheet::RangeIterator::operator*() const {
+    const Slot& slot = band_[index_];
+    return {Position::Unpack(slot.key), slot.cell != nullptr ? slot.cell : &number_};
+}
 
-            max_in_row_[pos.row] = std::nullopt;
-            max_in_col_[pos.col] = std::nullopt;
+Sheet::RangeIterator& Sheet::RangeIterator::operator++() {
+    if (++index_ == band_.size()) {
+        LoadNextBand();
+    } else {
+        Settle();
+    }
+    return *this;
+}
 
-        } else {
-            auto max_col_in_printable_area = printable_size_.cols - 1;
-            auto max_row_in_printable_area = printable_size_.rows - 1;
-
-            auto find_max = [this] (auto first, auto last, auto except, int max) {
-                for (auto it = first; it != last; ++it)
-                    if (it->has_value() && it != except)
-                        if (it->value() > max)
-                            max = it->value();
-                return max;
-            };
-
-            if (pos.row == max_row_in_printable_area) { // bottom row
-                auto beg = max_in_col_.begin();
-                int max_row = find_max(beg, beg + max_col_in_printable_area + 1, beg + pos.col, -1);
-
-                max_row_in_printable_area = max_row;
-                printable_size_.rows = max_row + 1;
-
-                if (max_in_col_.at(pos.col).value() == 0) {
-                    max_in_col_[pos.col] = std::nullopt;
-                } else {
-                    max_in_col_[pos.col] = max_row_in_printable_area;
-                }
-            }
+bool Sheet::RangeIterator::operator==(const RangeIterator& other) const {
+    if (sheet_ == nullptr || other.sheet_ == nullptr) {
+        return sheet_ == other.sheet_;
+    }
+    return sheet_ == other.sheet_ && next_row_ == other.next_row_ && index_ == other.index_;
+}
 
-            if (pos.col == max_col_in_printable_area) { // right col
-                auto beg = max_in_row_.begin();
-                int max_col = find_max(beg, beg + max_row_in_printable_area + 1, beg + pos.row, -1);
+bool Sheet::RangeIterator::operator!=(const RangeIterator& other) const {
+    return !(*this == other);
+}
 
-                max_col_in_printable_area = max_col;
-                printable_size_.cols = max_col + 1;
+void Sheet::RangeIterator::LoadNextBand() {
+    band_.clear();
+    index_ = 0;
+    while (band_.empty() && next_row_ <= bottom_right_.row) {
+        const Position first{next_row_, top_left_.col};
+        const Position last{std::min(bottom_right_.row, next_row_ | TiledGrid<PmrPtr<Cell>>::TILE_MASK), bottom_right_.col};
+        next_row_ = last.row + 1;
+
+        sheet_->cells_.ForEachInRect(first, last, [this](Position pos, const PmrPtr<Cell>& cell) {
+            band_.push_back({pos.Pack(), cell.get(), 0.0});
+        });
+        sheet_->numbers_.ForEachInRect(first, last, [this](Position pos, double number) {
+            band_.push_back({pos.Pack(), nullptr, number});
+        });
+        // packed keys order positions row by row
+        std::sort(band_.begin(), band_.end(), [](const Slot& lhs, const Slot& rhs) {
+            return lhs.key < rhs.key;
+        });
+    }
+    if (band_.empty()) {
+        sheet_ = nullptr;
+    } else {
+        Settle();
+    }
+}
 
-                if (max_in_row_.at(pos.row).value() == 0) {
-                    max_in_row_[pos.row] = std::nullopt;
-                } else {
-                    max_in_row_[pos.row] = max_col_in_printable_area;
-                }
-            }
+void Sheet::RangeIterator::Settle() {
+    if (band_[index_].cell == nullptr) {
+        number_ = NumberCell(band_[index_].number);
+    }
+}
 
-            if (pos.row < max_row_in_printable_area && pos.col < max_col_in_printable_area) { // center
-                for (int col = max_col_in_printable_area; col >= 0; col--) {
-                    if (pos_to_cell_.count({ pos.row, col})) {
-                        max_in_row_[pos.row] = col;
-                        break;
-                    }
-                }
-                if (max_in_row_.at(pos.row).value() == pos.col) {
-                    max_in_row_[pos.row] = std::nullopt;
-                }
+// Prints the printable area cell by cell; empty positions still get their
+// separators
+template <typename Print>
+void Sheet::PrintCells(std::ostream& output, Print print) const {
+    const Size printable_size = GetPrintableSize();
+    if (printable_size.rows == 0) {
+        return;
+    }
 
-                for (int row = max_row_in_printable_area; row >= 0; row--) {
-                    if (pos_to_cell_.count({ row, pos.col})) {
-                        max_in_col_[pos.col] = row;
-                        break;
-                    }
-                }
-                if (max_in_col_.at(pos.col).value() == pos.row) {
-                    max_in_col_[pos.col] = std::nullopt;
-                }
+    // the position the next printed cell would have
+    int row = 0;
+    int col = 0;
+    auto move_to = [&](Position pos) {
+        for (; row < pos.row; ++row, col = 0) {
+            for (; col < printable_size.cols - 1; ++col) {
+                output << '\t';
             }
+            output << '\n';
         }
+        for (; col < pos.col; ++col) {
+            output << '\t';
+        }
+    };
+
+    ForEachInRange({0, 0}, {printable_size.rows - 1, printable_size.cols - 1},
+                   [&](Position pos, const CellInterface& cell) {
+                       move_to(pos);
+                       print(pos, cell);
+                   });
+    move_to({printable_size.rows, 0});
+}
 
-    }
+void Sheet::PrintValues(std::ostream& output) const {
+    PrintCells(output, [&](Position pos, const CellInterface& cell) {
+        const auto* cached = cache_.Find(pos);
+        if (cached != nullptr && cached->has_value()) {
+            output << cached->value();
+        } else {
+            output << cell.GetValue();
+        }
+    });
 }
 
-Size Sheet::GetPrintableSize() const {
-    return printable_size_;
+void Sheet::PrintTexts(std::ostream& output) const {
+    PrintCells(output, [&](Position, const CellInterface& cell) {
+        output << cell.GetText();
+    });
 }
 
-inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value& value) {
-    std::visit(
-        [&](const auto& x) {
-            output << x;
-        },
-        value);
-    return output;
+void Sheet::GetColumnValues(Position first, size_t count, double* values, bool* not_number) const {
+    const int last_row = first.row + static_cast<int>(count) - 1;
+    if (!first.IsValid() || last_row >= Position::MAX_ROWS) {
+        throw InvalidPositionException("No such cell"s);
+    }
+
+    numbers_.CopyColumn(first, count, values);
+    std::fill_n(not_number, count, false);
+
+    cells_.ForEachInRect(first, {last_row, first.col}, [&](Position pos, const PmrPtr<Cell>& cell) {
+        const size_t i = pos.row - first.row;
+        auto value = cell->GetValue();
+        if (std::holds_alternative<double>(value)) {
+            values[i] = std::get<double>(value);
+        } else {
+            not_number[i] = true;
+        }
+    });
 }
 
-void Sheet::PrintValues(std::ostream& output) const {
-    for (int row = 0; row < printable_size_.rows; ++row) {
-        for (int col = 0; col < printable_size_.cols; ++col) {
-            auto pos = Position{row, col};
-            if (pos_to_cell_.count(pos)) {
-                if (cache_.at(pos).has_value()) {
-                    output << cache_.at(pos).value();
-                } else {
-                    output << pos_to_cell_.at(pos)->GetValue();
-                }
+bool Sheet::AggregateRange(PositionRange range, RangeAggregate& aggregate) const {
+    if (!range.top_left.IsValid() || !range.bottom_right.IsValid()) {
+        throw InvalidPositionException("No such cell"s);
+    }
+
+    if (!aggregate.needs_extremes) {
+        for (int col = range.top_left.col; col <= range.bottom_right.col; ++col) {
+            if (!aggregates_.IsIndexed(col)) {
+                IndexColumn(col);
             }
-            if (col == (printable_size_.cols -1)) {
-                output << '\n';
-            } else {
-                output << '\t';
+        }
+        auto totals = aggregates_.Query(range);
+        if (totals.stale > 0) {
+            // evaluating a stale formula brings its entry up to date
+            for (Position pos : aggregates_.GetStale(range)) {
+                (*cells_.Find(pos))->GetValue();
             }
+            totals = aggregates_.Query(range);
         }
+        aggregate.AddTotals(totals.sum, totals.count);
+        return totals.errors == 0;
     }
+
+    numbers_.ForEachInRect(range.top_left, range.bottom_right, [&aggregate](Position, double number) {
+        aggregate.Add(number);
+    });
+    bool has_error = false;
+    cells_.ForEachInRect(range.top_left, range.bottom_right, [&](Position, const PmrPtr<Cell>& cell) {
+        double number = 0.0;
+        switch (GetAggregateKind(*cell, number)) {
+            case AggregateIndex::Kind::Number:
+                aggregate.Add(number);
+                break;
+            case AggregateIndex::Kind::Error:
+                has_error = true;
+                break;
+            default:
+                break;
+        }
+    });
+    return !has_error;
 }
 
-void Sheet::PrintTexts(std::ostream& output) const {
-    for (int row = 0; row < printable_size_.rows; ++row) {
-        for (int col = 0; col < printable_size_.cols; ++col) {
-            auto pos = Position{row, col};
-            if (pos_to_cell_.count(pos)) {
-                output << pos_to_cell_.at(pos)->GetText();
-            }
-            if (col == (printable_size_.cols -1)) {
-                output << '\n';
-            } else {
-                output << '\t';
+CellInterface::Value Sheet::GetCellValue(Position pos) const {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("No such cell"s);
+    }
+
+    if (auto cell = cells_.Find(pos)) {
+        return (*cell)->GetValue();
+    } else if (auto number = numbers_.Find(pos)) {
+        return *number;
+    } else {
+        return 0.0;
+    }
+}
+
+bool Sheet::Contains(Position pos) const {
+    return cells_.Find(pos) != nullptr || numbers_.Contains(pos);
+}
+
+void Sheet::InvalidateCache(Position pos) {
+    if (auto cached = cache_.Find(pos)) {
+        *cached = std::nullopt;
+    }
+    if (evaluation_mode_ == EvaluationMode::Lazy) {
+        // clears the entries of the formulas it makes stale
+        MarkDependentsStale(pos);
+        return;
+    }
+    for (Position parent : dependency_graph_.GetDependents(pos)) {
+        if (auto cached = cache_.Find(parent)) {
+            *cached = std::nullopt;
+        }
+    }
+    dependency_graph_.ForEachRangeDependent(pos, [this](Position parent) {
+        if (auto cached = cache_.Find(parent)) {
+            *cached = std::nullopt;
+        }
+    });
+}
+
+void Sheet::MarkDependentsStale(Position pos) {
+    std::vector<Position> stack{pos};
+    // a formula that is stale already has stale dependents as well
+    auto mark = [this, &stack](Position dependent) {
+        auto cell = cells_.Find(dependent);
+        if (cell != nullptr && ((Cell*)(cell->get()))->MarkStale()) {
+            if (auto cached = cache_.Find(dependent)) {
+                *cached = std::nullopt;
             }
+            IndexCell(dependent);
+            stack.push_back(dependent);
+        }
+    };
+    while (!stack.empty()) {
+        const Position changed = stack.back();
+        stack.pop_back();
+        for (Position dependent : dependency_graph_.GetDependents(changed)) {
+            mark(dependent);
         }
+        dependency_graph_.ForEachRangeDependent(changed, mark);
     }
 }
 
-void Sheet::InvalidateCache(Position pos) {
+bool Sheet::IsStale(Position pos) const {
+    auto cell = cells_.Find(pos);
+    return cell != nullptr && ((const Cell*)(cell->get()))->IsStale();
+}
+
+void Sheet::IndexCell(Position pos) const {
+    if (!aggregates_.IsIndexed(pos.col)) {
+        return;
+    }
+    if (const double* number = numbers_.Find(pos)) {
+        aggregates_.Set(pos, AggregateIndex::Kind::Number, *number);
+    } else if (auto cell = cells_.Find(pos)) {
+        double number = 0.0;
+        const auto kind = GetIndexKind(*cell, number);
+        aggregates_.Set(pos, kind, number);
+    } else {
+        aggregates_.Set(pos, AggregateIndex::Kind::None);
+    }
+}
+
+void Sheet::IndexColumn(int col) const {
+    aggregates_.AddColumn(col);
+    const Position top{0, col};
+    const Position bottom{Position::MAX_ROWS - 1, col};
+    numbers_.ForEachInRect(top, bottom, [this](Position pos, double number) {
+        aggregates_.Set(pos, AggregateIndex::Kind::Number, number);
+    });
+    cells_.ForEachInRect(top, bottom, [this](Position pos, const PmrPtr<Cell>& cell) {
+        double number = 0.0;
+        const auto kind = GetIndexKind(cell, number);
+        aggregates_.Set(pos, kind, number);
+    });
+}
+
+void Sheet::InsertFormula(Position pos, FormulaCache::Handle formula) {
+    InvalidateCache(pos);
+    if (auto existing = cells_.Find(pos)) {
+        ((Cell*)(existing->get()))->SetFormula(std::move(formula));
+        return;
+    }
+
+    PmrPtr<Cell> cell = MakePmr<Cell>(&cell_memory_, pos, *this);
+    ((Cell*)(cell.get()))->SetFormula(std::move(formula));
+    DropNumberView(pos);
+    if (!numbers_.Erase(pos)) {
+        row_occupancy_.Add(pos.row);
+        col_occupancy_.Add(pos.col);
+    }
     cache_[pos] = std::nullopt;
-    for (const auto& parent : ((Cell*)GetCell(pos))->GetParents()) {
-        cache_[parent] = std::nullopt;
+    cells_.Insert(pos, std::move(cell));
+}
+
+Sheet::MemoryStats Sheet::GetMemoryStats() const {
+    MemoryStats stats;
+    stats.cells = {cell_memory_.GetBytes(), cells_.Size()};
+    stats.numbers = {number_memory_.GetBytes(), numbers_.Size()};
+    stats.texts = {text_memory_.GetBytes(), strings_.GetUniqueCount()};
+    stats.formulas = {formula_memory_.GetBytes(), formula_memory_.GetBlocks()};
+    stats.dependencies = {dependency_memory_.GetBytes(),
+                          dependency_graph_.GetEdgeCount() + dependency_graph_.GetRangeEdgeCount()};
+    stats.cache = {cache_memory_.GetBytes(), cache_.Size()};
+    stats.grid = {cells_.GetAllocatedBytes(), cells_.GetTileCount()};
+    stats.occupancy = {sizeof(row_occupancy_) + sizeof(col_occupancy_), 2};
+    stats.aggregates = {aggregate_memory_.GetBytes(), aggregates_.GetIndexedColumnCount()};
+    stats.views = {view_memory_.GetBytes(), number_views_.Size()};
+    return stats;
+}
+
+void Sheet::DropNumberView(Position pos) {
+    if (NumberCell** view = number_views_.Find(pos)) {
+        NumberCell* cell = *view;
+        number_views_.Erase(pos);
+        cell->~NumberCell();
+        view_memory_.deallocate(cell, sizeof(NumberCell), alignof(NumberCell));
     }
 }
 
@@ -1,20 +1,72 @@
 #pragma once
 
+#include "aggregate_index.h"
 #include "cell.h"
 #include "common.h"
+#include "counting_resource.h"
+#include "dependency_graph.h"
+#include "flat_position_map.h"
+#include "formula_cache.h"
+#include "numeric_columns.h"
+#include "occupancy_index.h"
+#include "string_pool.h"
+#include "tiled_grid.h"
 
 #include <functional>
-#include <deque>
 #include <unordered_map>
 #include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory_resource>
 #include <optional>
+#include <utility>
+#include <vector>
 
+// Not safe to use from several threads at once, const methods included:
+// in the lazy mode a read evaluates stale formulas and keeps their values,
+// a range query may start indexing a column, and the const GetCell creates
+// views of numbers. Callers sharing a sheet between threads have to
+// serialise every call.
 class Sheet : public SheetInterface {
 public:
+    // Eager evaluates a formula when it is set and keeps that value. Lazy
+    // only parses it and records its references: the value is computed
+    // when it is first read, printed or aggregated, and kept until the
+    // formula or one of its inputs changes, which makes it and everything
+    // depending on it stale again.
+    enum class EvaluationMode {
+        Eager,
+        Lazy,
+    };
+
     ~Sheet();
 
+    // Switching to Lazy makes every formula stale, switching to Eager
+    // evaluates the stale ones
+    void SetEvaluationMode(EvaluationMode mode);
+
+    EvaluationMode GetEvaluationMode() const {
+        return evaluation_mode_;
+    }
+
+    // Evaluates the stale formula at pos after the stale formulas it
+    // depends on, in one depth-first pass without recursion
+    void EvaluateStale(Position pos);
+
     void SetCell(Position pos, std::string text) override;
 
+    // Sets many cells at once. Formulas are parsed first, cycles are checked
+    // in one pass over the whole batch and every formula is evaluated once,
+    // after the cells it refers to. If any entry is invalid, the sheet is left
+    // unchanged. A position listed twice gets its last text. Runs of a
+    // filled column are evaluated for the whole run at once. In the lazy
+    // mode the formulas are checked and installed but not evaluated.
+    void SetCells(std::vector<std::pair<Position, std::string>> cells);
+
+    // A number stored without a Cell object is returned as a view holding
+    // its value. Both overloads return the same view, which stays valid
+    // until the position is set or cleared.
     const CellInterface* GetCell(Position pos) const override;
     CellInterface* GetCell(Position pos) override;
 
@@ -25,15 +77,203 @@ public:
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
+    CellInterface::Value GetCellValue(Position pos) const override;
+    // Copies integer literals straight from their column and visits only
+    // the Cell objects of the run
+    void GetColumnValues(Position first, size_t count, double* values, bool* not_number) const override;
+    // SUM, AVERAGE and COUNT are answered from the aggregate index, which
+    // starts following a column the first time a range covers it. MIN and
+    // MAX take the integer literals of the rectangle straight from their
+    // columns and visit only the Cell objects inside it.
+    bool AggregateRange(PositionRange range, RangeAggregate& aggregate) const override;
+
+    // Occupied position of a range. A number stored without a Cell object
+    // is shown through a proxy that lives until the iterator moves on.
+    struct RangeEntry {
+        Position pos;
+        const CellInterface* cell;
+    };
+
+    // Walks the occupied cells of a rectangle in row-major order. Cells are
+    // gathered TiledGrid::TILE_SIDE rows at a time from the occupancy masks,
+    // so the cost follows the number of cells rather than the area.
+    class RangeIterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = RangeEntry;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const RangeEntry*;
+        using reference = RangeEntry;
+
+        // end of any range
+        RangeIterator() = default;
+        RangeIterator(const Sheet* sheet, Position top_left, Position bottom_right);
+
+        RangeEntry operator*() const;
+        RangeIterator& operator++();
+
+        bool operator==(const RangeIterator& other) const;
+        bool operator!=(const RangeIterator& other) const;
+
+    private:
+        struct Slot {
+            uint32_t key;
+            const CellInterface* cell;
+            double number;
+        };
+
+        const Sheet* sheet_ = nullptr;
+        Position top_left_;
+        Position bottom_right_;
+        int next_row_ = 0;
+        std::vector<Slot> band_;
+        size_t index_ = 0;
+        NumberCell number_;
+
+        void LoadNextBand();
+        void Settle();
+    };
+
+    class Range {
+    public:
+        Range(const Sheet* sheet, Position top_left, Position bottom_right)
+            : sheet_(sheet)
+            , top_left_(top_left)
+            , bottom_right_(bottom_right) {
+        }
+
+        RangeIterator begin() const {
+            return RangeIterator(sheet_, top_left_, bottom_right_);
+        }
+
+        RangeIterator end() const {
+            return RangeIterator();
+        }
+
+    private:
+        const Sheet* sheet_;
+        Position top_left_;
+        Position bottom_right_;
+    };
+
+    // Both corners are inclusive; a corner past the other gives an empty range
+    Range GetRange(Position top_left, Position bottom_right) const;
+
+    // Calls visitor(pos, cell) for the occupied cells of the range in
+    // row-major order
+    template <typename Visitor>
+    void ForEachInRange(Position top_left, Position bottom_right, Visitor visitor) const {
+        for (RangeEntry entry : GetRange(top_left, bottom_right)) {
+            visitor(entry.pos, *entry.cell);
+        }
+    }
+
+    // Whether the position holds a cell, with or without a Cell object
+    bool Contains(Position pos) const;
+
+    // Cell objects and their contents are allocated from here
+    std::pmr::memory_resource* GetMemoryResource() {
+        return &cell_memory_;
+    }
+
+    // Parsed formulas shared between cells with the same expression
+    FormulaCache& GetFormulaCache() {
+        return formulas_;
+    }
+
+    const FormulaCache& GetFormulaCache() const {
+        return formulas_;
+    }
+
+    // Bytes are those requested from the sheet's pool or from the heap,
+    // without allocator overhead. Reading the stats costs a few additions.
+    struct MemoryStats {
+        struct Part {
+            size_t bytes = 0;
+            size_t objects = 0;
+        };
+
+        Part cells;         // Cell objects with contents; objects are cells
+        Part numbers;       // numeric columns; objects are stored numbers
+        Part texts;         // interned texts and their index; objects are unique texts
+        Part formulas;      // formulas and AST nodes; objects are allocations
+        Part dependencies;  // dependency graph; objects are edges
+        Part cache;         // value cache; objects are entries
+        Part grid;          // tiles of the cell grid; objects are tiles
+        Part occupancy;     // fixed per-row and per-column counters
+        Part aggregates;    // aggregate index; objects are indexed columns
+        Part views;         // views of numbers handed out by GetCell; objects are views
+
+        size_t GetTotalBytes() const {
+            return cells.bytes + numbers.bytes + texts.bytes + formulas.bytes + dependencies.bytes
+                 + cache.bytes + grid.bytes + occupancy.bytes + aggregates.bytes + views.bytes;
+        }
+    };
+
+    MemoryStats GetMemoryStats() const;
+
+    // Texts of all text cells; GetSavedBytes() shows the effect of sharing
+    StringPool& GetStringPool() {
+        return strings_;
+    }
+
+    const StringPool& GetStringPool() const {
+        return strings_;
+    }
+
+    // Edges between formulas and the cells they refer to
+    DependencyGraph& GetDependencyGraph() {
+        return dependency_graph_;
+    }
+
+    const DependencyGraph& GetDependencyGraph() const {
+        return dependency_graph_;
+    }
+
 private:
-    std::unordered_map<Position, std::unique_ptr<CellInterface>, PositionHasher> pos_to_cell_;
-    Size printable_size_;
-    std::array<std::optional<uint16_t>, Position::MAX_ROWS> max_in_col_;
-    std::array<std::optional<uint16_t>, Position::MAX_COLS> max_in_row_;
+    // Everything is allocated from this pool, through
+    // a counting resource per part of the sheet. The pool and the counters
+    // have to outlive every container below, so they are declared first.
+    std::pmr::unsynchronized_pool_resource memory_;
+    CountingResource cell_memory_{&memory_};
+    CountingResource formula_memory_{&memory_};
+    CountingResource text_memory_{&memory_};
+    CountingResource number_memory_{&memory_};
+    CountingResource dependency_memory_{&memory_};
+    CountingResource cache_memory_{&memory_};
+    CountingResource aggregate_memory_{&memory_};
+    CountingResource grid_memory_{&memory_};
+    // views are created by const reads
+    mutable CountingResource view_memory_{&memory_};
+
+    StringPool strings_{&text_memory_};
+    FormulaCache formulas_{&formula_memory_};
+    // text and formula cells; integer literals live in numbers_ without a Cell
+    TiledGrid<PmrPtr<Cell>> cells_{&grid_memory_};
+    NumericColumns numbers_{&number_memory_};
+    DependencyGraph dependency_graph_{&dependency_memory_};
+    OccupancyIndex row_occupancy_;
+    OccupancyIndex col_occupancy_;
+
+    FlatPositionMap<std::optional<CellInterface::Value>> cache_{&cache_memory_};
+    // grows on reads: columns are added by the first query over them
+    mutable AggregateIndex aggregates_{&aggregate_memory_};
+    EvaluationMode evaluation_mode_ = EvaluationMode::Eager;
+    // one per number asked for through GetCell, placed in view_memory_
+    mutable FlatPositionMap<NumberCell*> number_views_{&view_memory_};
 
-    std::unordered_map<Position, std::optional<CellInterface::Value>, PositionHasher> cache_;
-    std::unordered_set<Cell*> visited_;
-    std::deque<Cell*> stack_;
+    template <typename Print>
+    void PrintCells(std::ostream& output, Print print) const;
 
     void InvalidateCache(Position pos);
+    // Makes the formulas depending on pos stale, directly or through
+    // other formulas, stopping at those that are stale already
+    void MarkDependentsStale(Position pos);
+    bool IsStale(Position pos) const;
+    // Brings the aggregate index up to date with the cell at pos
+    void IndexCell(Position pos) const;
+    void IndexColumn(int col) const;
+    void InsertFormula(Position pos, FormulaCache::Handle formula);
+    // Frees the view of the number at pos; called before the number changes
+    void DropNumberView(Position pos);
 };
\ No newline at end of file
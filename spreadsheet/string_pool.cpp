@@ -0,0 +1,87 @@
+#include "string_pool.h"
+
+#include <cstring>
+#include <utility>
+
+StringPool::Handle::Handle(StringPool* pool, Entry* entry)
+    : pool_(pool)
+    , entry_(entry) {
+}
+
+StringPool::Handle::Handle(const Handle& other)
+    : pool_(other.pool_)
+    , entry_(other.entry_) {
+    if (entry_ != nullptr) {
+        pool_->AddRef(entry_);
+    }
+}
+
+StringPool::Handle::Handle(Handle&& other) noexcept
+    : pool_(std::exchange(other.pool_, nullptr))
+    , entry_(std::exchange(other.entry_, nullptr)) {
+}
+
+StringPool::Handle& StringPool::Handle::operator=(Handle other) noexcept {
+    std::swap(pool_, other.pool_);
+    std::swap(entry_, other.entry_);
+    return *this;
+}
+
+StringPool::Handle::~Handle() {
+    if (entry_ != nullptr) {
+        pool_->Release(entry_);
+    }
+}
+
+std::string_view StringPool::Handle::View() const {
+    if (entry_ == nullptr) {
+        return {};
+    }
+    return {entry_->Data(), entry_->size};
+}
+
+const char* StringPool::Handle::CStr() const {
+    return entry_ == nullptr ? "" : entry_->Data();
+}
+
+StringPool::StringPool(std::pmr::memory_resource* resource)
+    : resource_(resource)
+    , entries_(resource) {
+}
+
+StringPool::Handle StringPool::Intern(std::string_view text) {
+    if (text.empty()) {
+        return {};
+    }
+
+    if (auto it = entries_.find(text); it != entries_.end()) {
+        AddRef(it->second);
+        return Handle(this, it->second);
+    }
+
+    void* memory = resource_->allocate(sizeof(Entry) + text.size() + 1, alignof(Entry));
+    Entry* entry = new (memory) Entry{0, static_cast<uint32_t>(text.size())};
+    std::memcpy(entry->Data(), text.data(), text.size());
+    entry->Data()[text.size()] = '\0';
+
+    entries_.emplace(std::string_view(entry->Data(), entry->size), entry);
+    stored_bytes_ += entry->size;
+    AddRef(entry);
+    return Handle(this, entry);
+}
+
+void StringPool::AddRef(Entry* entry) {
+    ++entry->refs;
+    referenced_bytes_ += entry->size;
+}
+
+void StringPool::Release(Entry* entry) {
+    referenced_bytes_ -= entry->size;
+    if (--entry->refs > 0) {
+        return;
+    }
+
+    entries_.erase(std::string_view(entry->Data(), entry->size));
+    stored_bytes_ -= entry->size;
+    resource_->deallocate(entry, sizeof(Entry) + entry->size + 1, alignof(Entry));
+}
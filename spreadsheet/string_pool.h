@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <string_view>
+#include <unordered_map>
+
+// Interning pool for cell texts: equal strings share one immutable,
+// reference-counted buffer. A buffer is returned to the memory resource
+// when its last handle goes away.
+class StringPool {
+    struct Entry;
+
+public:
+    class Handle {
+    public:
+        Handle() = default;
+        Handle(const Handle& other);
+        Handle(Handle&& other) noexcept;
+        Handle& operator=(Handle other) noexcept;
+        ~Handle();
+
+        std::string_view View() const;
+        // Null-terminated, never nullptr
+        const char* CStr() const;
+
+        bool operator==(const Handle& other) const {
+            return entry_ == other.entry_;
+        }
+
+    private:
+        friend class StringPool;
+
+        StringPool* pool_ = nullptr;
+        Entry* entry_ = nullptr;
+
+        Handle(StringPool* pool, Entry* entry);
+    };
+
+    explicit StringPool(std::pmr::memory_resource* resource);
+    StringPool(const StringPool&) = delete;
+    StringPool& operator=(const StringPool&) = delete;
+
+    // The empty string is represented by a null handle and is not stored
+    Handle Intern(std::string_view text);
+
+    size_t GetUniqueCount() const {
+        return entries_.size();
+    }
+
+    // Payload bytes held by the pool
+    size_t GetStoredBytes() const {
+        return stored_bytes_;
+    }
+
+    // Payload bytes every handle would hold with its own copy
+    size_t GetReferencedBytes() const {
+        return referenced_bytes_;
+    }
+
+    size_t GetSavedBytes() const {
+        return referenced_bytes_ - stored_bytes_;
+    }
+
+private:
+    struct Entry {
+        uint32_t refs;
+        uint32_t size;
+        // followed by size characters and a terminating zero
+        char* Data() {
+            return reinterpret_cast<char*>(this + 1);
+        }
+    };
+
+    std::pmr::memory_resource* resource_;
+    std::pmr::unordered_map<std::string_view, Entry*> entries_;
+    size_t stored_bytes_ = 0;
+    size_t referenced_bytes_ = 0;
+
+    void AddRef(Entry* entry);
+    void Release(Entry* entry);
+};
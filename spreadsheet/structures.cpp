@@ -1,12 +1,11 @@
 #include "common.h"
 
-#include <cctype>
 #include <sstream>
-#include <regex>
 
 const int LETTERS = 26;
 const int MAX_POSITION_LENGTH = 17;
 const int MAX_POS_LETTER_COUNT = 3;
+const int MAX_POS_DIGIT_COUNT = 5;
 const int ASCII_TABLE_A_INDEX = 65;
 
 using namespace std::string_literals;
@@ -60,38 +59,33 @@ std::string Position::ToString() const {
     }
 }
 
+// Accepts 1 to 3 capital letters up to XFD and then a row number from 1 to
+// 16384 without leading zeros, nothing else
 Position Position::FromString(std::string_view str) {
-    static const std::regex r(R"(^([A-Z]?[A-Z]|[A-W][A-Z]{2}|X[A-E][A-Z]|XF[A-D])([1-9]|[1-9][0-9]{1,3}|1[0-5][0-9]{3}|16[0-2][0-9]{2}|163[0-7][0-9]|1638[0-4])$)");
-    if (!std::regex_match(str.data(), r)) {
+    size_t i = 0;
+    int col = 0;
+    for (; i < str.size() && i < static_cast<size_t>(MAX_POS_LETTER_COUNT) && str[i] >= 'A' && str[i] <= 'Z'; ++i) {
+        col = col * LETTERS + (str[i] - 'A' + 1);
+    }
+    if (i == 0 || i == str.size() || str[i] == '0' || str.size() - i > static_cast<size_t>(MAX_POS_DIGIT_COUNT)) {
         return Position::NONE;
-    } else {
-        Position pos;
-        size_t digit_pos;
-        for (size_t i = 0; i < str.size(); ++i) {
-            if (std::isdigit(static_cast<unsigned char>(str.at(i)))) {
-                digit_pos = i;
-                break;
-            }           
-        }
+    }
 
-        std::vector<int> num;
-        num.reserve(5);
-        for (size_t i = 0; i < digit_pos; ++i) {
-            num.push_back(static_cast<char>(str.at(i)) - ASCII_TABLE_A_INDEX + 1);
+    int row = 0;
+    for (; i < str.size(); ++i) {
+        if (str[i] < '0' || str[i] > '9') {
+            return Position::NONE;
         }
-
-        int value = 0, base = 1; 
-        while (num.size() > 0) {    
-            value += num.back() * base; 
-            base = base * LETTERS; 
-            num.pop_back();
-        }       
-    
-        pos.col = value - 1;
-        pos.row = std::atoi(str.substr(digit_pos, str.npos).data()) - 1;
-
-        return pos;
+        row = row * 10 + (str[i] - '0');
     }
+    if (col > MAX_COLS || row > MAX_ROWS) {
+        return Position::NONE;
+    }
+    return {row - 1, col - 1};
+}
+
+std::string PositionRange::ToString() const {
+    return top_left.ToString() + ':' + bottom_right.ToString();
 }
 
 bool Size::operator==(Size rhs) const {
@@ -0,0 +1,307 @@
+#pragma once
+
+#include "common.h"
+#include "occupancy_index.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <new>
+
+// Two-dimensional sparse storage split into TILE_SIDE x TILE_SIDE blocks.
+// Tiles are addressed through a two-level directory whose rows are only as
+// long as the tile columns in use. A row of a tile keeps just its occupied
+// slots, in column order, so a slot is found by counting the occupied bits
+// to its left and a tall single column costs a slot per cell rather than a
+// full row. Directory rows, tiles and rows of slots are taken from the
+// memory resource on first write, grow by doubling and are returned when
+// they become empty. Insert and Erase move the other slots of the row, so
+// a pointer to a slot is valid only until the grid changes.
+template <typename T>
+class TiledGrid {
+public:
+    static constexpr int TILE_SHIFT = 6;
+    static constexpr int TILE_SIDE = 1 << TILE_SHIFT;
+    static constexpr int TILE_MASK = TILE_SIDE - 1;
+    static constexpr int TILE_ROWS = Position::MAX_ROWS / TILE_SIDE;
+    static constexpr int TILE_COLS = Position::MAX_COLS / TILE_SIDE;
+
+    explicit TiledGrid(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : resource_(resource) {
+    }
+
+    TiledGrid(const TiledGrid&) = delete;
+    TiledGrid& operator=(const TiledGrid&) = delete;
+
+    ~TiledGrid() {
+        for (TileRow& tile_row : directory_) {
+            for (int i = 0; i < tile_row.size; ++i) {
+                Tile* tile = tile_row.tiles[i];
+                if (tile == nullptr) {
+                    continue;
+                }
+                for (int row = 0; row < TILE_SIDE; ++row) {
+                    if (tile->rows[row] != nullptr) {
+                        DeleteArray(tile->rows[row], tile->capacity[row]);
+                    }
+                }
+                Delete(tile);
+            }
+            if (tile_row.tiles != nullptr) {
+                DeleteArray(tile_row.tiles, tile_row.size);
+            }
+        }
+    }
+
+    const T* Find(Position pos) const {
+        const Tile* tile = FindTile(pos);
+        if (tile == nullptr || !tile->IsOccupied(pos)) {
+            return nullptr;
+        }
+        return &tile->At(pos);
+    }
+
+    T* Find(Position pos) {
+        return const_cast<T*>(static_cast<const TiledGrid&>(*this).Find(pos));
+    }
+
+    // Stores the value, replacing the previous one if the slot is occupied
+    T& Insert(Position pos, T value) {
+        Tile& tile = GetOrCreateTile(pos);
+        const int row = pos.row & TILE_MASK;
+        const int index = Rank(tile.occupied[row], pos.col & TILE_MASK);
+        if (tile.IsOccupied(pos)) {
+            T& slot = tile.rows[row][index];
+            slot = std::move(value);
+            return slot;
+        }
+
+        const int count = PopCount(tile.occupied[row]);
+        if (count == tile.capacity[row]) {
+            GrowRow(tile, row, count);
+        }
+        T* slots = tile.rows[row];
+        std::move_backward(slots + index, slots + count, slots + count + 1);
+        slots[index] = std::move(value);
+        tile.SetOccupied(pos, true);
+        ++tile.count;
+        ++size_;
+        return slots[index];
+    }
+
+    bool Erase(Position pos) {
+        TileRow& tile_row = directory_[pos.row >> TILE_SHIFT];
+        const int tile_col = pos.col >> TILE_SHIFT;
+        if (tile_col >= tile_row.size) {
+            return false;
+        }
+        Tile*& tile = tile_row.tiles[tile_col];
+        if (tile == nullptr || !tile->IsOccupied(pos)) {
+            return false;
+        }
+
+        const int row = pos.row & TILE_MASK;
+        const int index = Rank(tile->occupied[row], pos.col & TILE_MASK);
+        const int count = PopCount(tile->occupied[row]);
+        T* slots = tile->rows[row];
+        // the value at pos is overwritten by its right neighbour
+        std::move(slots + index + 1, slots + count, slots + index);
+        slots[count - 1] = T{};
+        tile->SetOccupied(pos, false);
+        --size_;
+        if (count == 1) {
+            DeleteArray(slots, tile->capacity[row]);
+            slot_count_ -= tile->capacity[row];
+            tile->rows[row] = nullptr;
+            tile->capacity[row] = 0;
+        }
+        if (--tile->count == 0) {
+            Delete(tile);
+            tile = nullptr;
+            --tile_count_;
+            if (--tile_row.count == 0) {
+                DeleteArray(tile_row.tiles, tile_row.size);
+                tile_pointer_count_ -= tile_row.size;
+                tile_row = TileRow{};
+            }
+        }
+        return true;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    size_t GetTileCount() const {
+        return tile_count_;
+    }
+
+    // Rows of slots, tiles, directory rows and the directory itself
+    size_t GetAllocatedBytes() const {
+        return sizeof(directory_) + tile_pointer_count_ * sizeof(Tile*) + tile_count_ * sizeof(Tile)
+             + slot_count_ * sizeof(T);
+    }
+
+    // Calls visitor(pos, value) for every occupied slot of the rectangle.
+    // Missing tiles are skipped whole and rows are walked by their masks;
+    // the order is row-major within a tile, tile by tile.
+    template <typename Visitor>
+    void ForEachInRect(Position top_left, Position bottom_right, Visitor visitor) const {
+        for (int tile_row = top_left.row >> TILE_SHIFT; tile_row <= bottom_right.row >> TILE_SHIFT; ++tile_row) {
+            const TileRow& tiles = directory_[tile_row];
+            const int first_row = std::max(top_left.row, tile_row << TILE_SHIFT);
+            const int last_row = std::min(bottom_right.row, (tile_row << TILE_SHIFT) | TILE_MASK);
+            const int last_tile_col = std::min(bottom_right.col >> TILE_SHIFT, tiles.size - 1);
+            for (int tile_col = top_left.col >> TILE_SHIFT; tile_col <= last_tile_col; ++tile_col) {
+                const Tile* tile = tiles.tiles[tile_col];
+                if (tile == nullptr) {
+                    continue;
+                }
+                const int base_col = tile_col << TILE_SHIFT;
+                const int first_col = std::max(top_left.col, base_col) - base_col;
+                const uint64_t col_mask = RangeMask(first_col, std::min(bottom_right.col, base_col | TILE_MASK) - base_col);
+                for (int row = first_row; row <= last_row; ++row) {
+                    const uint64_t occupied = tile->occupied[row & TILE_MASK];
+                    uint64_t bits = occupied & col_mask;
+                    if (bits == 0) {
+                        continue;
+                    }
+                    // the slots of the rectangle are consecutive in the row
+                    const T* slot = tile->rows[row & TILE_MASK] + Rank(occupied, first_col);
+                    for (; bits != 0; bits &= bits - 1, ++slot) {
+                        visitor(Position{row, base_col + CountTrailingZeros(bits)}, *slot);
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    struct Tile {
+        // occupied slots of the row in column order, allocated while there is one
+        std::array<T*, TILE_SIDE> rows{};
+        // bit per column for each row of the tile
+        std::array<uint64_t, TILE_SIDE> occupied{};
+        // slots allocated for each row
+        std::array<uint8_t, TILE_SIDE> capacity{};
+        int count = 0;
+
+        // only for an occupied position
+        T& At(Position pos) {
+            return rows[pos.row & TILE_MASK][Rank(occupied[pos.row & TILE_MASK], pos.col & TILE_MASK)];
+        }
+
+        const T& At(Position pos) const {
+            return rows[pos.row & TILE_MASK][Rank(occupied[pos.row & TILE_MASK], pos.col & TILE_MASK)];
+        }
+
+        bool IsOccupied(Position pos) const {
+            return (occupied[pos.row & TILE_MASK] >> (pos.col & TILE_MASK)) & 1u;
+        }
+
+        void SetOccupied(Position pos, bool value) {
+            uint64_t bit = uint64_t{1} << (pos.col & TILE_MASK);
+            if (value) {
+                occupied[pos.row & TILE_MASK] |= bit;
+            } else {
+                occupied[pos.row & TILE_MASK] &= ~bit;
+            }
+        }
+    };
+
+    // Tiles of a row of the directory, from tile column 0 to size - 1
+    struct TileRow {
+        Tile** tiles = nullptr;
+        int size = 0;
+        // tiles that are not null
+        int count = 0;
+    };
+
+    std::pmr::memory_resource* resource_;
+    std::array<TileRow, TILE_ROWS> directory_{};
+    size_t size_ = 0;
+    size_t tile_count_ = 0;
+    size_t tile_pointer_count_ = 0;
+    size_t slot_count_ = 0;
+
+    // bits first..last set
+    static uint64_t RangeMask(int first, int last) {
+        const uint64_t upto_last = last == TILE_MASK ? ~uint64_t{0} : (uint64_t{1} << (last + 1)) - 1;
+        return upto_last & ~((uint64_t{1} << first) - 1);
+    }
+
+    // index of the slot of column col among the occupied slots of a row
+    static int Rank(uint64_t occupied, int col) {
+        return PopCount(occupied & ((uint64_t{1} << col) - 1));
+    }
+
+    const Tile* FindTile(Position pos) const {
+        const TileRow& tile_row = directory_[pos.row >> TILE_SHIFT];
+        const int tile_col = pos.col >> TILE_SHIFT;
+        return tile_col < tile_row.size ? tile_row.tiles[tile_col] : nullptr;
+    }
+
+    Tile& GetOrCreateTile(Position pos) {
+        TileRow& tile_row = directory_[pos.row >> TILE_SHIFT];
+        const int tile_col = pos.col >> TILE_SHIFT;
+        if (tile_col >= tile_row.size) {
+            const int size = std::min(std::max(tile_col + 1, tile_row.size * 2), TILE_COLS);
+            Tile** tiles = NewArray<Tile*>(size);
+            if (tile_row.tiles != nullptr) {
+                std::copy_n(tile_row.tiles, tile_row.size, tiles);
+                DeleteArray(tile_row.tiles, tile_row.size);
+            }
+            tile_pointer_count_ += size - tile_row.size;
+            tile_row.tiles = tiles;
+            tile_row.size = size;
+        }
+        Tile*& tile = tile_row.tiles[tile_col];
+        if (tile == nullptr) {
+            tile = New<Tile>();
+            ++tile_count_;
+            ++tile_row.count;
+        }
+        return *tile;
+    }
+
+    // Makes room for one more slot in a full row of count slots
+    void GrowRow(Tile& tile, int row, int count) {
+        const int capacity = count == 0 ? 1 : std::min(count * 2, TILE_SIDE);
+        T* slots = NewArray<T>(capacity);
+        if (tile.rows[row] != nullptr) {
+            std::move(tile.rows[row], tile.rows[row] + count, slots);
+            DeleteArray(tile.rows[row], tile.capacity[row]);
+        }
+        slot_count_ += capacity - tile.capacity[row];
+        tile.rows[row] = slots;
+        tile.capacity[row] = static_cast<uint8_t>(capacity);
+    }
+
+    template <typename U>
+    U* New() {
+        void* memory = resource_->allocate(sizeof(U), alignof(U));
+        return new (memory) U{};
+    }
+
+    template <typename U>
+    void Delete(U* object) {
+        object->~U();
+        resource_->deallocate(object, sizeof(U), alignof(U));
+    }
+
+    // count value-initialised objects
+    template <typename U>
+    U* NewArray(int count) {
+        U* array = static_cast<U*>(resource_->allocate(count * sizeof(U), alignof(U)));
+        std::uninitialized_value_construct_n(array, count);
+        return array;
+    }
+
+    template <typename U>
+    void DeleteArray(U* array, int count) {
+        std::destroy_n(array, count);
+        resource_->deallocate(array, count * sizeof(U), alignof(U));
+    }
+};